@@ -0,0 +1,238 @@
+/*
+ * bench.c
+ *
+ * Benchmarks of the USB host data path
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "bulk.h"
+#include "packets.h"
+#include "simple_spi.h"
+#include "descriptors.h"
+#include "nrf.h"
+#include "app_scheduler.h"
+#include "nrf_pwr_mgmt.h"
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static void _timerStart(void);
+static uint32_t _timerNow(void);
+static void _resetResult(BenchResult *, char const *);
+static uint32_t _spiBytes(void);
+static void _wait(void);
+static void _percentiles(BenchResult *, uint32_t *, uint_fast16_t);
+
+/* TIMER2 counting us; TIMER0 belongs to the SoftDevice, TIMER1 is free for the application */
+static BenchClock const timerClock = { _timerStart, _timerNow };
+static BenchClock const * benchClock = &timerClock;
+
+static uint32_t samples[BENCH_MAX_SAMPLES];
+static uint_fast8_t rxBuffer[BUFFER_SIZE];
+
+/* PUBLIC FUNCTIONS */
+
+void BENCH_setClock(BenchClock const * newClock) {
+	benchClock = newClock ? newClock : &timerClock;
+}
+
+void BENCH_start(void) {
+	benchClock->start();
+}
+
+uint32_t BENCH_now(void) {
+	return benchClock->now();
+}
+
+void BENCH_enumeration(BenchResult * result) {
+	EnumerationTiming timing;
+
+	_resetResult(result, "enumeration");
+	USB_getEnumerationTiming(&timing);
+	result->count = 1;
+	result->elapsedUs = timing.totalMs * 1000;
+}
+
+void BENCH_bulkIn(uint_fast8_t address, uint_fast8_t ep, uint32_t bytes, BenchResult * result) {
+	BulkPacket const * packet;
+	BulkStreamStatus status;
+	uint32_t start, lastData, spiStart;
+	uint_fast8_t it;
+
+	_resetResult(result, "bulk_in");
+	spiStart = _spiBytes();
+	start = lastData = BENCH_now();
+
+	/* A token of an earlier stream may still be on the wire */
+	while ((result->status = BULK_startStream(address, ep)) == rslBUSY && BENCH_now() - start < BENCH_TIMEOUT_US)
+		_wait();
+	if (result->status)
+		return;
+	start = lastData = BENCH_now();
+
+	while (result->bytes < bytes) {
+		while ((packet = BULK_peekPacket()) != NULL && result->bytes < bytes) {
+			for (it = 0; it < packet->length; it++) {
+				if (packet->data[it] > 9)
+					result->errors++;
+			}
+			result->bytes += packet->length;
+			result->count++;
+			BULK_releasePacket();
+			lastData = BENCH_now();
+		}
+		if (result->bytes >= bytes)
+			break;
+
+		/* The stream stops itself on anything but ACK and NAK */
+		BULK_getStreamStatus(&status);
+		if (!status.running) {
+			result->status = status.lastResult;
+			break;
+		}
+		if (BENCH_now() - lastData > BENCH_TIMEOUT_US) {
+			result->status = rslTIMEOUT;
+			break;
+		}
+		_wait();
+	}
+
+	result->elapsedUs = BENCH_now() - start;
+	BULK_stopStream();
+
+	/* Drop what arrived past the end, so the next benchmark starts with an empty ring */
+	while (BULK_peekPacket() != NULL)
+		BULK_releasePacket();
+	result->spiBytes = _spiBytes() - spiStart;
+}
+
+void BENCH_latency(uint_fast8_t address, uint_fast8_t ep, uint_fast16_t count, BenchResult * result) {
+	uint32_t start, transactionStart, spiStart;
+	uint_fast16_t it, kept = 0;
+	uint_fast8_t status, length;
+
+	_resetResult(result, "latency_in");
+	spiStart = _spiBytes();
+	start = BENCH_now();
+
+	for (it = 0; it < count; it++) {
+		transactionStart = BENCH_now();
+		status = transmitPacket(address, xfrIN, ep);
+		if (status) {
+			result->errors++;
+			result->status = status;
+			continue;
+		}
+
+		length = MIN(MAX_readRegister(rRCVBC), BUFFER_SIZE);
+		MAX_multiReadRegister(rRCVFIFO, rxBuffer, length);
+		MAX_writeRegister(rHIRQ, MAX_IRQ_RCVDAV);
+
+		/* The INT edges of the transaction were posted to the scheduler; run them before
+		 * its queue fills up */
+		app_sched_execute();
+
+		if (kept < BENCH_MAX_SAMPLES)
+			samples[kept++] = BENCH_now() - transactionStart;
+		result->bytes += length;
+		result->count++;
+	}
+
+	result->elapsedUs = BENCH_now() - start;
+	result->spiBytes = _spiBytes() - spiStart;
+	_percentiles(result, samples, kept);
+
+	/* Errors are counted; the status only says whether none got through at all */
+	if (result->count)
+		result->status = rslSUCCES;
+}
+
+void BENCH_print(BenchResult const * result) {
+	/* The ratio in thousandths, the printf of newlib-nano has no floats */
+	uint32_t bytesPerSecond = result->elapsedUs ? (uint32_t)((uint64_t) result->bytes * 1000000 / result->elapsedUs) : 0;
+	uint32_t spiPerUsb = result->bytes ? (uint32_t)((uint64_t) result->spiBytes * 1000 / result->bytes) : 0;
+
+	printf("{\"bench\":\"%s\",\"build\":\"%s\",\"status\":%u,\"count\":%lu,\"bytes\":%lu,"
+	       "\"elapsed_us\":%lu,\"bytes_per_s\":%lu,\"p50_us\":%lu,\"p99_us\":%lu,\"max_us\":%lu,"
+	       "\"spi_bytes\":%lu,\"spi_per_usb_milli\":%lu,\"errors\":%lu}\n",
+	       result->name, BENCH_BUILD, (unsigned) result->status,
+	       (unsigned long) result->count, (unsigned long) result->bytes,
+	       (unsigned long) result->elapsedUs, (unsigned long) bytesPerSecond,
+	       (unsigned long) result->p50Us, (unsigned long) result->p99Us, (unsigned long) result->maxUs,
+	       (unsigned long) result->spiBytes, (unsigned long) spiPerUsb, (unsigned long) result->errors);
+}
+
+void BENCH_runSuite(USBDevice const * device) {
+	EndpointInfo const * endpoint;
+	BenchResult result;
+
+	BENCH_start();
+	BENCH_enumeration(&result);
+	BENCH_print(&result);
+
+	endpoint = DESC_findEndpoint(&device->model, epBULK, true);
+	if (!endpoint)
+		return;
+
+	BENCH_bulkIn(device->address, endpoint->address & 0x0F, BENCH_BULK_BYTES, &result);
+	BENCH_print(&result);
+
+	BENCH_latency(device->address, endpoint->address & 0x0F, BENCH_LATENCY_SAMPLES, &result);
+	BENCH_print(&result);
+}
+
+/* PRIVATE FUNCTIONS */
+
+static void _timerStart(void) {
+	NRF_TIMER2->TASKS_STOP = 1;
+	NRF_TIMER2->MODE = TIMER_MODE_MODE_Timer;
+	NRF_TIMER2->BITMODE = TIMER_BITMODE_BITMODE_32Bit;
+	NRF_TIMER2->PRESCALER = 4;      /* 16 MHz / 2^4 */
+	NRF_TIMER2->TASKS_CLEAR = 1;
+	NRF_TIMER2->TASKS_START = 1;
+}
+
+static uint32_t _timerNow(void) {
+	NRF_TIMER2->TASKS_CAPTURE[0] = 1;
+	return NRF_TIMER2->CC[0];
+}
+
+static void _resetResult(BenchResult * result, char const * name) {
+	memset(result, 0, sizeof(BenchResult));
+	result->name = name;
+}
+
+static uint32_t _spiBytes(void) {
+	SPIStats stats;
+
+	SIMSPI_getStats(&stats);
+	return stats.bytes;
+}
+
+/* Let the stream's scheduled work run, then sleep until the next interrupt */
+static void _wait(void) {
+	app_sched_execute();
+	nrf_pwr_mgmt_run();
+}
+
+/* Sorts the samples in place; there are few enough for an insertion sort */
+static void _percentiles(BenchResult * result, uint32_t * values, uint_fast16_t count) {
+	uint_fast16_t it, slot;
+	uint32_t value;
+
+	if (!count)
+		return;
+
+	for (it = 1; it < count; it++) {
+		value = values[it];
+		for (slot = it; slot > 0 && values[slot - 1] > value; slot--)
+			values[slot] = values[slot - 1];
+		values[slot] = value;
+	}
+
+	result->p50Us = values[(count - 1) * 50 / 100];
+	result->p99Us = values[(count - 1) * 99 / 100];
+	result->maxUs = values[count - 1];
+}
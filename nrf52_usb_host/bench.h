@@ -0,0 +1,127 @@
+#pragma once
+/*
+ * bench.h
+ *
+ * Benchmarks of the USB host data path: enumeration time, bulk IN throughput, the latency
+ * distribution of single transactions and the SPI traffic per USB byte. Results are
+ * printed one JSON object per line, so runs of two builds can be diffed. Time comes from
+ * TIMER2 on the target, or from another clock such as the MAX3421E model's (max_sim.h).
+ * The suite blocks the main loop for seconds, so the firmware only runs it when built
+ * with BENCH_ENABLED 1; host/bench_sim runs it on the model
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usb.h"
+
+#ifndef BENCH_ENABLED
+#define BENCH_ENABLED           0
+#endif
+
+/* Bytes the bulk IN benchmark streams */
+#define BENCH_BULK_BYTES        64000UL
+
+/* Transactions the latency benchmark times */
+#define BENCH_LATENCY_SAMPLES   200
+
+/* Latency samples that are kept for the percentiles */
+#define BENCH_MAX_SAMPLES       256
+
+/* A benchmark gives up when no data arrived for this long (us) */
+#define BENCH_TIMEOUT_US        2000000UL
+
+/* Printed with every result; override with e.g. -DBENCH_BUILD=\"<git hash>\" */
+#ifndef BENCH_BUILD
+#define BENCH_BUILD             __DATE__ " " __TIME__
+#endif
+
+/* Where the timestamps come from */
+typedef struct {
+	void(*start)(void);
+	uint32_t(*now)(void);       /* us */
+} BenchClock;
+
+typedef struct {
+	char const * name;
+	uint_fast8_t status;        /* rslSUCCES, or the result code that ended the benchmark */
+	uint32_t count;             /* transactions or packets measured */
+	uint32_t bytes;             /* USB payload bytes */
+	uint32_t elapsedUs;
+	uint32_t p50Us;             /* per transaction, 0 if not measured */
+	uint32_t p99Us;
+	uint32_t maxUs;
+	uint32_t spiBytes;          /* SPI bytes clocked during the benchmark */
+	uint32_t errors;            /* failed transactions or corrupt data */
+} BenchResult;
+
+/**
+ * Replace the clock. Must be called before BENCH_start
+ *
+ * Parameters:
+ * BenchClock const * clock: the new clock, or NULL to restore the TIMER2 one
+ */
+void BENCH_setClock(BenchClock const *);
+
+/**
+ * Start the clock
+ */
+void BENCH_start(void);
+
+/**
+ * Get a timestamp
+ *
+ * Returns:
+ * uint32_t: us since BENCH_start
+ */
+uint32_t BENCH_now(void);
+
+/**
+ * Report how long the last enumeration took
+ *
+ * Parameters:
+ * BenchResult * result: filled in with the enumeration time
+ */
+void BENCH_enumeration(BenchResult *);
+
+/**
+ * Stream from a bulk IN endpoint and measure the throughput. The data is checked against
+ * the 0..9 pattern of the bench device. Must be called from thread mode, outside the
+ * scheduler; it runs the scheduler while waiting
+ *
+ * Parameters:
+ * uint_fast8_t address: the device address
+ * uint_fast8_t ep: the endpoint number
+ * uint32_t bytes: the number of bytes to receive
+ * BenchResult * result: filled in with the measurement
+ */
+void BENCH_bulkIn(uint_fast8_t, uint_fast8_t, uint32_t, BenchResult *);
+
+/**
+ * Time single IN transactions, from the token to the data read out of the RCVFIFO. Must
+ * be called from thread mode, outside the scheduler
+ *
+ * Parameters:
+ * uint_fast8_t address: the device address
+ * uint_fast8_t ep: the endpoint number
+ * uint_fast16_t count: the number of transactions (at most BENCH_MAX_SAMPLES are kept)
+ * BenchResult * result: filled in with the measurement
+ */
+void BENCH_latency(uint_fast8_t, uint_fast8_t, uint_fast16_t, BenchResult *);
+
+/**
+ * Print a result as a line of JSON
+ *
+ * Parameters:
+ * BenchResult const * result: the result
+ */
+void BENCH_print(BenchResult const *);
+
+/**
+ * Run and print all benchmarks that apply to a configured device. Must be called from
+ * thread mode, not from a scheduler event: the benchmarks run the scheduler themselves
+ *
+ * Parameters:
+ * USBDevice const * device: the device
+ */
+void BENCH_runSuite(USBDevice const *);
@@ -0,0 +1,210 @@
+/*
+ * bridge.c
+ *
+ * USB HID to BLE HID bridge. Each USB report is translated straight from the receive
+ * buffer and handed to the motion coalescer from the same callback, which notifies it
+ * right away if a buffer is free
+ */
+
+#include <string.h>
+
+#include "bridge.h"
+#include "motion.h"
+#include "latency.h"
+
+/* Consumer usages of the media player report, in the order of its bits */
+static uint16_t const mediaUsages[BRIDGE_MEDIA_KEYS] = {
+	0x00CD,     /* Play/Pause */
+	0x0183,     /* AL Consumer Control Configuration */
+	0x00B5,     /* Scan Next Track */
+	0x00B6,     /* Scan Previous Track */
+	0x00EA,     /* Volume Down */
+	0x00E9,     /* Volume Up */
+	0x0225,     /* AC Forward */
+	0x0224      /* AC Back */
+};
+
+static BridgeStats stats;
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static bool _read(Bridge const *, int_fast8_t, uint_fast8_t, uint8_t const *, int32_t *);
+static void _readMapped(Bridge const *, uint_fast8_t, uint8_t const *, MotionInput *);
+static uint_fast8_t _mediaKey(uint_fast16_t);
+
+/* PUBLIC FUNCTIONS */
+
+bool BRIDGE_bind(Bridge * bridge, HidReportMap const * map) {
+	HidField const * field;
+	uint_fast8_t it, key;
+	bool relative, array;
+
+	BRIDGE_bindBoot(bridge);
+	memset(bridge->buttons, -1, sizeof(bridge->buttons));
+	memset(bridge->media, -1, sizeof(bridge->media));
+	bridge->x = bridge->y = bridge->wheel = bridge->pan = -1;
+	bridge->map = map;
+
+	for (it = 0; it < map->fieldCount; it++) {
+		field = &map->fields[it];
+		relative = field->flags & HID_FIELD_RELATIVE;
+		array = field->flags & HID_FIELD_ARRAY;
+
+		switch (field->usagePage) {
+		case pageBUTTON:
+			if (!array && field->usage >= 1 && field->usage <= BRIDGE_BUTTONS && bridge->buttons[field->usage - 1] < 0)
+				bridge->buttons[field->usage - 1] = it;
+			break;
+
+		case pageGENERIC_DESKTOP:
+			/* Absolute axes (tablets, joysticks) have no place in a relative mouse report */
+			if (array || !relative)
+				break;
+			if (field->usage == usageX && bridge->x < 0)
+				bridge->x = it;
+			else if (field->usage == usageY && bridge->y < 0)
+				bridge->y = it;
+			else if (field->usage == usageWHEEL && bridge->wheel < 0)
+				bridge->wheel = it;
+			break;
+
+		case pageCONSUMER:
+			if (array) {
+				if (bridge->mediaArrayCount < BRIDGE_MAX_ARRAYS)
+					bridge->mediaArrays[bridge->mediaArrayCount++] = it;
+			}
+			else if (field->usage == usageAC_PAN && relative) {
+				if (bridge->pan < 0)
+					bridge->pan = it;
+			}
+			else if ((key = _mediaKey(field->usage)) < BRIDGE_MEDIA_KEYS && bridge->media[key] < 0) {
+				bridge->media[key] = it;
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	for (it = 0; it < BRIDGE_BUTTONS; it++) {
+		if (bridge->buttons[it] >= 0)
+			return true;
+	}
+	for (it = 0; it < BRIDGE_MEDIA_KEYS; it++) {
+		if (bridge->media[it] >= 0)
+			return true;
+	}
+	return bridge->x >= 0 || bridge->y >= 0 || bridge->wheel >= 0 || bridge->pan >= 0 || bridge->mediaArrayCount;
+}
+
+void BRIDGE_bindBoot(Bridge * bridge) {
+	memset(bridge, 0, sizeof(Bridge));
+}
+
+void BRIDGE_reportReceived(uint8_t const * data, uint_fast8_t length, void * context) {
+	Bridge * bridge = (Bridge *) context;
+	HidReportInfo const * report;
+	HidBootMouseReport boot;
+	MotionInput input;
+
+	/* Fields this report doesn't carry keep their last state */
+	memset(&input, 0, sizeof(input));
+	input.received = LATENCY_now();
+	input.buttons = bridge->lastButtons;
+	input.media = bridge->lastMedia;
+
+	if (bridge->map) {
+		report = HID_findReport(bridge->map, data, length);
+		if (!report || length < report->length) {
+			stats.unknown++;
+			return;
+		}
+		_readMapped(bridge, report->id, data, &input);
+	}
+	else {
+		if (!HID_parseBootMouse(data, length, &boot)) {
+			stats.unknown++;
+			return;
+		}
+		input.buttons = boot.buttons & ((1 << BRIDGE_BUTTONS) - 1);
+		input.x = boot.x;
+		input.y = boot.y;
+		input.wheel = boot.wheel;
+	}
+
+	stats.reports++;
+	bridge->lastButtons = input.buttons;
+	bridge->lastMedia = input.media;
+	MOTION_add(&input);
+}
+
+void BRIDGE_getStats(BridgeStats * result) {
+	*result = stats;
+}
+
+/* PRIVATE FUNCTIONS */
+
+/* Extract a bound field if it is part of the report with this ID */
+static bool _read(Bridge const * bridge, int_fast8_t index, uint_fast8_t id, uint8_t const * data, int32_t * value) {
+	HidField const * field;
+
+	if (index < 0)
+		return false;
+	field = &bridge->map->fields[index];
+	if (field->reportId != id)
+		return false;
+	*value = HID_extractField(field, data);
+	return true;
+}
+
+static void _readMapped(Bridge const * bridge, uint_fast8_t id, uint8_t const * data, MotionInput * input) {
+	HidField const * field;
+	uint_fast8_t it, key;
+	bool mediaSeen = false;
+	uint8_t media = 0;
+	int32_t value;
+
+	for (it = 0; it < BRIDGE_BUTTONS; it++) {
+		if (_read(bridge, bridge->buttons[it], id, data, &value))
+			input->buttons = (input->buttons & ~(1 << it)) | (value ? 1 << it : 0);
+	}
+
+	_read(bridge, bridge->x, id, data, &input->x);
+	_read(bridge, bridge->y, id, data, &input->y);
+	_read(bridge, bridge->wheel, id, data, &input->wheel);
+	_read(bridge, bridge->pan, id, data, &input->pan);
+
+	/* Media keys are rebuilt from scratch by any report that carries them */
+	for (it = 0; it < BRIDGE_MEDIA_KEYS; it++) {
+		if (_read(bridge, bridge->media[it], id, data, &value)) {
+			mediaSeen = true;
+			media |= value ? 1 << it : 0;
+		}
+	}
+	for (it = 0; it < bridge->mediaArrayCount; it++) {
+		if (!_read(bridge, bridge->mediaArrays[it], id, data, &value))
+			continue;
+		mediaSeen = true;
+
+		/* An array slot holds the index of the pressed usage in the field's range */
+		field = &bridge->map->fields[bridge->mediaArrays[it]];
+		if (value < field->logicalMin || value > field->logicalMax)
+			continue;
+		key = _mediaKey(field->usage + (value - field->logicalMin));
+		if (key < BRIDGE_MEDIA_KEYS)
+			media |= 1 << key;
+	}
+	if (mediaSeen)
+		input->media = media;
+}
+
+static uint_fast8_t _mediaKey(uint_fast16_t usage) {
+	uint_fast8_t key;
+
+	for (key = 0; key < BRIDGE_MEDIA_KEYS; key++) {
+		if (mediaUsages[key] == usage)
+			break;
+	}
+	return key;
+}
@@ -0,0 +1,79 @@
+#pragma once
+/*
+ * bridge.h
+ *
+ * USB HID to BLE HID bridge: turns the input reports of an attached mouse into the
+ * buttons, movement and media player reports of the BLE HID service
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hidreport.h"
+
+/* Buttons and media keys of the BLE report map (hids_init in nrf_services.c) */
+#define BRIDGE_BUTTONS          5
+#define BRIDGE_MEDIA_KEYS       8
+
+/* Consumer page array fields (key slots) that are checked for media keys */
+#define BRIDGE_MAX_ARRAYS       4
+
+typedef struct {
+	uint32_t reports;           /* USB reports translated */
+	uint32_t unknown;           /* USB reports that are not in the map, or too short */
+} BridgeStats;
+
+/* Where each BLE input comes from: indices into the report map, -1 if the device lacks it */
+typedef struct {
+	HidReportMap const * map;   /* NULL for the fixed boot mouse layout */
+	int8_t buttons[BRIDGE_BUTTONS];
+	int8_t x;
+	int8_t y;
+	int8_t wheel;
+	int8_t pan;
+	int8_t media[BRIDGE_MEDIA_KEYS];
+	int8_t mediaArrays[BRIDGE_MAX_ARRAYS];
+	uint8_t mediaArrayCount;
+	uint8_t lastButtons;        /* button and media state of the last report, for reports */
+	uint8_t lastMedia;          /* that don't carry them */
+} Bridge;
+
+/**
+ * Bind a bridge to a compiled report map: look up the fields that feed the BLE reports once
+ *
+ * Parameters:
+ * Bridge * bridge: the bridge to set up
+ * HidReportMap const * map: the compiled map of the interface, kept by the caller
+ *
+ * Returns:
+ * bool: false if the map has nothing the BLE reports can carry
+ */
+bool BRIDGE_bind(Bridge *, HidReportMap const *);
+
+/**
+ * Bind a bridge to an interface that was switched to the boot mouse protocol
+ *
+ * Parameters:
+ * Bridge * bridge: the bridge to set up
+ */
+void BRIDGE_bindBoot(Bridge *);
+
+/**
+ * Poller callback: translate one USB input report and hand it to the motion coalescer,
+ * which sends what the SoftDevice can take. Runs in thread mode, straight from the
+ * transfer completion
+ *
+ * Parameters:
+ * uint8_t const * data: the raw USB report
+ * uint_fast8_t length: the number of bytes received
+ * void * context: the Bridge
+ */
+void BRIDGE_reportReceived(uint8_t const *, uint_fast8_t, void *);
+
+/**
+ * Get the bridge counters
+ *
+ * Parameters:
+ * BridgeStats * result: filled in with a copy of the counters
+ */
+void BRIDGE_getStats(BridgeStats *);
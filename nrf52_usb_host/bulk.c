@@ -0,0 +1,277 @@
+/*
+ * bulk.c
+ *
+ * Streaming bulk transfers on top of the MAX3421E's double-buffered FIFOs
+ */
+
+#include "bulk.h"
+#include "usb.h"
+#include "packets.h"
+#include "nrf_log.h"
+
+typedef struct {
+	BulkPacket ring[BULK_RING_SLOTS];
+	volatile uint_fast8_t head;
+	volatile uint_fast8_t tail;
+	volatile uint_fast8_t count;
+	uint_fast8_t address;
+	uint_fast8_t ep;
+	bool streaming;
+	bool armed;
+	bool paused;
+	BulkStreamStatus status;
+} BulkStream;
+
+static BulkStream inStream;
+
+typedef struct {
+	uint8_t const * data;
+	uint_fast16_t length;
+	uint_fast16_t acknowledged;
+	uint_fast8_t packetLength;  /* the packet in the SNDFIFO, 0 if there is none */
+	uint_fast8_t maxPacketSize;
+	uint_fast8_t address;
+	uint_fast8_t ep;
+	bool busy;
+	bool armed;
+	BulkWriteCallback callback;
+	void * context;
+} BulkWrite;
+
+static BulkWrite outTransfer;
+
+/* The SPI layer works on uint_fast8_t buffers: stage the FIFO contents here. Only used
+ * from thread mode, one FIFO at a time */
+static uint_fast8_t fifoBuffer[BUFFER_SIZE];
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static void _armIn(void);
+static void _inDone(uint_fast8_t, void *);
+static void _drainIn(void);
+static void _loadOut(void);
+static void _armOut(void);
+static void _outDone(uint_fast8_t, void *);
+static void _finishOut(uint_fast8_t);
+static uint_fast8_t _outPacketSize(uint_fast8_t, uint_fast8_t);
+
+/* PUBLIC FUNCTIONS */
+
+uint_fast8_t BULK_startStream(uint_fast8_t address, uint_fast8_t ep) {
+	if (inStream.streaming)
+		return rslSUCCES;
+
+	inStream.address = address;
+	inStream.ep = ep;
+	inStream.status.packets = 0;
+	inStream.status.bytes = 0;
+	inStream.status.naks = 0;
+	inStream.status.ringFullPauses = 0;
+	inStream.status.lastResult = rslSUCCES;
+
+	inStream.streaming = true;
+	inStream.status.running = true;
+	_armIn();
+	if (!inStream.armed) {
+		inStream.streaming = false;
+		inStream.status.running = false;
+		return rslBUSY;
+	}
+	return rslSUCCES;
+}
+
+void BULK_stopStream(void) {
+	inStream.streaming = false;
+	inStream.paused = false;
+	inStream.status.running = false;
+}
+
+BulkPacket const * BULK_peekPacket(void) {
+	if (!inStream.count)
+		return NULL;
+	return &inStream.ring[inStream.tail];
+}
+
+void BULK_releasePacket(void) {
+	if (!inStream.count)
+		return;
+
+	inStream.tail = (inStream.tail + 1) & (BULK_RING_SLOTS - 1);
+	inStream.count--;
+
+	if (inStream.paused) {
+		inStream.paused = false;
+		_armIn();
+	}
+}
+
+void BULK_getStreamStatus(BulkStreamStatus * result) {
+	*result = inStream.status;
+}
+
+uint_fast8_t BULK_write(uint_fast8_t address,
+	uint_fast8_t ep,
+	uint8_t const * data,
+	uint_fast16_t length,
+	BulkWriteCallback callback,
+	void * context) {
+	if (!length)
+		return rslBADREQ;
+	if (outTransfer.busy || inStream.streaming)
+		return rslBUSY;
+
+	outTransfer.data = data;
+	outTransfer.length = length;
+	outTransfer.acknowledged = 0;
+	outTransfer.packetLength = 0;
+	outTransfer.maxPacketSize = _outPacketSize(address, ep);
+	outTransfer.address = address;
+	outTransfer.ep = ep;
+	outTransfer.armed = false;
+	outTransfer.callback = callback;
+	outTransfer.context = context;
+	outTransfer.busy = true;
+
+	_loadOut();
+	_armOut();
+	if (!outTransfer.armed) {
+		outTransfer.busy = false;
+		return rslBUSY;
+	}
+	return rslSUCCES;
+}
+
+/* PRIVATE FUNCTIONS */
+
+static void _armIn(void) {
+	inStream.armed = !transmitPacketAsync(inStream.address, xfrIN, inStream.ep, _inDone, NULL);
+	if (!inStream.armed)
+		inStream.paused = true;
+}
+
+static void _inDone(uint_fast8_t result, void * context) {
+	UNUSED_PARAMETER(context);
+	inStream.armed = false;
+
+	if (!inStream.streaming) {
+		/* Nobody wants this packet anymore: free the FIFO buffer */
+		if (result == rslSUCCES)
+			MAX_writeRegister(rHIRQ, MAX_IRQ_RCVDAV);
+		return;
+	}
+
+	switch (result) {
+	case rslSUCCES:
+		/* Re-arm before draining: the SIE fills the other half of the RCVFIFO meanwhile.
+		 * Only do so if the ring can hold both the packet we have and the next one */
+		if (inStream.count + 2 <= BULK_RING_SLOTS) {
+			_armIn();
+		}
+		else {
+			inStream.paused = true;
+			inStream.status.ringFullPauses++;
+		}
+		_drainIn();
+		break;
+	case rslNAK:
+		/* The device had nothing for a while; keep polling */
+		inStream.status.naks++;
+		_armIn();
+		break;
+	default:
+		NRF_LOG_INFO("Bulk IN stream stopped: 0x%x\n", result);
+		inStream.status.lastResult = result;
+		BULK_stopStream();
+		break;
+	}
+}
+
+static void _drainIn(void) {
+	BulkPacket * packet = &inStream.ring[inStream.head];
+	uint_fast8_t it, length;
+
+	length = MIN(MAX_readRegister(rRCVBC), BUFFER_SIZE);
+	MAX_multiReadRegister(rRCVFIFO, fifoBuffer, length);
+
+	/* Clearing RCVDAV hands this half of the FIFO back to the SIE */
+	MAX_writeRegister(rHIRQ, MAX_IRQ_RCVDAV);
+
+	for (it = 0; it < length; it++)
+		packet->data[it] = (uint8_t) fifoBuffer[it];
+	packet->length = length;
+
+	inStream.head = (inStream.head + 1) & (BULK_RING_SLOTS - 1);
+	inStream.count++;
+	inStream.status.packets++;
+	inStream.status.bytes += length;
+}
+
+/* Copy the next packet into the SNDFIFO and commit it. Only one packet is committed at a
+ * time: the module drops a packet that was NAKed, so the next one may only follow the ACK */
+static void _loadOut(void) {
+	uint_fast8_t it, chunk;
+
+	if (outTransfer.packetLength || outTransfer.acknowledged >= outTransfer.length)
+		return;
+
+	chunk = MIN(outTransfer.length - outTransfer.acknowledged, outTransfer.maxPacketSize);
+	for (it = 0; it < chunk; it++)
+		fifoBuffer[it] = outTransfer.data[outTransfer.acknowledged + it];
+
+	loadSendFifo(fifoBuffer, chunk);
+	outTransfer.packetLength = chunk;
+}
+
+static void _armOut(void) {
+	if (!outTransfer.packetLength)
+		return;
+	outTransfer.armed = !transmitPacketAsync(outTransfer.address, xfrOUT, outTransfer.ep, _outDone, NULL);
+}
+
+static void _outDone(uint_fast8_t result, void * context) {
+	UNUSED_PARAMETER(context);
+	outTransfer.armed = false;
+
+	switch (result) {
+	case rslSUCCES:
+		outTransfer.acknowledged += outTransfer.packetLength;
+		outTransfer.packetLength = 0;
+
+		if (outTransfer.acknowledged >= outTransfer.length) {
+			_finishOut(rslSUCCES);
+			break;
+		}
+		_loadOut();
+		_armOut();
+		break;
+	case rslNAK:
+		/* Keep offering the packet; the transfer engine reloads it before the token */
+		_armOut();
+		break;
+	default:
+		NRF_LOG_INFO("Bulk OUT write failed: 0x%x\n", result);
+		_finishOut(result);
+		break;
+	}
+}
+
+static void _finishOut(uint_fast8_t result) {
+	outTransfer.busy = false;
+	if (outTransfer.callback)
+		outTransfer.callback(result, outTransfer.acknowledged, outTransfer.context);
+}
+
+/* wMaxPacketSize of an OUT endpoint of a device, capped to the FIFO size */
+static uint_fast8_t _outPacketSize(uint_fast8_t address, uint_fast8_t ep) {
+	USBDevice const * device = USB_findDevice(address);
+	uint_fast8_t it;
+
+	if (!device)
+		return BUFFER_SIZE;
+
+	for (it = 0; it < device->model.endpointCount; it++) {
+		if (device->model.endpoints[it].address == ep && device->model.endpoints[it].maxPacketSize)
+			return MIN(device->model.endpoints[it].maxPacketSize, BUFFER_SIZE);
+	}
+	return BUFFER_SIZE;
+}
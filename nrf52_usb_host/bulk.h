@@ -0,0 +1,93 @@
+#pragma once
+/*
+ * bulk.h
+ *
+ * Streaming bulk transfers on top of the MAX3421E's double-buffered FIFOs
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "max3421e.h"
+
+/* Number of received packets the consumer can hold on to (power of two) */
+#define BULK_RING_SLOTS     8
+
+typedef struct {
+	uint8_t data[BUFFER_SIZE];
+	uint8_t length;
+} BulkPacket;
+
+typedef struct {
+	uint32_t packets;
+	uint32_t bytes;
+	uint32_t naks;              /* NAK_LIMIT exhausted, the token was re-armed */
+	uint32_t ringFullPauses;    /* times the stream paused because the ring was full */
+	uint_fast8_t lastResult;    /* rHRSL result that stopped the stream, rslSUCCES if none */
+	bool running;
+} BulkStreamStatus;
+
+/* Called when a bulk OUT write finished, with the rHRSL result and the bytes acknowledged */
+typedef void(*BulkWriteCallback)(uint_fast8_t, uint_fast16_t, void *);
+
+/**
+ * Start streaming from a bulk IN endpoint of a configured device. A new IN token is
+ * issued as soon as the previous one completes, so the module receives into one half of
+ * the RCVFIFO while the other half is read out. Must be called from thread mode
+ *
+ * Parameters:
+ * uint_fast8_t address: the device address
+ * uint_fast8_t ep: the endpoint number
+ *
+ * Returns:
+ * uint_fast8_t: rslSUCCES if the stream started, rslBUSY if the transfer engine is in use
+ */
+uint_fast8_t BULK_startStream(uint_fast8_t, uint_fast8_t);
+
+/**
+ * Stop streaming. The token in flight is completed and its data discarded; packets
+ * already in the ring stay available
+ */
+void BULK_stopStream(void);
+
+/**
+ * Get the oldest received packet without removing it from the ring
+ *
+ * Returns:
+ * BulkPacket const *: the packet, or NULL if the ring is empty
+ */
+BulkPacket const * BULK_peekPacket(void);
+
+/**
+ * Hand the packet returned by BULK_peekPacket back to the stream. Resumes a stream that
+ * paused on a full ring. Must be called from thread mode
+ */
+void BULK_releasePacket(void);
+
+/**
+ * Get the counters of the current stream
+ *
+ * Parameters:
+ * BulkStreamStatus * result: filled in with a copy of the counters
+ */
+void BULK_getStreamStatus(BulkStreamStatus *);
+
+/**
+ * Send a block of data to a bulk or interrupt OUT endpoint, split into packets of the
+ * endpoint's wMaxPacketSize. The next packet is loaded as soon as the previous one is
+ * ACKed; a NAKed packet is loaded again before it is offered again. The transfer engine
+ * is shared with the IN stream, so stop that first. Must be called from thread mode
+ *
+ * Parameters:
+ * uint_fast8_t address: the device address
+ * uint_fast8_t ep: the endpoint number
+ * uint8_t const * data: the data to send, must stay valid until the callback
+ * uint_fast16_t length: the number of bytes to send
+ * BulkWriteCallback callback: called once all data was acknowledged or on an error
+ * void * context: passed to the callback
+ *
+ * Returns:
+ * uint_fast8_t: rslSUCCES if the write started, rslBUSY if a write or transfer is in progress,
+ *               rslBADREQ for an empty write
+ */
+uint_fast8_t BULK_write(uint_fast8_t, uint_fast8_t, uint8_t const *, uint_fast16_t, BulkWriteCallback, void *);
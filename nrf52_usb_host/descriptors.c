@@ -0,0 +1,125 @@
+/*
+ * descriptors.c
+ *
+ * Zero-allocation parser for the standard USB descriptors
+ */
+
+#include <string.h>
+
+#include "descriptors.h"
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static uint16_t _getWord(uint8_t const *);
+
+/* PUBLIC FUNCTIONS */
+
+uint_fast8_t DESC_parseDevice(uint8_t const * buffer, uint_fast16_t length, DeviceModel * model) {
+	if (length < DEVICE_DESCRIPTOR_LENGTH || buffer[0] < DEVICE_DESCRIPTOR_LENGTH)
+		return descBADLENGTH;
+	if (buffer[1] != descDEVICE)
+		return descBADTYPE;
+
+	model->deviceClass = buffer[4];
+	model->deviceSubClass = buffer[5];
+	model->deviceProtocol = buffer[6];
+	model->maxPacketSize0 = buffer[7];
+	model->vendorId = _getWord(&buffer[8]);
+	model->productId = _getWord(&buffer[10]);
+	model->bcdDevice = _getWord(&buffer[12]);
+	return descOK;
+}
+
+uint_fast8_t DESC_parseConfiguration(uint8_t const * buffer, uint_fast16_t length, DeviceModel * model) {
+	uint_fast16_t offset;
+	uint_fast8_t descLength;
+	InterfaceInfo * interface = NULL;
+	EndpointInfo * endpoint;
+
+	if (length < CONFIG_DESCRIPTOR_LENGTH || buffer[0] < CONFIG_DESCRIPTOR_LENGTH)
+		return descBADLENGTH;
+	if (buffer[1] != descCONFIGURATION)
+		return descBADTYPE;
+
+	model->totalLength = _getWord(&buffer[2]);
+	model->configurationValue = buffer[5];
+	model->attributes = buffer[7];
+	model->maxPower = buffer[8];
+	model->interfaceCount = 0;
+	model->endpointCount = 0;
+	memset(model->interfaces, 0, sizeof(model->interfaces));
+	memset(model->endpoints, 0, sizeof(model->endpoints));
+
+	/* Only look at what was both fetched and announced */
+	if (model->totalLength < length)
+		length = model->totalLength;
+
+	/* Walk the descriptors that follow the configuration header */
+	for (offset = buffer[0]; offset + 2 <= length; offset += descLength) {
+		descLength = buffer[offset];
+		if (descLength < 2)
+			return descBADLENGTH;
+		if (offset + descLength > length)
+			return descTRUNCATED;
+
+		switch (buffer[offset + 1]) {
+		case descINTERFACE:
+			if (descLength < 9)
+				return descBADLENGTH;
+			/* Alternate settings are not used, only keep setting 0 */
+			if (buffer[offset + 3] != 0 || model->interfaceCount == MAX_INTERFACES) {
+				interface = NULL;
+				break;
+			}
+			interface = &model->interfaces[model->interfaceCount++];
+			interface->number = buffer[offset + 2];
+			interface->interfaceClass = buffer[offset + 5];
+			interface->interfaceSubClass = buffer[offset + 6];
+			interface->interfaceProtocol = buffer[offset + 7];
+			interface->firstEndpoint = model->endpointCount;
+			break;
+
+		case descHID:
+			/* The report descriptor length is in the first class descriptor entry */
+			if (interface && descLength >= 9 && buffer[offset + 6] == descHID_REPORT)
+				interface->reportLength = _getWord(&buffer[offset + 7]);
+			break;
+
+		case descENDPOINT:
+			if (descLength < 7)
+				return descBADLENGTH;
+			if (!interface || model->endpointCount == MAX_ENDPOINTS)
+				break;
+			endpoint = &model->endpoints[model->endpointCount++];
+			endpoint->address = buffer[offset + 2];
+			endpoint->type = buffer[offset + 3] & 0x03;
+			endpoint->maxPacketSize = _getWord(&buffer[offset + 4]) & 0x07FF;
+			endpoint->interval = buffer[offset + 6];
+			endpoint->interface = (uint8_t)(interface - model->interfaces);
+			interface->endpointCount++;
+			break;
+
+		default:
+			/* Class or vendor specific, not needed */
+			break;
+		}
+	}
+	return descOK;
+}
+
+EndpointInfo const * DESC_findEndpoint(DeviceModel const * model, uint_fast8_t type, bool in) {
+	uint_fast8_t it;
+
+	for (it = 0; it < model->endpointCount; it++) {
+		if (model->endpoints[it].type == type
+		    && ((model->endpoints[it].address & epDIR_IN) != 0) == in)
+			return &model->endpoints[it];
+	}
+	return NULL;
+}
+
+/* PRIVATE FUNCTIONS */
+
+static uint16_t _getWord(uint8_t const * buffer) {
+	return (uint16_t)(buffer[0] | (buffer[1] << 8));
+}
@@ -0,0 +1,117 @@
+#pragma once
+/*
+ * descriptors.h
+ *
+ * Parsing of the standard USB descriptors into a compact, fixed-size device model
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Descriptor Types */
+#define descDEVICE              0x01
+#define descCONFIGURATION       0x02
+#define descSTRING              0x03
+#define descINTERFACE           0x04
+#define descENDPOINT            0x05
+#define descHID                 0x21
+#define descHID_REPORT          0x22
+
+/* Endpoint Types (bmAttributes bits 1..0) */
+#define epCONTROL               0x00
+#define epISOCHRONOUS           0x01
+#define epBULK                  0x02
+#define epINTERRUPT             0x03
+
+#define epDIR_IN                0x80
+
+#define DEVICE_DESCRIPTOR_LENGTH    18
+#define CONFIG_DESCRIPTOR_LENGTH    9
+
+/* Size of the static buffer the configuration descriptor is fetched into */
+#define DESCRIPTOR_ARENA_SIZE   256
+
+#define MAX_INTERFACES          4
+#define MAX_ENDPOINTS           8
+
+/* Parser Result Codes */
+#define descOK                  0x00
+#define descBADLENGTH           0x01
+#define descBADTYPE             0x02
+#define descTRUNCATED           0x03
+
+typedef struct {
+	uint16_t maxPacketSize;
+	uint8_t address;            /* bEndpointAddress: number, epDIR_IN for IN endpoints */
+	uint8_t type;               /* epCONTROL, epISOCHRONOUS, epBULK or epINTERRUPT */
+	uint8_t interval;           /* bInterval */
+	uint8_t interface;          /* index in DeviceModel.interfaces */
+} EndpointInfo;
+
+typedef struct {
+	uint16_t reportLength;      /* HID report descriptor length, 0 for non-HID interfaces */
+	uint8_t number;
+	uint8_t interfaceClass;
+	uint8_t interfaceSubClass;
+	uint8_t interfaceProtocol;
+	uint8_t firstEndpoint;      /* index in DeviceModel.endpoints */
+	uint8_t endpointCount;
+} InterfaceInfo;
+
+typedef struct {
+	uint16_t vendorId;
+	uint16_t productId;
+	uint16_t bcdDevice;
+	uint16_t totalLength;       /* wTotalLength of the configuration */
+	uint8_t deviceClass;
+	uint8_t deviceSubClass;
+	uint8_t deviceProtocol;
+	uint8_t maxPacketSize0;
+	uint8_t configurationValue;
+	uint8_t attributes;
+	uint8_t maxPower;
+	uint8_t interfaceCount;
+	uint8_t endpointCount;
+	InterfaceInfo interfaces[MAX_INTERFACES];
+	EndpointInfo endpoints[MAX_ENDPOINTS];
+} DeviceModel;
+
+/**
+ * Fill in the device-level fields of the model from a device descriptor
+ *
+ * Parameters:
+ * uint8_t const * buffer: the raw device descriptor
+ * uint_fast16_t length: the number of valid bytes in the buffer
+ * DeviceModel * model: the model to update
+ *
+ * Returns:
+ * uint_fast8_t: descOK or a parser result code
+ */
+uint_fast8_t DESC_parseDevice(uint8_t const *, uint_fast16_t, DeviceModel *);
+
+/**
+ * Fill in the configuration, interfaces and endpoints of the model from a complete
+ * configuration descriptor. Interfaces and endpoints beyond the model's capacity are skipped
+ *
+ * Parameters:
+ * uint8_t const * buffer: the raw configuration descriptor set
+ * uint_fast16_t length: the number of valid bytes in the buffer
+ * DeviceModel * model: the model to update
+ *
+ * Returns:
+ * uint_fast8_t: descOK or a parser result code
+ */
+uint_fast8_t DESC_parseConfiguration(uint8_t const *, uint_fast16_t, DeviceModel *);
+
+/**
+ * Find the first endpoint of a given type and direction
+ *
+ * Parameters:
+ * DeviceModel const * model: the parsed device
+ * uint_fast8_t type: the endpoint type (epBULK, epINTERRUPT, ...)
+ * bool in: true for an IN endpoint, false for OUT
+ *
+ * Returns:
+ * EndpointInfo const *: the endpoint, or NULL if the device has none
+ */
+EndpointInfo const * DESC_findEndpoint(DeviceModel const *, uint_fast8_t, bool);
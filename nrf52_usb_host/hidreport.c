@@ -0,0 +1,410 @@
+/*
+ * hidreport.c
+ *
+ * Streaming HID report descriptor parser and table-driven report decoder
+ */
+
+#include <string.h>
+
+#include "hidreport.h"
+#include "packets.h"
+#include "nrf_log.h"
+
+/* Item Types and Tags (HID 1.11, 6.2.2) */
+#define itemMAIN                0
+#define itemGLOBAL              1
+#define itemLOCAL               2
+#define itemLONG                0xFE
+
+#define tagINPUT                0x8
+
+#define tagUSAGE_PAGE           0x0
+#define tagLOGICAL_MINIMUM      0x1
+#define tagLOGICAL_MAXIMUM      0x2
+#define tagREPORT_SIZE          0x7
+#define tagREPORT_ID            0x8
+#define tagREPORT_COUNT         0x9
+#define tagPUSH                 0xA
+#define tagPOP                  0xB
+
+#define tagUSAGE                0x0
+#define tagUSAGE_MINIMUM        0x1
+#define tagUSAGE_MAXIMUM        0x2
+
+/* Input item data bits */
+#define inputCONSTANT           0x01
+#define inputVARIABLE           0x02
+#define inputRELATIVE           0x04
+
+static uint8_t descriptorBuffer[HID_MAX_DESCRIPTOR_LENGTH];
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static uint_fast8_t _classRequest(USBDevice const *, InterfaceInfo const *, uint_fast8_t, uint_fast16_t);
+static void _fail(HidParser *, uint_fast8_t);
+static void _processItem(HidParser *);
+static void _addInput(HidParser *, uint32_t);
+static void _addField(HidParser *, uint32_t, uint_fast16_t, uint_fast8_t);
+static int_fast8_t _reportIndex(HidParser *, uint_fast8_t);
+
+/* PUBLIC FUNCTIONS */
+
+void HID_parserInit(HidParser * parser, HidReportMap * map) {
+	memset(parser, 0, sizeof(HidParser));
+	memset(map, 0, sizeof(HidReportMap));
+	parser->map = map;
+}
+
+uint_fast8_t HID_parserFeed(HidParser * parser, uint8_t const * data, uint_fast16_t length) {
+	uint_fast16_t it;
+	uint_fast8_t size;
+
+	for (it = 0; it < length; it++) {
+		/* Long items carry nothing we use (none are defined), only step over their data */
+		if (parser->skip) {
+			parser->skip--;
+			continue;
+		}
+
+		parser->item[parser->itemLength++] = data[it];
+		if (parser->itemLength == 1) {
+			size = data[it] & 0x03;
+			parser->itemNeeded = (data[it] == itemLONG) ? 3 : 1 + (size == 3 ? 4 : size);
+		}
+		if (parser->itemLength < parser->itemNeeded)
+			continue;
+
+		if (parser->item[0] == itemLONG)
+			parser->skip = parser->item[1];
+		else
+			_processItem(parser);
+		parser->itemLength = 0;
+	}
+	return parser->result;
+}
+
+uint_fast8_t HID_parserFinish(HidParser * parser) {
+	HidReportMap * map = parser->map;
+	HidReportInfo * report;
+	HidField field;
+	uint_fast8_t it, pos;
+
+	if (parser->itemLength || parser->skip)
+		_fail(parser, hidTRUNCATED);
+
+	/* Stable insertion sort on the report ID, so each report's fields are consecutive */
+	for (it = 1; it < map->fieldCount; it++) {
+		field = map->fields[it];
+		for (pos = it; pos > 0 && map->fields[pos - 1].reportId > field.reportId; pos--)
+			map->fields[pos] = map->fields[pos - 1];
+		map->fields[pos] = field;
+	}
+
+	for (it = 0; it < map->reportCount; it++) {
+		report = &map->reports[it];
+		report->length = MIN((parser->reportBits[it] + 7) >> 3, 0xFF);
+		report->fieldCount = 0;
+		for (pos = 0; pos < map->fieldCount; pos++) {
+			if (map->fields[pos].reportId != report->id)
+				continue;
+			if (!report->fieldCount)
+				report->firstField = pos;
+			report->fieldCount++;
+		}
+	}
+	return parser->result;
+}
+
+uint_fast8_t HID_parseReportDescriptor(uint8_t const * buffer, uint_fast16_t length, HidReportMap * map) {
+	HidParser parser;
+
+	HID_parserInit(&parser, map);
+	HID_parserFeed(&parser, buffer, length);
+	return HID_parserFinish(&parser);
+}
+
+uint_fast8_t HID_readReportMap(USBDevice const * device, InterfaceInfo const * interface, HidReportMap * map) {
+	uint_fast16_t length = interface->reportLength;
+	uint_fast16_t received;
+	uint_fast8_t result;
+
+	if (!length)
+		return rslBADREQ;
+	if (length > HID_MAX_DESCRIPTOR_LENGTH) {
+		NRF_LOG_INFO("Report descriptor too long: %d bytes\n", length);
+		return rslBADBC;
+	}
+
+	result = USB_getDescriptor(device->address, descHID_REPORT, 0, interface->number, descriptorBuffer, length, &received);
+	if (result)
+		return result;
+
+	/* A full table still decodes the fields that fit */
+	result = HID_parseReportDescriptor(descriptorBuffer, received, map);
+	if (result != hidOK && result != hidTOOMANY)
+		return rslBADBC;
+
+	NRF_LOG_INFO("Interface %d: %d fields in %d reports\n", interface->number, map->fieldCount, map->reportCount);
+	return rslSUCCES;
+}
+
+bool HID_isBootMouse(InterfaceInfo const * interface) {
+	return interface->interfaceClass == clsHID
+	       && interface->interfaceSubClass == HID_SUBCLASS_BOOT
+	       && interface->interfaceProtocol == HID_BOOT_MOUSE;
+}
+
+uint_fast8_t HID_setProtocol(USBDevice const * device, InterfaceInfo const * interface, uint_fast8_t protocol) {
+	return _classRequest(device, interface, reqHID_SET_PROTOCOL, protocol);
+}
+
+uint_fast8_t HID_setIdle(USBDevice const * device, InterfaceInfo const * interface, uint_fast8_t duration) {
+	/* Report ID 0: all reports */
+	return _classRequest(device, interface, reqHID_SET_IDLE, duration << 8);
+}
+
+bool HID_parseBootMouse(uint8_t const * report, uint_fast8_t length, HidBootMouseReport * result) {
+	if (length < 3)
+		return false;
+
+	result->buttons = report[0];
+	result->x = (int8_t) report[1];
+	result->y = (int8_t) report[2];
+	result->wheel = (length > 3) ? (int8_t) report[3] : 0;
+	return true;
+}
+
+int_fast8_t HID_findField(HidReportMap const * map, uint_fast16_t usagePage, uint_fast16_t usage) {
+	uint_fast8_t it;
+
+	for (it = 0; it < map->fieldCount; it++) {
+		if (map->fields[it].usagePage == usagePage && map->fields[it].usage == usage)
+			return it;
+	}
+	return -1;
+}
+
+HidReportInfo const * HID_findReport(HidReportMap const * map, uint8_t const * report, uint_fast8_t length) {
+	uint_fast8_t it;
+
+	if (!map->usesReportIds)
+		return map->reportCount ? &map->reports[0] : NULL;
+	if (!length)
+		return NULL;
+
+	for (it = 0; it < map->reportCount; it++) {
+		if (map->reports[it].id == report[0])
+			return &map->reports[it];
+	}
+	return NULL;
+}
+
+int32_t HID_extractField(HidField const * field, uint8_t const * report) {
+	uint8_t const * bytes = &report[field->bitOffset >> 3];
+	uint_fast8_t shift = field->bitOffset & 7;
+	uint_fast8_t spare = 32 - field->bitSize;
+	uint_fast8_t count = (shift + field->bitSize + 7) >> 3;
+	uint64_t raw = 0;
+	uint32_t value;
+	uint_fast8_t it;
+
+	for (it = 0; it < count; it++)
+		raw |= (uint64_t) bytes[it] << (it * 8);
+
+	/* Move the field to the top, then back down with or without its sign */
+	value = (uint32_t)(raw >> shift) << spare;
+	return (field->flags & HID_FIELD_SIGNED) ? (int32_t) value >> spare : (int32_t)(value >> spare);
+}
+
+/* PRIVATE FUNCTIONS */
+
+/* Class request without a data stage, to the interface */
+static uint_fast8_t _classRequest(USBDevice const * device,
+	InterfaceInfo const * interface,
+	uint_fast8_t bRequest,
+	uint_fast16_t wValue) {
+	ControlPacket packet = {
+		.perAddress = device->address,
+		.type = 0x10,
+		.endPoint = 0,
+		.bmRequestType = 0x21,
+		.bRequest = bRequest,
+		.wValue = wValue,
+		.wIndex = interface->number,
+		.wLength = 0,
+		.direction = DIR_OUT
+	};
+	return sendControl(&packet);
+}
+
+/* Keep the first error; parsing continues so the offsets of later fields stay right */
+static void _fail(HidParser * parser, uint_fast8_t result) {
+	if (!parser->result)
+		parser->result = result;
+}
+
+static void _processItem(HidParser * parser) {
+	HidGlobals * globals = &parser->globals;
+	uint_fast8_t size = parser->itemNeeded - 1;
+	uint_fast8_t type = (parser->item[0] >> 2) & 0x03;
+	uint_fast8_t tag = parser->item[0] >> 4;
+	uint32_t data = 0;
+	int32_t sdata;
+	uint_fast8_t it;
+
+	for (it = 0; it < size; it++)
+		data |= (uint32_t) parser->item[1 + it] << (it * 8);
+	sdata = (size == 1) ? (int8_t) data : (size == 2) ? (int16_t) data : (int32_t) data;
+
+	switch (type) {
+	case itemMAIN:
+		if (tag == tagINPUT)
+			_addInput(parser, data);
+		/* Output, feature and collection items only end the local state */
+		parser->usageCount = 0;
+		parser->usageRange = false;
+		break;
+
+	case itemGLOBAL:
+		switch (tag) {
+		case tagUSAGE_PAGE:
+			globals->usagePage = (uint16_t) data;
+			break;
+		case tagLOGICAL_MINIMUM:
+			globals->logicalMin = sdata;
+			break;
+		case tagLOGICAL_MAXIMUM:
+			globals->logicalMax = sdata;
+			globals->logicalMaxRaw = data;
+			break;
+		case tagREPORT_SIZE:
+			globals->reportSize = (uint8_t) data;
+			break;
+		case tagREPORT_ID:
+			globals->reportId = (uint8_t) data;
+			break;
+		case tagREPORT_COUNT:
+			globals->reportCount = (uint16_t) data;
+			break;
+		case tagPUSH:
+			if (parser->stackDepth == HID_GLOBAL_STACK)
+				_fail(parser, hidBADSTACK);
+			else
+				parser->stack[parser->stackDepth++] = *globals;
+			break;
+		case tagPOP:
+			if (!parser->stackDepth)
+				_fail(parser, hidBADSTACK);
+			else
+				*globals = parser->stack[--parser->stackDepth];
+			break;
+		default:
+			/* Physical range and units don't change how a field is read */
+			break;
+		}
+		break;
+
+	case itemLOCAL:
+		switch (tag) {
+		case tagUSAGE:
+			/* Four-byte usages carry their own page */
+			if (parser->usageCount < HID_MAX_USAGES)
+				parser->usages[parser->usageCount++] = (size == 4) ? data : (data & 0xFFFF);
+			break;
+		case tagUSAGE_MINIMUM:
+			parser->usageMin = data;
+			parser->usageRange = true;
+			break;
+		case tagUSAGE_MAXIMUM:
+			parser->usageMax = data;
+			break;
+		default:
+			break;
+		}
+		break;
+
+	default:
+		_fail(parser, hidBADITEM);
+		break;
+	}
+}
+
+/* Compile an Input main item into one field per report count */
+static void _addInput(HidParser * parser, uint32_t flags) {
+	HidGlobals const * globals = &parser->globals;
+	int_fast8_t report = _reportIndex(parser, globals->reportId);
+	uint_fast16_t offset, it;
+	uint32_t usage;
+	uint_fast8_t last;
+
+	if (report < 0) {
+		_fail(parser, hidTOOMANY);
+		return;
+	}
+	offset = parser->reportBits[report];
+	parser->reportBits[report] += globals->reportSize * globals->reportCount;
+
+	/* Padding only takes up room */
+	if ((flags & inputCONSTANT) || !globals->reportSize || globals->reportSize > 32)
+		return;
+
+	last = parser->usageCount ? parser->usageCount - 1 : 0;
+	for (it = 0; it < globals->reportCount; it++) {
+		/* Without a Usage of its own the field is undefined (0): usages[] still holds those
+		 * of an earlier main item */
+		if (!parser->usageCount && !parser->usageRange)
+			usage = 0;
+		else if (!(flags & inputVARIABLE))
+			usage = parser->usageRange ? parser->usageMin : parser->usages[0];
+		else if (parser->usageRange)
+			usage = MIN(parser->usageMin + it, parser->usageMax);
+		else
+			usage = parser->usages[MIN(it, last)];
+
+		_addField(parser, usage, offset + it * globals->reportSize, flags);
+	}
+}
+
+static void _addField(HidParser * parser, uint32_t usage, uint_fast16_t bitOffset, uint_fast8_t flags) {
+	HidGlobals const * globals = &parser->globals;
+	HidReportMap * map = parser->map;
+	HidField * field;
+
+	if (map->fieldCount == HID_MAX_FIELDS) {
+		_fail(parser, hidTOOMANY);
+		return;
+	}
+
+	field = &map->fields[map->fieldCount++];
+	field->logicalMin = globals->logicalMin;
+	/* A maximum like 0xFF with a minimum of 0 is meant unsigned */
+	field->logicalMax = (globals->logicalMin >= 0 && globals->logicalMax < 0) ? (int32_t) globals->logicalMaxRaw : globals->logicalMax;
+	field->usagePage = (usage >> 16) ? (uint16_t)(usage >> 16) : globals->usagePage;
+	field->usage = (uint16_t) usage;
+	field->bitOffset = bitOffset;
+	field->bitSize = globals->reportSize;
+	field->reportId = globals->reportId;
+	field->flags = (globals->logicalMin < 0 ? HID_FIELD_SIGNED : 0)
+		| ((flags & inputRELATIVE) ? HID_FIELD_RELATIVE : 0)
+		| ((flags & inputVARIABLE) ? 0 : HID_FIELD_ARRAY);
+}
+
+/* Find or add the report with this ID; its bits start after the ID byte */
+static int_fast8_t _reportIndex(HidParser * parser, uint_fast8_t id) {
+	HidReportMap * map = parser->map;
+	uint_fast8_t it;
+
+	for (it = 0; it < map->reportCount; it++) {
+		if (map->reports[it].id == id)
+			return it;
+	}
+	if (map->reportCount == HID_MAX_REPORTS)
+		return -1;
+
+	map->reports[it].id = id;
+	parser->reportBits[it] = id ? 8 : 0;
+	if (id)
+		map->usesReportIds = true;
+	map->reportCount++;
+	return it;
+}
@@ -0,0 +1,277 @@
+#pragma once
+/*
+ * hidreport.h
+ *
+ * HID report descriptor parser. The descriptor is compiled once, at enumeration, into a
+ * flat table of input fields that incoming reports are decoded with
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usb.h"
+
+/* Size of the compiled table */
+#define HID_MAX_FIELDS          32
+#define HID_MAX_REPORTS         8
+
+/* Local usages collected before a main item, and PUSH depth for the global state */
+#define HID_MAX_USAGES          16
+#define HID_GLOBAL_STACK        2
+
+/* Size of the static buffer the report descriptor is fetched into */
+#define HID_MAX_DESCRIPTOR_LENGTH   512
+
+/* HID Class Requests */
+#define reqHID_SET_REPORT       0x09
+#define reqHID_SET_IDLE         0x0A
+#define reqHID_SET_PROTOCOL     0x0B
+
+#define HID_PROTOCOL_BOOT       0
+#define HID_PROTOCOL_REPORT     1
+
+/* Boot interfaces (bInterfaceSubClass / bInterfaceProtocol) */
+#define HID_SUBCLASS_BOOT       0x01
+#define HID_BOOT_KEYBOARD       0x01
+#define HID_BOOT_MOUSE          0x02
+
+/* Usage Pages */
+#define pageGENERIC_DESKTOP     0x01
+#define pageKEYBOARD            0x07
+#define pageLED                 0x08
+#define pageBUTTON              0x09
+#define pageCONSUMER            0x0C
+
+/* Generic Desktop Usages */
+#define usageX                  0x30
+#define usageY                  0x31
+#define usageWHEEL              0x38
+
+/* Consumer Usages */
+#define usageAC_PAN             0x0238
+
+/* Field Flags */
+#define HID_FIELD_SIGNED        0x01    /* logical minimum below 0: sign-extend */
+#define HID_FIELD_RELATIVE      0x02    /* a delta rather than an absolute value */
+#define HID_FIELD_ARRAY         0x04    /* the value is an index into the usage range */
+
+/* Parser Result Codes */
+#define hidOK                   0x00
+#define hidBADITEM              0x01
+#define hidTOOMANY              0x02
+#define hidBADSTACK             0x03
+#define hidTRUNCATED            0x04
+
+/* The fixed report of a boot mouse; many also send a wheel byte after Y */
+typedef struct {
+	uint8_t buttons;
+	int8_t x;
+	int8_t y;
+	int8_t wheel;
+} HidBootMouseReport;
+
+/* One input field, located in the raw report including its report ID byte */
+typedef struct {
+	int32_t logicalMin;
+	int32_t logicalMax;
+	uint16_t usagePage;
+	uint16_t usage;             /* for array fields: the usage of logicalMin */
+	uint16_t bitOffset;
+	uint8_t bitSize;            /* 1..32 */
+	uint8_t reportId;           /* 0 if the device does not use report IDs */
+	uint8_t flags;
+} HidField;
+
+/* The fields of one input report, which are consecutive in the table */
+typedef struct {
+	uint8_t id;
+	uint8_t length;             /* bytes, including the report ID */
+	uint8_t firstField;
+	uint8_t fieldCount;
+} HidReportInfo;
+
+typedef struct {
+	HidField fields[HID_MAX_FIELDS];
+	HidReportInfo reports[HID_MAX_REPORTS];
+	uint8_t fieldCount;
+	uint8_t reportCount;
+	bool usesReportIds;
+} HidReportMap;
+
+typedef struct {
+	int32_t logicalMin;
+	int32_t logicalMax;
+	uint32_t logicalMaxRaw;     /* unsigned reading, for maxima like 0xFF with a minimum of 0 */
+	uint16_t usagePage;
+	uint16_t reportCount;
+	uint8_t reportSize;
+	uint8_t reportId;
+} HidGlobals;
+
+/* Parser state; items may be split over several calls to HID_parserFeed */
+typedef struct {
+	HidReportMap * map;
+	HidGlobals globals;
+	HidGlobals stack[HID_GLOBAL_STACK];
+	uint32_t usages[HID_MAX_USAGES];    /* page in the upper half if given, else 0 */
+	uint32_t usageMin;
+	uint32_t usageMax;
+	uint16_t reportBits[HID_MAX_REPORTS];
+	uint16_t skip;                      /* data bytes left of a long item */
+	uint8_t item[5];
+	uint8_t itemLength;
+	uint8_t itemNeeded;
+	uint8_t usageCount;
+	uint8_t stackDepth;
+	bool usageRange;
+	uint8_t result;
+} HidParser;
+
+/**
+ * Start compiling a report descriptor into a map
+ *
+ * Parameters:
+ * HidParser * parser: the parser state
+ * HidReportMap * map: the table to fill in
+ */
+void HID_parserInit(HidParser *, HidReportMap *);
+
+/**
+ * Feed the next part of the report descriptor. Items may straddle calls
+ *
+ * Parameters:
+ * HidParser * parser: the parser state
+ * uint8_t const * data: the descriptor bytes
+ * uint_fast16_t length: the number of bytes
+ *
+ * Returns:
+ * uint_fast8_t: hidOK or the first parser result code; hidTOOMANY leaves the fields that
+ *               did fit usable
+ */
+uint_fast8_t HID_parserFeed(HidParser *, uint8_t const *, uint_fast16_t);
+
+/**
+ * Finish the map: group the fields per report and work out the report lengths
+ *
+ * Parameters:
+ * HidParser * parser: the parser state
+ *
+ * Returns:
+ * uint_fast8_t: the parser result, hidTRUNCATED if the descriptor ended inside an item
+ */
+uint_fast8_t HID_parserFinish(HidParser *);
+
+/**
+ * Compile a complete report descriptor
+ *
+ * Parameters:
+ * uint8_t const * buffer: the raw report descriptor
+ * uint_fast16_t length: the number of valid bytes in the buffer
+ * HidReportMap * map: the table to fill in
+ *
+ * Returns:
+ * uint_fast8_t: hidOK or a parser result code
+ */
+uint_fast8_t HID_parseReportDescriptor(uint8_t const *, uint_fast16_t, HidReportMap *);
+
+/**
+ * Fetch the report descriptor of a HID interface and compile it
+ *
+ * Parameters:
+ * USBDevice const * device: the configured device
+ * InterfaceInfo const * interface: the HID interface
+ * HidReportMap * map: the table to fill in
+ *
+ * Returns:
+ * uint_fast8_t: the result code of the control transfer, rslBADBC if the descriptor could
+ *               not be compiled
+ */
+uint_fast8_t HID_readReportMap(USBDevice const *, InterfaceInfo const *, HidReportMap *);
+
+/**
+ * Check whether an interface is a mouse that supports the boot protocol
+ *
+ * Parameters:
+ * InterfaceInfo const * interface: the interface
+ *
+ * Returns:
+ * bool: true for a boot mouse
+ */
+bool HID_isBootMouse(InterfaceInfo const *);
+
+/**
+ * Switch a HID interface to the boot or report protocol
+ *
+ * Parameters:
+ * USBDevice const * device: the configured device
+ * InterfaceInfo const * interface: the HID interface
+ * uint_fast8_t protocol: HID_PROTOCOL_BOOT or HID_PROTOCOL_REPORT
+ *
+ * Returns:
+ * uint_fast8_t: the result code of the control transfer
+ */
+uint_fast8_t HID_setProtocol(USBDevice const *, InterfaceInfo const *, uint_fast8_t);
+
+/**
+ * Set the idle rate of all reports of a HID interface
+ *
+ * Parameters:
+ * USBDevice const * device: the configured device
+ * InterfaceInfo const * interface: the HID interface
+ * uint_fast8_t duration: in units of 4 ms, 0 to only report changes
+ *
+ * Returns:
+ * uint_fast8_t: the result code of the control transfer; devices may STALL it
+ */
+uint_fast8_t HID_setIdle(USBDevice const *, InterfaceInfo const *, uint_fast8_t);
+
+/**
+ * Read a boot mouse report. No descriptor is needed, the layout is fixed
+ *
+ * Parameters:
+ * uint8_t const * report: the raw report
+ * uint_fast8_t length: the number of bytes received
+ * HidBootMouseReport * result: the decoded report
+ *
+ * Returns:
+ * bool: false if the report is too short to be a boot mouse report
+ */
+bool HID_parseBootMouse(uint8_t const *, uint_fast8_t, HidBootMouseReport *);
+
+/**
+ * Find the first field with the given usage
+ *
+ * Parameters:
+ * HidReportMap const * map: the compiled map
+ * uint_fast16_t usagePage: the usage page
+ * uint_fast16_t usage: the usage; for array fields the start of their usage range
+ *
+ * Returns:
+ * int_fast8_t: the index in map->fields, or -1 if there is none
+ */
+int_fast8_t HID_findField(HidReportMap const *, uint_fast16_t, uint_fast16_t);
+
+/**
+ * Find the report an input report belongs to, from its ID byte if the device uses them
+ *
+ * Parameters:
+ * HidReportMap const * map: the compiled map
+ * uint8_t const * report: the raw report
+ * uint_fast8_t length: the number of bytes received
+ *
+ * Returns:
+ * HidReportInfo const *: the report, or NULL if it is unknown
+ */
+HidReportInfo const * HID_findReport(HidReportMap const *, uint8_t const *, uint_fast8_t);
+
+/**
+ * Extract a single field from a report
+ *
+ * Parameters:
+ * HidField const * field: the field
+ * uint8_t const * report: the raw report, at least as long as the field's report
+ *
+ * Returns:
+ * int32_t: the logical value, sign-extended for signed fields
+ */
+int32_t HID_extractField(HidField const *, uint8_t const *);
@@ -0,0 +1,63 @@
+/*
+ * bench_sim.c
+ *
+ * Runs the benchmark suite (bench.h) on the virtual bulk device, on the simulated clock
+ * of the MAX3421E model, and prints the JSON lines like the firmware does with
+ * BENCH_ENABLED. Fails if a benchmark does not complete or sees corrupt data. Run it
+ * again with a device that NAKs every packet a few times to see the retry cost
+ */
+
+#include "check.h"
+#include "platform.h"
+#include "max_sim.h"
+#include "vdev.h"
+#include "usb.h"
+#include "bench.h"
+
+/* The bulk IN endpoint of VDEV_initBulk */
+#define BENCH_SIM_EP            2
+
+static bool _settled(void);
+static void _run(void);
+
+int main(void) {
+	static VirtualDevice device;
+
+	HOST_start();
+	VDEV_initBulk(&device);
+	MAXSIM_attach(&device.port);
+	CHECK(HOST_run(_settled, 200000));
+	CHECK(USB_getState() == USB_STATE_READY);
+
+	BENCH_setClock(&MAXSIM_clock);
+	BENCH_start();
+	_run();
+
+	VDEV_setDelay(&device, 0x80 | BENCH_SIM_EP, 3);
+	_run();
+	return CHECK_RESULT();
+}
+
+static bool _settled(void) {
+	return USB_getState() == USB_STATE_READY || USB_getState() == USB_STATE_FAILED;
+}
+
+static void _run(void) {
+	uint_fast8_t address = USB_getRootDevice()->address;
+	BenchResult result;
+
+	BENCH_enumeration(&result);
+	BENCH_print(&result);
+
+	BENCH_bulkIn(address, BENCH_SIM_EP, BENCH_BULK_BYTES, &result);
+	BENCH_print(&result);
+	CHECK(result.status == rslSUCCES);
+	CHECK(result.bytes >= BENCH_BULK_BYTES);
+	CHECK(result.errors == 0);
+
+	BENCH_latency(address, BENCH_SIM_EP, BENCH_LATENCY_SAMPLES, &result);
+	BENCH_print(&result);
+	CHECK(result.status == rslSUCCES);
+	CHECK(result.count == BENCH_LATENCY_SAMPLES);
+	CHECK(result.errors == 0);
+}
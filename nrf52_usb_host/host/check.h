@@ -0,0 +1,20 @@
+#pragma once
+/*
+ * check.h
+ *
+ * Assertions for the host test programs: a failed check prints where and counts, and
+ * CHECK_RESULT turns the count into the exit status ctest looks at
+ */
+
+#include <stdio.h>
+
+static int checkFailures;
+
+#define CHECK(condition) do { \
+	if (!(condition)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+		checkFailures++; \
+	} \
+} while (0)
+
+#define CHECK_RESULT()          (checkFailures ? 1 : 0)
@@ -0,0 +1,285 @@
+/*
+ * platform.c
+ *
+ * Host stand-ins for app_timer, app_scheduler, GPIOTE and the power manager, on the
+ * simulated clock of the MAX3421E model. Interrupts run from the main loop: wherever the
+ * firmware would sleep, the expired timers, the SPI completions and the INT falling edge
+ * are serviced instead
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+#include "max_sim.h"
+#include "max3421e.h"
+#include "app_timer.h"
+#include "app_scheduler.h"
+#include "nrf_pwr_mgmt.h"
+#include "nrf.h"
+
+/* Timers the stack creates: the USB, hub, poller and retry timers */
+#define HOST_TIMERS             8
+
+#define NS_PER_TICK             (1000000000ULL / APP_TIMER_CLOCK_FREQ)
+
+typedef struct {
+	app_timer_timeout_handler_t handler;
+	bool running;
+	uint64_t expiry;
+	void * context;
+} HostTimer;
+
+typedef struct {
+	app_sched_event_handler_t handler;
+	uint16_t size;
+	uint8_t data[HOST_SCHED_EVENT_SIZE];
+} HostEvent;
+
+/* The firmware defines these in main.c */
+volatile uint_fast8_t RXData[BUFFER_SIZE];
+NRF_TIMER_Type HOST_timer2;
+
+static HostTimer timers[HOST_TIMERS];
+static uint_fast8_t timerCount;
+
+static HostEvent queue[HOST_SCHED_QUEUE_SIZE];
+static uint_fast16_t queueHead;
+static uint_fast16_t queueCount;
+static uint_fast16_t queuePeak;
+
+static nrf_drv_gpiote_evt_handler_t pinHandler;
+static bool pinLow;
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static bool _interrupts(void);
+static uint64_t _nextExpiry(void);
+static bool _runEvent(void);
+
+/* PUBLIC FUNCTIONS */
+
+void HOST_start(void) {
+	SIMSPI_setTransport(&MAXSIM_transport);
+	USB_init();
+	MAX_start(true);
+
+	MAX_enableInterrupts(MAX_IRQ_CONDET);
+	MAX_clearInterruptStatus(MAX_IRQ_CONDET);
+	MAX_enableInterruptsMaster();
+	queuePeak = queueCount;
+}
+
+void HOST_step(void) {
+	if (_runEvent())
+		_interrupts();
+	else
+		nrf_pwr_mgmt_run();
+}
+
+bool HOST_run(bool(*done)(void), uint32_t limit) {
+	while (limit--) {
+		HOST_step();
+		if (done())
+			return true;
+	}
+	return false;
+}
+
+void HOST_idle(uint32_t passes) {
+	while (passes--)
+		HOST_step();
+}
+
+uint_fast16_t HOST_getQueuePeak(void) {
+	return queuePeak;
+}
+
+/* SDK */
+
+void app_error_handler_bare(ret_code_t error) {
+	printf("app error %u\n", (unsigned) error);
+	exit(2);
+}
+
+ret_code_t app_sched_event_put(void const * data, uint16_t size, app_sched_event_handler_t handler) {
+	HostEvent * event;
+
+	if (size > HOST_SCHED_EVENT_SIZE)
+		return NRF_ERROR_INVALID_LENGTH;
+	if (queueCount == HOST_SCHED_QUEUE_SIZE)
+		return NRF_ERROR_NO_MEM;
+
+	event = &queue[(queueHead + queueCount) % HOST_SCHED_QUEUE_SIZE];
+	event->handler = handler;
+	event->size = size;
+	if (size)
+		memcpy(event->data, data, size);
+	if (++queueCount > queuePeak)
+		queuePeak = queueCount;
+	return NRF_SUCCESS;
+}
+
+void app_sched_execute(void) {
+	while (_runEvent())
+		;
+}
+
+ret_code_t app_timer_create(app_timer_id_t const * id, app_timer_mode_t mode, app_timer_timeout_handler_t handler) {
+	HostTimer * timer;
+
+	UNUSED_PARAMETER(mode);
+	if (timerCount == HOST_TIMERS)
+		return NRF_ERROR_NO_MEM;
+
+	timer = &timers[timerCount++];
+	timer->handler = handler;
+	*(HostTimer **) *id = timer;
+	return NRF_SUCCESS;
+}
+
+ret_code_t app_timer_start(app_timer_id_t id, uint32_t ticks, void * context) {
+	HostTimer * timer = *(HostTimer **) id;
+
+	timer->running = true;
+	timer->expiry = MAXSIM_now() + ticks * NS_PER_TICK;
+	timer->context = context;
+	return NRF_SUCCESS;
+}
+
+ret_code_t app_timer_stop(app_timer_id_t id) {
+	(*(HostTimer **) id)->running = false;
+	return NRF_SUCCESS;
+}
+
+uint32_t app_timer_cnt_get(void) {
+	return (uint32_t)(MAXSIM_now() / NS_PER_TICK) & 0xFFFFFF;
+}
+
+uint32_t app_timer_cnt_diff_compute(uint32_t to, uint32_t from) {
+	return (to - from) & 0xFFFFFF;
+}
+
+void nrf_delay_ms(uint32_t ms) {
+	MAXSIM_advance(ms * 1000000ULL);
+}
+
+void nrf_delay_us(uint32_t us) {
+	MAXSIM_advance(us * 1000ULL);
+}
+
+ret_code_t nrf_drv_gpiote_in_init(nrf_drv_gpiote_pin_t pin, nrf_drv_gpiote_in_config_t const * config, nrf_drv_gpiote_evt_handler_t handler) {
+	UNUSED_PARAMETER(pin);
+	UNUSED_PARAMETER(config);
+	pinHandler = handler;
+	return NRF_SUCCESS;
+}
+
+void nrf_drv_gpiote_in_event_enable(nrf_drv_gpiote_pin_t pin, bool interrupt) {
+	UNUSED_PARAMETER(pin);
+	UNUSED_PARAMETER(interrupt);
+}
+
+void nrf_gpio_cfg_output(uint32_t pin) {
+	UNUSED_PARAMETER(pin);
+}
+
+void nrf_gpio_pin_set(uint32_t pin) {
+	UNUSED_PARAMETER(pin);
+}
+
+void nrf_gpio_pin_toggle(uint32_t pin) {
+	UNUSED_PARAMETER(pin);
+}
+
+uint32_t nrf_gpio_pin_read(uint32_t pin) {
+	bool low = MAXSIM_intAsserted();
+
+	UNUSED_PARAMETER(pin);
+	/* A high level re-arms the falling edge detector */
+	if (!low)
+		pinLow = false;
+	return !low;
+}
+
+ret_code_t nrf_spi_mngr_init(nrf_spi_mngr_t const * manager, nrf_drv_spi_config_t const * config) {
+	UNUSED_PARAMETER(manager);
+	UNUSED_PARAMETER(config);
+	return NRF_SUCCESS;
+}
+
+ret_code_t nrf_spi_mngr_perform(nrf_spi_mngr_t const * manager, nrf_drv_spi_config_t const * config, nrf_spi_mngr_transfer_t const * transfers, uint8_t count, void(*idle)(void)) {
+	UNUSED_PARAMETER(manager);
+	UNUSED_PARAMETER(config);
+	UNUSED_PARAMETER(transfers);
+	UNUSED_PARAMETER(count);
+	UNUSED_PARAMETER(idle);
+	return NRF_ERROR_NOT_SUPPORTED;
+}
+
+ret_code_t nrf_spi_mngr_schedule(nrf_spi_mngr_t const * manager, nrf_spi_mngr_transaction_t const * transaction) {
+	UNUSED_PARAMETER(manager);
+	UNUSED_PARAMETER(transaction);
+	return NRF_ERROR_NOT_SUPPORTED;
+}
+
+void nrf_pwr_mgmt_run(void) {
+	if (_interrupts())
+		return;
+	MAXSIM_idle(_nextExpiry());
+	_interrupts();
+}
+
+/* PRIVATE FUNCTIONS */
+
+/* Run what would have interrupted the CPU by now. Returns true if anything ran or was
+ * queued for the main loop */
+static bool _interrupts(void) {
+	uint_fast16_t queued = queueCount;
+	bool any = false;
+	bool low;
+	uint_fast8_t it;
+
+	MAXSIM_serviceSpi();
+	low = MAXSIM_intAsserted();
+	if (low && !pinLow && pinHandler) {
+		pinHandler(MAX_IRQ_PIN, 0);
+		any = true;
+	}
+	pinLow = low;
+	MAXSIM_serviceSpi();
+
+	for (it = 0; it < timerCount; it++) {
+		if (timers[it].running && timers[it].expiry <= MAXSIM_now()) {
+			timers[it].running = false;
+			timers[it].handler(timers[it].context);
+			any = true;
+		}
+	}
+	return any || queueCount != queued;
+}
+
+static uint64_t _nextExpiry(void) {
+	uint64_t next = UINT64_MAX;
+	uint_fast8_t it;
+
+	for (it = 0; it < timerCount; it++) {
+		if (timers[it].running && timers[it].expiry < next)
+			next = timers[it].expiry;
+	}
+	return next;
+}
+
+static bool _runEvent(void) {
+	HostEvent event;
+
+	if (!queueCount)
+		return false;
+
+	event = queue[queueHead];
+	queueHead = (queueHead + 1) % HOST_SCHED_QUEUE_SIZE;
+	queueCount--;
+	event.handler(event.data, event.size);
+	return true;
+}
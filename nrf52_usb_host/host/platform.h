@@ -0,0 +1,59 @@
+#pragma once
+/*
+ * platform.h
+ *
+ * Host stand-ins for the SDK pieces the USB host stack uses: app_timer, app_scheduler,
+ * GPIOTE, the power manager and the delays all run on the MAX3421E model's simulated
+ * clock. The test programs drive the main loop with HOST_step, like main() does with
+ * app_sched_execute and nrf_pwr_mgmt_run
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Events the scheduler queue holds; the firmware's SCHED_QUEUE_SIZE is 10 */
+#ifndef HOST_SCHED_QUEUE_SIZE
+#define HOST_SCHED_QUEUE_SIZE   10
+#endif
+
+/* Largest event the scheduler accepts (bytes) */
+#define HOST_SCHED_EVENT_SIZE   16
+
+/**
+ * Install the MAX3421E model as the SPI transport and bring the stack up with a connect
+ * detect interrupt armed, like main() does
+ */
+void HOST_start(void);
+
+/**
+ * One pass of the main loop: run one scheduler event, or sleep until the next interrupt
+ */
+void HOST_step(void);
+
+/**
+ * Run the main loop until a condition holds
+ *
+ * Parameters:
+ * bool(*done)(void): checked after every pass
+ * uint32_t limit: passes to give up after
+ *
+ * Returns:
+ * bool: true if the condition held, false if the limit was reached
+ */
+bool HOST_run(bool(*)(void), uint32_t);
+
+/**
+ * Run a number of main loop passes
+ *
+ * Parameters:
+ * uint32_t passes: passes to run
+ */
+void HOST_idle(uint32_t);
+
+/**
+ * Get the most events the scheduler queue has held at once
+ *
+ * Returns:
+ * uint_fast16_t: the high-water mark since HOST_start
+ */
+uint_fast16_t HOST_getQueuePeak(void);
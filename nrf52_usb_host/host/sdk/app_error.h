@@ -0,0 +1,12 @@
+#pragma once
+/*
+ * Host build: errors end the test program (platform.c)
+ */
+
+#include "sdk_errors.h"
+
+void app_error_handler_bare(ret_code_t);
+
+#define APP_ERROR_CHECK(err_code)   do { if (err_code) app_error_handler_bare(err_code); } while (0)
+#define APP_ERROR_HANDLER(err_code) app_error_handler_bare(err_code)
+#define APP_ERROR_CHECK_BOOL(value) do { if (!(value)) app_error_handler_bare(NRF_ERROR_INTERNAL); } while (0)
@@ -0,0 +1,15 @@
+#pragma once
+/*
+ * Host build: the app_scheduler API, implemented in platform.c with a queue of
+ * HOST_SCHED_QUEUE_SIZE events
+ */
+
+#include <stdint.h>
+
+#include "sdk_errors.h"
+#include "app_error.h"
+
+typedef void(*app_sched_event_handler_t)(void *, uint16_t);
+
+ret_code_t app_sched_event_put(void const *, uint16_t, app_sched_event_handler_t);
+void app_sched_execute(void);
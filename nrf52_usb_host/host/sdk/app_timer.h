@@ -0,0 +1,26 @@
+#pragma once
+/*
+ * Host build: the app_timer API, implemented in platform.c on the simulated clock
+ */
+
+#include <stdint.h>
+
+#include "sdk_errors.h"
+#include "app_error.h"
+
+#define APP_TIMER_CLOCK_FREQ                32768
+#define APP_TIMER_MIN_TIMEOUT_TICKS         5
+#define APP_TIMER_SCHED_EVENT_DATA_SIZE     8
+#define APP_TIMER_TICKS(ms)                 ((uint32_t)(((uint64_t)(ms) * APP_TIMER_CLOCK_FREQ) / 1000))
+
+typedef void * app_timer_id_t;
+typedef void(*app_timer_timeout_handler_t)(void *);
+typedef enum { APP_TIMER_MODE_SINGLE_SHOT, APP_TIMER_MODE_REPEATED } app_timer_mode_t;
+
+#define APP_TIMER_DEF(id)   static void * id##_data; static app_timer_id_t const id = &id##_data
+
+ret_code_t app_timer_create(app_timer_id_t const *, app_timer_mode_t, app_timer_timeout_handler_t);
+ret_code_t app_timer_start(app_timer_id_t, uint32_t, void *);
+ret_code_t app_timer_stop(app_timer_id_t);
+uint32_t app_timer_cnt_get(void);
+uint32_t app_timer_cnt_diff_compute(uint32_t, uint32_t);
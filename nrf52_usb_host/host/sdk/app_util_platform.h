@@ -0,0 +1,9 @@
+#pragma once
+/*
+ * Host build: single-threaded, so critical regions are empty
+ */
+
+#define CRITICAL_REGION_ENTER()     {
+#define CRITICAL_REGION_EXIT()      }
+
+#define APP_IRQ_PRIORITY_LOWEST     7
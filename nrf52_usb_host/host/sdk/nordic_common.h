@@ -0,0 +1,10 @@
+#pragma once
+/*
+ * Host build: the helper macros of nordic_common.h the driver uses
+ */
+
+#define MIN(a, b)                   ((a) < (b) ? (a) : (b))
+#define MAX(a, b)                   ((a) > (b) ? (a) : (b))
+#define ARRAY_SIZE(array)           (sizeof(array) / sizeof((array)[0]))
+#define UNUSED_PARAMETER(x)         ((void)(x))
+#define UNUSED_VARIABLE(x)          ((void)(x))
@@ -0,0 +1,23 @@
+#pragma once
+/*
+ * Host build: the TIMER registers bench.c uses; the instance is in platform.c
+ */
+
+#include <stdint.h>
+
+typedef struct {
+	volatile uint32_t TASKS_START;
+	volatile uint32_t TASKS_STOP;
+	volatile uint32_t TASKS_CLEAR;
+	volatile uint32_t TASKS_CAPTURE[6];
+	volatile uint32_t MODE;
+	volatile uint32_t BITMODE;
+	volatile uint32_t PRESCALER;
+	volatile uint32_t CC[6];
+} NRF_TIMER_Type;
+
+extern NRF_TIMER_Type HOST_timer2;
+
+#define NRF_TIMER2                      (&HOST_timer2)
+#define TIMER_MODE_MODE_Timer           0
+#define TIMER_BITMODE_BITMODE_32Bit     3
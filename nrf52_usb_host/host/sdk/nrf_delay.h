@@ -0,0 +1,9 @@
+#pragma once
+/*
+ * Host build: delays advance the simulated clock (platform.c)
+ */
+
+#include <stdint.h>
+
+void nrf_delay_ms(uint32_t);
+void nrf_delay_us(uint32_t);
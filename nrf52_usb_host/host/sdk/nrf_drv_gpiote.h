@@ -0,0 +1,32 @@
+#pragma once
+/*
+ * Host build: the GPIO and GPIOTE calls of the driver. The INT pin follows the MAX3421E
+ * model (platform.c)
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdk_errors.h"
+
+typedef uint32_t nrf_drv_gpiote_pin_t;
+typedef int nrf_gpiote_polarity_t;
+
+typedef struct {
+	int sense;
+	int pull;
+	bool is_watcher;
+	bool hi_accuracy;
+} nrf_drv_gpiote_in_config_t;
+
+#define GPIOTE_CONFIG_IN_SENSE_HITOLO(accuracy)     { 0, 0, false, (accuracy) }
+#define NRF_GPIO_PIN_PULLUP                         3
+
+typedef void(*nrf_drv_gpiote_evt_handler_t)(nrf_drv_gpiote_pin_t, nrf_gpiote_polarity_t);
+
+ret_code_t nrf_drv_gpiote_in_init(nrf_drv_gpiote_pin_t, nrf_drv_gpiote_in_config_t const *, nrf_drv_gpiote_evt_handler_t);
+void nrf_drv_gpiote_in_event_enable(nrf_drv_gpiote_pin_t, bool);
+void nrf_gpio_cfg_output(uint32_t);
+void nrf_gpio_pin_set(uint32_t);
+void nrf_gpio_pin_toggle(uint32_t);
+uint32_t nrf_gpio_pin_read(uint32_t);
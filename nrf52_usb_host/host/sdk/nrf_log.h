@@ -0,0 +1,10 @@
+#pragma once
+/*
+ * Host build: logging is compiled out
+ */
+
+#define NRF_LOG_MODULE_REGISTER()   extern int nrf_log_module_unused
+#define NRF_LOG_INFO(...)           ((void) 0)
+#define NRF_LOG_DEBUG(...)          ((void) 0)
+#define NRF_LOG_WARNING(...)        ((void) 0)
+#define NRF_LOG_ERROR(...)          ((void) 0)
@@ -0,0 +1,6 @@
+#pragma once
+/*
+ * Host build: sleeping lets the simulated clock run to the next event (platform.c)
+ */
+
+void nrf_pwr_mgmt_run(void);
@@ -0,0 +1,59 @@
+#pragma once
+/*
+ * Host build: the types of nrf_spi_mngr.h the driver uses. The functions are stubs in
+ * platform.c; the simulator replaces the transport anyway
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "sdk_errors.h"
+
+typedef struct { int instance; } nrf_drv_spi_t;
+
+typedef struct {
+	uint8_t sck_pin;
+	uint8_t mosi_pin;
+	uint8_t miso_pin;
+	uint8_t ss_pin;
+	uint8_t irq_priority;
+	uint8_t orc;
+	int frequency;
+	int mode;
+	int bit_order;
+} nrf_drv_spi_config_t;
+
+#define SPI_FREQUENCY_FREQUENCY_M4          0
+#define SPI_FREQUENCY_FREQUENCY_M8          1
+#define NRF_DRV_SPI_MODE_0                  0
+#define NRF_DRV_SPI_BIT_ORDER_MSB_FIRST     0
+
+typedef struct {
+	uint8_t const * p_tx_data;
+	uint8_t tx_length;
+	uint8_t * p_rx_data;
+	uint8_t rx_length;
+} nrf_spi_mngr_transfer_t;
+
+typedef void(*nrf_spi_mngr_callback_end_t)(ret_code_t, void *);
+typedef void(*nrf_spi_mngr_callback_begin_t)(void *);
+
+typedef struct {
+	nrf_spi_mngr_callback_begin_t begin_callback;
+	nrf_spi_mngr_callback_end_t end_callback;
+	void * p_user_data;
+	nrf_spi_mngr_transfer_t const * p_transfers;
+	uint8_t number_of_transfers;
+	nrf_drv_spi_config_t const * p_required_spi_cfg;
+} nrf_spi_mngr_transaction_t;
+
+typedef struct { int instance; } nrf_spi_mngr_t;
+
+#define NRF_SPI_MNGR_DEF(name, queue, instance)     nrf_spi_mngr_t name
+#define NRF_SPI_MNGR_TRANSFER(tx, txLength, rx, rxLength) \
+	{ .p_tx_data = (uint8_t const *)(tx), .tx_length = (txLength), .p_rx_data = (uint8_t *)(rx), .rx_length = (rxLength) }
+
+ret_code_t nrf_spi_mngr_init(nrf_spi_mngr_t const *, nrf_drv_spi_config_t const *);
+ret_code_t nrf_spi_mngr_perform(nrf_spi_mngr_t const *, nrf_drv_spi_config_t const *, nrf_spi_mngr_transfer_t const *, uint8_t, void(*)(void));
+ret_code_t nrf_spi_mngr_schedule(nrf_spi_mngr_t const *, nrf_spi_mngr_transaction_t const *);
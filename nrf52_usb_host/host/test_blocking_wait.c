@@ -0,0 +1,65 @@
+/*
+ * test_blocking_wait.c
+ *
+ * A blocking transfer sleeps until the INT line drops. While the poller runs, FRAME
+ * fires every millisecond and would keep the line low: the wait must not turn into a
+ * loop that reads HIRQ over SPI until the transfer is done
+ */
+
+#include "check.h"
+#include "platform.h"
+#include "max_sim.h"
+#include "vdev.h"
+#include "usb.h"
+#include "poller.h"
+
+/* NAKs before every control packet: the descriptor read takes a few frames */
+#define BLOCKING_CONTROL_NAKS   30
+/* SPI cycles a token may take: HIRQ, clearing HXFRDN, HRSL, the toggle and the HXFR */
+#define BLOCKING_SPI_PER_TOKEN  8
+
+static VirtualDevice device;
+
+static bool _settled(void);
+static void _onReport(uint8_t const *, uint_fast8_t, void *);
+
+int main(void) {
+	USBDevice * root;
+	MaxSimStats stats;
+	uint8_t descriptor[18];
+
+	HOST_start();
+	VDEV_initKeyboard(&device);
+	MAXSIM_attach(&device.port);
+	CHECK(HOST_run(_settled, 200000));
+	CHECK(USB_getState() == USB_STATE_READY);
+
+	root = USB_getRootDevice();
+	CHECK(POLL_addEndpoint(root->address, DESC_findEndpoint(&root->model, epINTERRUPT, true), _onReport, NULL) == rslSUCCES);
+	HOST_idle(100);
+
+	VDEV_setDelay(&device, 0, BLOCKING_CONTROL_NAKS);
+	MAXSIM_resetStats();
+	CHECK(USB_getDescriptor(root->address, descDEVICE, 0, 0, descriptor, sizeof(descriptor), NULL) == rslSUCCES);
+	MAXSIM_getStats(&stats);
+	printf("%u SPI cycles for %u tokens in %llu us\n", (unsigned) stats.spiTransactions, (unsigned) stats.usbTransactions, (unsigned long long) (stats.usbNs + stats.spiNs) / 1000);
+	CHECK(stats.usbTransactions > BLOCKING_CONTROL_NAKS);
+	CHECK(stats.spiTransactions <= BLOCKING_SPI_PER_TOKEN * stats.usbTransactions);
+
+	/* The poller gets its frames back afterwards */
+	MAXSIM_resetStats();
+	HOST_idle(1000);
+	MAXSIM_getStats(&stats);
+	CHECK(stats.usbTransactions > 0);
+	return CHECK_RESULT();
+}
+
+static bool _settled(void) {
+	return USB_getState() == USB_STATE_READY || USB_getState() == USB_STATE_FAILED;
+}
+
+static void _onReport(uint8_t const * data, uint_fast8_t length, void * context) {
+	UNUSED_PARAMETER(data);
+	UNUSED_PARAMETER(length);
+	UNUSED_PARAMETER(context);
+}
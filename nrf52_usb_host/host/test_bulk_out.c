@@ -0,0 +1,81 @@
+/*
+ * test_bulk_out.c
+ *
+ * Bulk OUT writes to a device that NAKs every packet a few times. The MAX3421E drops a
+ * SNDFIFO packet the device did not ACK, and so does the model: every byte only gets
+ * there if each retry reloads its packet, and the packets stay in order
+ */
+
+#include "check.h"
+#include "platform.h"
+#include "max_sim.h"
+#include "vdev.h"
+#include "usb.h"
+#include "bulk.h"
+
+/* The bulk OUT endpoint of VDEV_initBulk */
+#define BULK_OUT_EP             1
+#define BULK_OUT_BYTES          200
+
+static VirtualDevice device;
+static bool written;
+static uint_fast8_t writeResult;
+static uint_fast16_t writeAcknowledged;
+
+static bool _settled(void);
+static bool _written(void);
+static void _write(uint_fast8_t);
+static void _onWritten(uint_fast8_t, uint_fast16_t, void *);
+
+int main(void) {
+	HOST_start();
+	VDEV_initBulk(&device);
+	MAXSIM_attach(&device.port);
+	CHECK(HOST_run(_settled, 200000));
+	CHECK(USB_getState() == USB_STATE_READY);
+
+	_write(0);
+	_write(2);
+	return CHECK_RESULT();
+}
+
+static bool _settled(void) {
+	return USB_getState() == USB_STATE_READY || USB_getState() == USB_STATE_FAILED;
+}
+
+static bool _written(void) {
+	return written;
+}
+
+/* Write a block with every packet NAKed 'naks' times first, and check what arrived */
+static void _write(uint_fast8_t naks) {
+	static uint8_t data[BULK_OUT_BYTES];
+	VirtualStats before, stats;
+	uint_fast16_t it;
+
+	for (it = 0; it < sizeof(data); it++)
+		data[it] = (uint8_t) it;
+
+	VDEV_setDelay(&device, BULK_OUT_EP, naks);
+	VDEV_getStats(&device, &before);
+	written = false;
+	CHECK(BULK_write(USB_getRootDevice()->address, BULK_OUT_EP, data, sizeof(data), _onWritten, NULL) == rslSUCCES);
+	CHECK(HOST_run(_written, 200000));
+
+	VDEV_getStats(&device, &stats);
+	stats.outPackets -= before.outPackets;
+	stats.outBytes -= before.outBytes;
+	stats.naks -= before.naks;
+	printf("%u NAKs per packet: %u packets, %u bytes, %u NAKs\n", (unsigned) naks, (unsigned) stats.outPackets, (unsigned) stats.outBytes, (unsigned) stats.naks);
+	CHECK(writeResult == rslSUCCES);
+	CHECK(writeAcknowledged == sizeof(data));
+	CHECK(stats.outPackets == (sizeof(data) + 63) / 64);
+	CHECK(stats.outBytes == sizeof(data));
+}
+
+static void _onWritten(uint_fast8_t result, uint_fast16_t acknowledged, void * context) {
+	UNUSED_PARAMETER(context);
+	writeResult = result;
+	writeAcknowledged = acknowledged;
+	written = true;
+}
@@ -0,0 +1,43 @@
+/*
+ * test_hid_parser.c
+ *
+ * Report descriptors compiled into field tables: every field must get the usage its own
+ * main item declared, and a field that declares none must not inherit one
+ */
+
+#include "check.h"
+#include "hidreport.h"
+
+#define USAGE_X                 0x30
+#define USAGE_Y                 0x31
+
+/* A relative X/Y pair, then a variable byte without a Usage of its own */
+static uint8_t const unnamedField[] = {
+	0x05, 0x01,         /* Usage Page (Generic Desktop) */
+	0x09, 0x02,         /* Usage (Mouse) */
+	0xA1, 0x01,         /* Collection (Application) */
+	0x09, 0x30,         /*   Usage (X) */
+	0x09, 0x31,         /*   Usage (Y) */
+	0x15, 0x81,         /*   Logical Minimum (-127) */
+	0x25, 0x7F,         /*   Logical Maximum (127) */
+	0x75, 0x08,         /*   Report Size (8) */
+	0x95, 0x02,         /*   Report Count (2) */
+	0x81, 0x06,         /*   Input (Data, Variable, Relative) */
+	0x95, 0x01,         /*   Report Count (1) */
+	0x81, 0x02,         /*   Input (Data, Variable, Absolute) */
+	0xC0                /* End Collection */
+};
+
+int main(void) {
+	static HidReportMap map;
+
+	CHECK(HID_parseReportDescriptor(unnamedField, sizeof(unnamedField), &map) == hidOK);
+	CHECK(map.fieldCount == 3);
+	CHECK(map.fields[0].usage == USAGE_X);
+	CHECK(map.fields[1].usage == USAGE_Y);
+	CHECK(map.fields[2].usage == 0);
+	CHECK(map.fields[2].bitOffset == 16);
+	CHECK(HID_findField(&map, 0x01, USAGE_X) == 0);
+	CHECK(HID_findField(&map, 0x01, USAGE_Y) == 1);
+	return CHECK_RESULT();
+}
@@ -0,0 +1,123 @@
+/*
+ * test_max_sim.c
+ *
+ * Enumerates a minimal hand-written boot mouse through the MAX3421E model: the device
+ * only answers what the enumeration asks for, so this checks the model and the stack
+ * against each other without the virtual device library
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "platform.h"
+#include "max_sim.h"
+#include "max3421e.h"
+#include "usb.h"
+
+typedef struct {
+	MaxSimPort port;            /* must be first */
+	uint8_t address;
+	uint8_t configuration;
+	uint8_t setup[8];
+	uint8_t const * response;
+	uint_fast16_t responseLength;
+	uint_fast16_t sent;
+} TestDevice;
+
+static uint8_t const deviceDescriptor[18] = {
+	18, 1, 0x00, 0x02, 0, 0, 0, 8, 0x6d, 0x04, 0x16, 0xc0, 0x00, 0x01, 0, 0, 0, 1
+};
+
+static uint8_t const configDescriptor[34] = {
+	9, 2, 34, 0, 1, 1, 0, 0xa0, 50,
+	9, 4, 0, 0, 1, 3, 1, 2, 0,
+	9, 0x21, 0x11, 0x01, 0, 1, 0x22, 50, 0,
+	7, 5, 0x81, 3, 4, 0, 10
+};
+
+static uint_fast8_t _token(MaxSimPort *, uint_fast8_t, uint_fast8_t, uint_fast8_t, uint8_t *, uint_fast8_t *);
+static void _busReset(MaxSimPort *);
+static bool _settled(void);
+
+static TestDevice mouse = { { _token, _busReset, USB_SPEED_FULL } };
+
+int main(void) {
+	MaxSimStats stats;
+
+	HOST_start();
+	CHECK(MAX_readRegister(rREVISION) == MAXSIM_REVISION);
+
+	MAXSIM_attach(&mouse.port);
+	CHECK(HOST_run(_settled, 200000));
+	MAXSIM_getStats(&stats);
+
+	CHECK(USB_getState() == USB_STATE_READY);
+	CHECK(mouse.address != 0);
+	CHECK(mouse.configuration == 1);
+	CHECK(USB_getDevice()->interfaceCount == 1);
+	CHECK(USB_getDevice()->endpointCount == 1);
+	CHECK(stats.errors == 0);
+	CHECK(stats.collisions == 0);
+	return CHECK_RESULT();
+}
+
+static uint_fast8_t _token(MaxSimPort * port, uint_fast8_t token, uint_fast8_t address, uint_fast8_t endpoint, uint8_t * data, uint_fast8_t * length) {
+	TestDevice * device = (TestDevice *) port;
+	uint_fast16_t count;
+
+	if (address != device->address)
+		return rslTIMEOUT;
+
+	switch (token) {
+	case xfrSETUP:
+		memcpy(device->setup, data, 8);
+		device->response = NULL;
+		device->responseLength = 0;
+		device->sent = 0;
+		if (data[1] == 6) {
+			if (data[3] == 1) {
+				device->response = deviceDescriptor;
+				device->responseLength = sizeof(deviceDescriptor);
+			} else if (data[3] == 2) {
+				device->response = configDescriptor;
+				device->responseLength = sizeof(configDescriptor);
+			} else {
+				return rslSTALL;
+			}
+			device->responseLength = MIN(device->responseLength, (uint_fast16_t)(data[6] | data[7] << 8));
+		}
+		return rslSUCCES;
+
+	case xfrIN:
+		/* The interrupt endpoint has nothing to report */
+		if (endpoint)
+			return rslNAK;
+		count = MIN(device->responseLength - device->sent, 8);
+		memcpy(data, device->response + device->sent, count);
+		device->sent += count;
+		*length = count;
+		return rslSUCCES;
+
+	case xfrINHS:
+		*length = 0;
+		if (device->setup[1] == 5)
+			device->address = device->setup[2];
+		else if (device->setup[1] == 9)
+			device->configuration = device->setup[2];
+		return rslSUCCES;
+
+	case xfrOUTHS:
+		return rslSUCCES;
+
+	default:
+		return rslSTALL;
+	}
+}
+
+static void _busReset(MaxSimPort * port) {
+	((TestDevice *) port)->address = 0;
+}
+
+static bool _settled(void) {
+	return USB_getState() == USB_STATE_READY || USB_getState() == USB_STATE_FAILED;
+}
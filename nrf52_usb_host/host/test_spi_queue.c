@@ -0,0 +1,142 @@
+/*
+ * test_spi_queue.c
+ *
+ * The request queue of simple_spi.c on a mock transport that holds scheduled requests
+ * until the test completes them, and can refuse one: slots must come back in order
+ * whether a request finished or was refused, and payloads longer than a burst must be
+ * split or rejected, never truncated
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "simple_spi.h"
+
+#define MOCK_COMMAND            0x0A
+
+static SPIRequest * queued[SIMSPI_REQUEST_SLOTS];
+static uint_fast8_t queuedHead;
+static uint_fast8_t queuedCount;
+static ret_code_t refuseWith;
+static bool queueBehind;        /* an interrupt queues a request while one is being refused */
+
+static uint8_t performed[4];
+static uint_fast8_t performCount;
+
+static uint_fast8_t callbacks;
+static ret_code_t lastResult;
+
+static void _start(void);
+static ret_code_t _perform(uint8_t *, uint8_t *, uint8_t);
+static ret_code_t _schedule(SPIRequest *, uint_fast8_t);
+static void _completeOldest(void);
+static void _onDone(ret_code_t, void *);
+
+static SPITransport const mockTransport = {
+	.start = _start,
+	.perform = _perform,
+	.schedule = _schedule
+};
+
+int main(void) {
+	uint_fast8_t tx[150], rx[150];
+	uint_fast8_t it;
+
+	SIMSPI_setTransport(&mockTransport);
+	SIMSPI_startSPI();
+	CHECK(SIMSPI_isIdle());
+
+	/* A refused request behind one in flight, with another queued behind it before the
+	 * refusal: it gets no callback, and its slot comes back once the one before it is done */
+	CHECK(SIMSPI_schedule(MOCK_COMMAND, NULL, NULL, 1, _onDone, NULL) == NRF_SUCCESS);
+	refuseWith = NRF_ERROR_BUSY;
+	queueBehind = true;
+	CHECK(SIMSPI_schedule(MOCK_COMMAND, NULL, NULL, 1, _onDone, NULL) == NRF_ERROR_BUSY);
+	CHECK(!queueBehind);
+	CHECK(queuedCount == 2);
+	_completeOldest();
+	_completeOldest();
+	CHECK(callbacks == 2);
+	CHECK(SIMSPI_isIdle());
+
+	/* A refused request with nothing in flight is released at once */
+	CHECK(SIMSPI_schedule(MOCK_COMMAND, NULL, NULL, 1, _onDone, NULL) == NRF_ERROR_BUSY);
+	refuseWith = NRF_SUCCESS;
+	CHECK(SIMSPI_isIdle());
+
+	/* Every slot can be used again, and no more */
+	for (it = 0; it < SIMSPI_REQUEST_SLOTS; it++)
+		CHECK(SIMSPI_schedule(MOCK_COMMAND, NULL, NULL, 1, _onDone, NULL) == NRF_SUCCESS);
+	CHECK(SIMSPI_schedule(MOCK_COMMAND, NULL, NULL, 1, _onDone, NULL) == NRF_ERROR_NO_MEM);
+	for (it = 0; it < SIMSPI_REQUEST_SLOTS; it++)
+		_completeOldest();
+	CHECK(SIMSPI_isIdle());
+	CHECK(lastResult == NRF_SUCCESS);
+
+	/* Too long to queue in one slot */
+	CHECK(SIMSPI_schedule(MOCK_COMMAND, tx, NULL, SIMSPI_MAX_PAYLOAD + 1, _onDone, NULL) == NRF_ERROR_INVALID_LENGTH);
+	CHECK(SIMSPI_isIdle());
+
+	/* A blocking burst is split, each part led by the command byte. The mock echoes
+	 * every byte plus one */
+	for (it = 0; it < sizeof(tx); it++)
+		tx[it] = (uint_fast8_t) it;
+	memset(rx, 0, sizeof(rx));
+	CHECK(SIMSPI_transferBurst(MOCK_COMMAND, tx, rx, sizeof(tx)) == (uint8_t)(sizeof(tx) - 1 + 1));
+	CHECK(performCount == 3);
+	CHECK(performed[0] == SIMSPI_MAX_PAYLOAD + 1);
+	CHECK(performed[1] == SIMSPI_MAX_PAYLOAD + 1);
+	CHECK(performed[2] == sizeof(tx) - 2 * SIMSPI_MAX_PAYLOAD + 1);
+	for (it = 0; it < sizeof(rx); it++)
+		CHECK(rx[it] == (uint8_t)(it + 1));
+	return CHECK_RESULT();
+}
+
+static void _start(void) {
+}
+
+static ret_code_t _perform(uint8_t * tx, uint8_t * rx, uint8_t length) {
+	uint_fast8_t it;
+
+	CHECK(tx[0] == MOCK_COMMAND);
+	rx[0] = 0;
+	for (it = 1; it < length; it++)
+		rx[it] = tx[it] + 1;
+	if (performCount < sizeof(performed))
+		performed[performCount] = length;
+	performCount++;
+	return NRF_SUCCESS;
+}
+
+static ret_code_t _schedule(SPIRequest * request, uint_fast8_t slot) {
+	UNUSED_PARAMETER(slot);
+	if (refuseWith != NRF_SUCCESS) {
+		if (queueBehind) {
+			queueBehind = false;
+			refuseWith = NRF_SUCCESS;
+			CHECK(SIMSPI_schedule(MOCK_COMMAND, NULL, NULL, 1, _onDone, NULL) == NRF_SUCCESS);
+			refuseWith = NRF_ERROR_BUSY;
+		}
+		return refuseWith;
+	}
+	queued[(queuedHead + queuedCount++) % SIMSPI_REQUEST_SLOTS] = request;
+	return NRF_SUCCESS;
+}
+
+static void _completeOldest(void) {
+	SPIRequest * request;
+
+	CHECK(queuedCount > 0);
+	if (!queuedCount)
+		return;
+	request = queued[queuedHead];
+	queuedHead = (queuedHead + 1) % SIMSPI_REQUEST_SLOTS;
+	queuedCount--;
+	SIMSPI_complete(request, NRF_SUCCESS);
+}
+
+static void _onDone(ret_code_t result, void * context) {
+	UNUSED_PARAMETER(context);
+	callbacks++;
+	lastResult = result;
+}
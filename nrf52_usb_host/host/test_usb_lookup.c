@@ -0,0 +1,97 @@
+/*
+ * test_usb_lookup.c
+ *
+ * USB_findDevice must find every device that has an address. Everything that keeps
+ * per-device state goes through it: the data toggles, the retry policies, the control
+ * packet size and the pipe speed. A broken lookup still enumerates, so this checks the
+ * state itself and what the interrupt polling looks like on the wire
+ */
+
+#include "check.h"
+#include "platform.h"
+#include "max_sim.h"
+#include "vdev.h"
+#include "usb.h"
+#include "poller.h"
+
+/* Interrupt polling is watched for this long (ns); the keyboard asks for 10 ms */
+#define LOOKUP_POLL_NS          60000000ULL
+
+static VirtualDevice device;
+
+static bool _settled(void);
+static void _onReport(uint8_t const *, uint_fast8_t, void *);
+
+int main(void) {
+	USBDevice * root;
+	MaxSimStats stats;
+	uint64_t until;
+	uint_fast8_t address;
+	uint_fast8_t status[2];
+
+	HOST_start();
+	CHECK(USB_findDevice(0) == NULL);
+
+	/* Full speed with 64-byte control packets */
+	VDEV_initBulk(&device);
+	MAXSIM_attach(&device.port);
+	CHECK(HOST_run(_settled, 200000));
+	CHECK(USB_getState() == USB_STATE_READY);
+
+	root = USB_getRootDevice();
+	CHECK(root->address != 0);
+	CHECK(USB_findDevice(root->address) == root);
+	for (address = 1; address <= USB_MAX_DEVICES; address++) {
+		if (address != root->address)
+			CHECK(USB_findDevice(address) == NULL);
+	}
+	CHECK(USB_findDevice(USB_MAX_DEVICES + 1) == NULL);
+	CHECK(root->model.maxPacketSize0 == 64);
+
+	/* GET_STATUS lands in the caller's buffer */
+	status[0] = status[1] = 0xFF;
+	CHECK(USB_requestStatus(status) == rslSUCCES);
+	CHECK(status[0] == 0 && status[1] == 0);
+
+	USB_setToggle(root->address, 2, true, true);
+	CHECK(USB_getToggle(root->address, 2, true));
+	CHECK(!USB_getToggle(root->address, 2, false));
+	USB_setToggle(root->address, 2, true, false);
+	CHECK(!USB_getToggle(root->address, 2, true));
+
+	MAXSIM_detach();
+	HOST_idle(100);
+	CHECK(USB_findDevice(root->address) == NULL);
+
+	/* Low speed; its interrupt endpoint NAKs. Every poll must give up after one NAK and
+	 * come back at the next interval, not spin on the NAKs until the bulk retry limit */
+	VDEV_initKeyboard(&device);
+	MAXSIM_attach(&device.port);
+	CHECK(HOST_run(_settled, 200000));
+	CHECK(USB_getState() == USB_STATE_READY);
+
+	root = USB_getRootDevice();
+	CHECK(USB_findDevice(root->address) == root);
+	CHECK(root->speed == USB_SPEED_LOW);
+	CHECK(POLL_addEndpoint(root->address, DESC_findEndpoint(&root->model, epINTERRUPT, true), _onReport, NULL) == rslSUCCES);
+
+	MAXSIM_resetStats();
+	until = MAXSIM_now() + LOOKUP_POLL_NS;
+	while (MAXSIM_now() < until)
+		HOST_step();
+	MAXSIM_getStats(&stats);
+	printf("%u polls, %u NAKs in %llu ms\n", (unsigned) stats.usbTransactions, (unsigned) stats.naks, LOOKUP_POLL_NS / 1000000);
+	CHECK(stats.usbTransactions >= LOOKUP_POLL_NS / 10000000);
+	CHECK(stats.usbTransactions <= 2 * LOOKUP_POLL_NS / 10000000);
+	return CHECK_RESULT();
+}
+
+static bool _settled(void) {
+	return USB_getState() == USB_STATE_READY || USB_getState() == USB_STATE_FAILED;
+}
+
+static void _onReport(uint8_t const * data, uint_fast8_t length, void * context) {
+	UNUSED_PARAMETER(data);
+	UNUSED_PARAMETER(length);
+	UNUSED_PARAMETER(context);
+}
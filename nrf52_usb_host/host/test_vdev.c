@@ -0,0 +1,114 @@
+/*
+ * test_vdev.c
+ *
+ * Enumerates every virtual device model in turn on the MAX3421E model, and the bulk
+ * device with a STALL and with no answer at all: the devices that work must end up
+ * READY with their interfaces and endpoints found, the dead one must end up FAILED
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "platform.h"
+#include "max_sim.h"
+#include "vdev.h"
+#include "max3421e.h"
+#include "usb.h"
+#include "poller.h"
+
+static VirtualDevice device;
+static uint_fast16_t reports;
+static uint8_t lastReport[8];
+
+static bool _settled(void);
+static USBState _enumerate(uint_fast8_t, uint_fast8_t);
+static void _detach(void);
+static void _onReport(uint8_t const *, uint_fast8_t, void *);
+
+int main(void) {
+	VirtualFault stall = { 0, xfrIN, rslSTALL, 2, 1 };
+	VirtualFault dead = { 0, VDEV_ANY_TOKEN, rslTIMEOUT, 0, VDEV_FOREVER };
+	uint8_t const key[8] = { 0, 0, 4 };
+	VirtualStats stats;
+
+	HOST_start();
+
+	VDEV_initMouse(&device);
+	CHECK(_enumerate(1, 1) == USB_STATE_READY);
+	_detach();
+
+	/* The keyboard NAKs its interrupt endpoint until a key is queued */
+	VDEV_initKeyboard(&device);
+	CHECK(_enumerate(1, 1) == USB_STATE_READY);
+	CHECK(POLL_addEndpoint(USB_getRootDevice()->address, DESC_findEndpoint(USB_getDevice(), epINTERRUPT, true), _onReport, NULL) == rslSUCCES);
+	HOST_idle(2000);
+	CHECK(reports == 0);
+	CHECK(VDEV_queueReport(&device, 0x81, key, sizeof(key)));
+	HOST_idle(2000);
+	CHECK(reports == 1);
+	CHECK(lastReport[2] == 4);
+	CHECK(POLL_nextSlot() == 1);
+	_detach();
+
+	/* The detach frees the poller slot, and with it whatever the caller keeps per slot */
+	CHECK(POLL_nextSlot() == 0);
+
+	VDEV_initComposite(&device);
+	CHECK(_enumerate(3, 4) == USB_STATE_READY);
+	_detach();
+
+	VDEV_initBulk(&device);
+	CHECK(_enumerate(1, 2) == USB_STATE_READY);
+	_detach();
+
+	/* One control IN packet STALLs: the step is retried */
+	VDEV_initBulk(&device);
+	CHECK(VDEV_injectFault(&device, &stall));
+	CHECK(_enumerate(1, 2) == USB_STATE_READY);
+	VDEV_getStats(&device, &stats);
+	CHECK(stats.faults == 1);
+	_detach();
+
+	VDEV_initBulk(&device);
+	CHECK(VDEV_injectFault(&device, &dead));
+	CHECK(_enumerate(0, 0) == USB_STATE_FAILED);
+
+	/* Nothing may flood the scheduler: a full queue loses timer events on the target */
+	printf("scheduler queue peak %u of %u\n", (unsigned) HOST_getQueuePeak(), HOST_SCHED_QUEUE_SIZE);
+	CHECK(HOST_getQueuePeak() < HOST_SCHED_QUEUE_SIZE);
+	return CHECK_RESULT();
+}
+
+static bool _settled(void) {
+	return USB_getState() == USB_STATE_READY || USB_getState() == USB_STATE_FAILED;
+}
+
+/* Plug the device in and wait for the enumeration to finish; check what was found if
+ * it got to READY */
+static USBState _enumerate(uint_fast8_t interfaces, uint_fast8_t endpoints) {
+	MaxSimStats stats;
+
+	MAXSIM_resetStats();
+	MAXSIM_attach(&device.port);
+	CHECK(HOST_run(_settled, 200000));
+	MAXSIM_getStats(&stats);
+	CHECK(stats.collisions == 0);
+
+	if (USB_getState() == USB_STATE_READY) {
+		CHECK(USB_getDevice()->interfaceCount == interfaces);
+		CHECK(USB_getDevice()->endpointCount == endpoints);
+	}
+	return USB_getState();
+}
+
+static void _detach(void) {
+	MAXSIM_detach();
+	HOST_idle(100);
+	CHECK(USB_getState() == USB_STATE_DETACHED);
+}
+
+static void _onReport(uint8_t const * data, uint_fast8_t length, void * context) {
+	UNUSED_PARAMETER(context);
+	reports++;
+	memcpy(lastReport, data, MIN(length, sizeof(lastReport)));
+}
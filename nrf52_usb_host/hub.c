@@ -0,0 +1,316 @@
+/*
+ * hub.c
+ *
+ * Hub class driver: powers the ports of a hub, watches its status-change endpoint and
+ * enumerates the devices plugged into it
+ */
+
+#include <string.h>
+
+#include "hub.h"
+#include "packets.h"
+#include "poller.h"
+#include "nrf_log.h"
+#include "app_timer.h"
+
+/* Steps of the port being serviced */
+typedef enum {
+	PORT_IDLE,
+	PORT_STATUS,
+	PORT_DEBOUNCE,
+	PORT_RESETTING,
+	PORT_ADDRESS,
+	PORT_CONFIGURE
+} PortState;
+
+typedef struct {
+	USBDevice * device;
+	DeviceReadyCallback callback;
+	uint8_t portCount;
+	uint8_t changed;                        /* bit n: port n reported a change */
+	uint8_t children[HUB_MAX_PORTS + 1];    /* address of the device on each port, 0 if none */
+	bool used;
+} Hub;
+
+APP_TIMER_DEF(portTimer);
+
+static Hub hubs[HUB_MAX_HUBS];
+static USBStepper portStepper;
+
+/* New devices all answer at address 0, so ports are serviced one at a time */
+static Hub * activeHub;
+static uint_fast8_t activePort;
+static PortState portState = PORT_IDLE;
+static uint_fast8_t resetPolls;
+static USBDevice * newDevice;
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static uint_fast8_t _hubRequest(uint_fast8_t, uint_fast8_t, uint_fast8_t, uint_fast16_t, uint_fast16_t, uint8_t *, uint_fast16_t);
+static uint_fast8_t _getPortStatus(uint_fast8_t, uint_fast16_t *, uint_fast16_t *);
+static void _statusChanged(uint8_t const *, uint_fast8_t, void *);
+static void _portStep(void);
+static void _portDone(void);
+static void _removeDevice(uint_fast8_t);
+
+/* PUBLIC FUNCTIONS */
+
+uint_fast8_t HUB_start(USBDevice * device, DeviceReadyCallback callback) {
+	EndpointInfo const * endpoint = DESC_findEndpoint(&device->model, epINTERRUPT, true);
+	uint8_t descriptor[HUB_DESCRIPTOR_LENGTH];
+	Hub * hub = NULL;
+	uint_fast8_t it, result;
+
+	if (!portStepper.step)
+		USB_createStepper(&portStepper, &portTimer, _portStep);
+
+	for (it = 0; it < HUB_MAX_HUBS; it++) {
+		if (!hubs[it].used) {
+			hub = &hubs[it];
+			break;
+		}
+	}
+	if (!hub || !endpoint)
+		return rslBADREQ;
+
+	/* bNbrPorts and bPwrOn2PwrGood are all we need from the hub descriptor */
+	result = _hubRequest(device->address, 0xA0, reqGET_DESCRIPTOR, descHUB << 8, 0, descriptor, HUB_DESCRIPTOR_LENGTH);
+	if (result)
+		return result;
+
+	memset(hub, 0, sizeof(Hub));
+	hub->device = device;
+	hub->callback = callback;
+	hub->portCount = MIN(descriptor[2], HUB_MAX_PORTS);
+
+	for (it = 1; it <= hub->portCount; it++) {
+		result = _hubRequest(device->address, 0x23, reqSET_FEATURE, ftPORT_POWER, it, NULL, 0);
+		if (result)
+			return result;
+	}
+	NRF_LOG_INFO("Hub %d: %d ports\n", device->address, hub->portCount);
+	hub->used = true;
+
+	/* The first status change can only arrive after power is good (bPwrOn2PwrGood x 2 ms),
+	 * so the poll interval takes care of the wait */
+	POLL_addEndpoint(device->address, endpoint, _statusChanged, hub);
+	return rslSUCCES;
+}
+
+void HUB_stop(void) {
+	USB_cancelSteps(&portStepper);
+	memset(hubs, 0, sizeof(hubs));
+	activeHub = NULL;
+	newDevice = NULL;
+	portState = PORT_IDLE;
+}
+
+/* PRIVATE FUNCTIONS */
+
+static uint_fast8_t _hubRequest(uint_fast8_t address,
+	uint_fast8_t bmRequestType,
+	uint_fast8_t bRequest,
+	uint_fast16_t wValue,
+	uint_fast16_t wIndex,
+	uint8_t * data,
+	uint_fast16_t length) {
+	ControlPacket packet = {
+		.perAddress = address,
+		.type = 0x10,
+		.endPoint = 0,
+		.bmRequestType = bmRequestType,
+		.bRequest = bRequest,
+		.wValue = wValue,
+		.wIndex = wIndex,
+		.wLength = length,
+		.direction = (bmRequestType & 0x80) ? DIR_IN : DIR_OUT,
+		.data = data
+	};
+	return sendControl(&packet);
+}
+
+static uint_fast8_t _getPortStatus(uint_fast8_t port, uint_fast16_t * status, uint_fast16_t * change) {
+	uint8_t buffer[4];
+	uint_fast8_t result;
+
+	result = _hubRequest(activeHub->device->address, 0xA3, reqGET_STATUS, 0, port, buffer, 4);
+	if (!result) {
+		*status = buffer[0] | (buffer[1] << 8);
+		*change = buffer[2] | (buffer[3] << 8);
+	}
+	return result;
+}
+
+/* Poller callback: may run inside another transfer, so only note the change */
+static void _statusChanged(uint8_t const * data, uint_fast8_t length, void * context) {
+	Hub * hub = (Hub *) context;
+
+	if (!length || !hub->used)
+		return;
+
+	/* Bit 0 is the hub itself (local power, over-current): nothing to do for bus power */
+	hub->changed |= data[0] & ~1;
+	if (hub->changed && portState == PORT_IDLE) {
+		portState = PORT_STATUS;
+		USB_nextStep(&portStepper, 0);
+	}
+}
+
+static void _portStep(void) {
+	uint_fast16_t status, change;
+	uint_fast8_t it;
+
+	/* Pick the next port with a pending change */
+	if (!activeHub) {
+		for (it = 0; it < HUB_MAX_HUBS && !activeHub; it++) {
+			if (hubs[it].used && hubs[it].changed)
+				activeHub = &hubs[it];
+		}
+		if (!activeHub) {
+			portState = PORT_IDLE;
+			return;
+		}
+		for (activePort = 1; !(activeHub->changed & (1 << activePort)); activePort++) ;
+		activeHub->changed &= ~(1 << activePort);
+		portState = PORT_STATUS;
+	}
+
+	switch (portState) {
+	case PORT_STATUS:
+		if (_getPortStatus(activePort, &status, &change)) {
+			_portDone();
+			break;
+		}
+
+		/* Acknowledge every change bit (C_PORT_CONNECTION .. C_PORT_RESET) */
+		for (it = 0; it < 5; it++) {
+			if (change & (1 << it))
+				_hubRequest(activeHub->device->address, 0x23, reqCLEAR_FEATURE, ftC_PORT_CONNECTION + it, activePort, NULL, 0);
+		}
+
+		if (!(change & PORT_CONNECTION)) {
+			_portDone();
+			break;
+		}
+		if (activeHub->children[activePort]) {
+			_removeDevice(activeHub->children[activePort]);
+			activeHub->children[activePort] = 0;
+		}
+		if (status & PORT_CONNECTION) {
+			portState = PORT_DEBOUNCE;
+			USB_nextStep(&portStepper, HUB_DEBOUNCE_MS);
+		}
+		else {
+			_portDone();
+		}
+		break;
+
+	case PORT_DEBOUNCE:
+		if (_getPortStatus(activePort, &status, &change) || !(status & PORT_CONNECTION)) {
+			_portDone();
+			break;
+		}
+		_hubRequest(activeHub->device->address, 0x23, reqSET_FEATURE, ftPORT_RESET, activePort, NULL, 0);
+		resetPolls = 0;
+		portState = PORT_RESETTING;
+		USB_nextStep(&portStepper, HUB_RESET_POLL_MS);
+		break;
+
+	case PORT_RESETTING:
+		if (_getPortStatus(activePort, &status, &change)) {
+			_portDone();
+			break;
+		}
+		if (!(change & PORT_RESET)) {
+			if (++resetPolls < HUB_RESET_TIMEOUT_POLLS)
+				USB_nextStep(&portStepper, HUB_RESET_POLL_MS);
+			else
+				_portDone();
+			break;
+		}
+		_hubRequest(activeHub->device->address, 0x23, reqCLEAR_FEATURE, ftC_PORT_RESET, activePort, NULL, 0);
+		if (!(status & PORT_ENABLE)) {
+			_portDone();
+			break;
+		}
+
+		newDevice = USB_allocateDevice();
+		if (!newDevice) {
+			NRF_LOG_INFO("Device table full, ignoring hub %d port %d\n", activeHub->device->address, activePort);
+			_portDone();
+			break;
+		}
+		newDevice->parent = activeHub->device->address;
+		newDevice->port = activePort;
+		newDevice->speed = (status & PORT_LOW_SPEED) ? USB_SPEED_LOW : USB_SPEED_FULL;
+		portState = PORT_ADDRESS;
+		USB_nextStep(&portStepper, USB_RESET_RECOVERY_MS);
+		break;
+
+	case PORT_ADDRESS:
+		if (USB_setNewPeripheralAddress(newDevice->address)) {
+			USB_freeDevice(newDevice);
+			_portDone();
+			break;
+		}
+		portState = PORT_CONFIGURE;
+		USB_nextStep(&portStepper, USB_SET_ADDRESS_RECOVERY_MS);
+		break;
+
+	case PORT_CONFIGURE:
+		if (USB_readDescriptors(newDevice) || USB_setConfiguration(newDevice)) {
+			NRF_LOG_INFO("Enumeration failed on hub %d port %d\n", activeHub->device->address, activePort);
+			USB_freeDevice(newDevice);
+			_portDone();
+			break;
+		}
+		activeHub->children[activePort] = newDevice->address;
+		if (activeHub->callback)
+			activeHub->callback(newDevice);
+		_portDone();
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* Done with this port: move on to the next change, if any */
+static void _portDone(void) {
+	uint_fast8_t it;
+
+	activeHub = NULL;
+	newDevice = NULL;
+	portState = PORT_IDLE;
+
+	for (it = 0; it < HUB_MAX_HUBS; it++) {
+		if (hubs[it].used && hubs[it].changed) {
+			portState = PORT_STATUS;
+			USB_nextStep(&portStepper, 0);
+			return;
+		}
+	}
+}
+
+/* Drop a device that was unplugged, with everything behind it if it was a hub */
+static void _removeDevice(uint_fast8_t address) {
+	USBDevice * device = USB_findDevice(address);
+	uint_fast8_t it, port;
+
+	if (!device)
+		return;
+
+	for (it = 0; it < HUB_MAX_HUBS; it++) {
+		if (hubs[it].used && hubs[it].device == device) {
+			for (port = 1; port <= hubs[it].portCount; port++) {
+				if (hubs[it].children[port])
+					_removeDevice(hubs[it].children[port]);
+			}
+			hubs[it].used = false;
+		}
+	}
+
+	NRF_LOG_INFO("Device %d removed\n", address);
+	POLL_removeDevice(address);
+	USB_freeDevice(device);
+}
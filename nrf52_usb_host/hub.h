@@ -0,0 +1,61 @@
+#pragma once
+/*
+ * hub.h
+ *
+ * Hub class driver: powers the ports of a hub, watches its status-change endpoint and
+ * enumerates the devices plugged into it
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usb.h"
+
+/* Number of hubs (including nested ones) that can be driven at the same time */
+#define HUB_MAX_HUBS            2
+
+/* Ports per hub that are serviced; the status-change bitmap is one byte */
+#define HUB_MAX_PORTS           7
+
+/* Port timing (ms), USB 2.0 spec 7.1.7.3 and 7.1.7.5 */
+#define HUB_DEBOUNCE_MS         100
+#define HUB_RESET_POLL_MS       10
+#define HUB_RESET_TIMEOUT_POLLS 10
+
+/* Hub Class Requests and Features */
+#define descHUB                 0x29
+#define HUB_DESCRIPTOR_LENGTH   7
+
+#define ftPORT_RESET            4
+#define ftPORT_POWER            8
+#define ftC_PORT_CONNECTION     16
+#define ftC_PORT_RESET          20
+
+/* wPortStatus / wPortChange bits */
+#define PORT_CONNECTION         0x0001
+#define PORT_ENABLE             0x0002
+#define PORT_RESET              0x0010
+#define PORT_LOW_SPEED          0x0200
+
+/* Called for every device the driver configured behind a hub */
+typedef void(*DeviceReadyCallback)(USBDevice *);
+
+/**
+ * Take over a configured hub: read its hub descriptor, power its ports and poll its
+ * status-change endpoint. Devices behind it are enumerated into the device table as they
+ * are plugged in; a device that is a hub itself can be passed back to HUB_start
+ *
+ * Parameters:
+ * USBDevice * device: the hub, in the configured state
+ * DeviceReadyCallback callback: called for each downstream device once it is configured
+ *
+ * Returns:
+ * uint_fast8_t: rslSUCCES, rslBADREQ if the device has no status-change endpoint or the
+ *               hub table is full, or the result code of the failing control transfer
+ */
+uint_fast8_t HUB_start(USBDevice *, DeviceReadyCallback);
+
+/**
+ * Forget all hubs, after the root device was detached
+ */
+void HUB_stop(void);
@@ -0,0 +1,53 @@
+/*
+ * latency.c
+ *
+ * Log-scale histogram of the USB-to-BLE input latency
+ */
+
+#include <string.h>
+
+#include "latency.h"
+#include "app_timer.h"
+
+static LatencyHistogram histogram;
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static uint_fast8_t _bucket(uint32_t);
+
+/* PUBLIC FUNCTIONS */
+
+uint32_t LATENCY_now(void) {
+	return app_timer_cnt_get();
+}
+
+void LATENCY_record(uint32_t since) {
+	uint32_t ticks = app_timer_cnt_diff_compute(app_timer_cnt_get(), since);
+	uint32_t us = (uint32_t)(((uint64_t) ticks * 1000000) / APP_TIMER_CLOCK_FREQ);
+
+	histogram.counts[_bucket(us)]++;
+	histogram.samples++;
+	if (us > histogram.maxUs)
+		histogram.maxUs = us;
+}
+
+void LATENCY_getHistogram(LatencyHistogram * result) {
+	*result = histogram;
+}
+
+void LATENCY_reset(void) {
+	memset(&histogram, 0, sizeof(histogram));
+}
+
+/* PRIVATE FUNCTIONS */
+
+static uint_fast8_t _bucket(uint32_t us) {
+	uint32_t units = us >> LATENCY_BUCKET_SHIFT;
+	uint_fast8_t bucket;
+
+	if (units < 2)
+		return 0;
+
+	bucket = 31 - __builtin_clz(units);
+	return (bucket < LATENCY_BUCKETS) ? bucket : LATENCY_BUCKETS - 1;
+}
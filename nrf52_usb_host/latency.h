@@ -0,0 +1,53 @@
+#pragma once
+/*
+ * latency.h
+ *
+ * Histogram of the input latency: from the USB report coming in to the last BLE input
+ * report it turned into being handed to the SoftDevice. Buckets are log-scale, bucket 0
+ * holds everything below 2 << LATENCY_BUCKET_SHIFT us and every next one is twice as
+ * wide; the last one is open-ended. Time comes from the RTC behind app_timer, which keeps
+ * running while the CPU sleeps
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LATENCY_BUCKETS         16
+
+/* log2 of the bucket unit (us): bucket n >= 1 holds [64 << n, 64 << (n + 1)) */
+#define LATENCY_BUCKET_SHIFT    6
+
+typedef struct {
+	uint32_t counts[LATENCY_BUCKETS];
+	uint32_t samples;
+	uint32_t maxUs;
+} LatencyHistogram;
+
+/**
+ * Get a timestamp to measure a latency from
+ *
+ * Returns:
+ * uint32_t: the RTC count (24 bits)
+ */
+uint32_t LATENCY_now(void);
+
+/**
+ * Add the time since a timestamp to the histogram
+ *
+ * Parameters:
+ * uint32_t since: a timestamp from LATENCY_now
+ */
+void LATENCY_record(uint32_t);
+
+/**
+ * Get the histogram
+ *
+ * Parameters:
+ * LatencyHistogram * result: filled in with a copy of the histogram
+ */
+void LATENCY_getHistogram(LatencyHistogram *);
+
+/**
+ * Clear the histogram
+ */
+void LATENCY_reset(void);
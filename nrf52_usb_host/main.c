@@ -42,6 +42,12 @@
 #include "nrf_bsp.h"
 
 #include "max3421e.h"
+#include "poller.h"
+#include "hub.h"
+#include "hidreport.h"
+#include "bridge.h"
+#include "bench.h"
+#include "trace.h"
 
 #include "nrf_spi_mngr.h"
 
@@ -154,6 +160,21 @@ static void power_management_init(void)
 }
 
 
+/**@brief Function for logging a hot-path trace record.
+ *
+ * @details Logs the time since the previous record, so the gaps between the INT pin and the
+ *          BLE notification can be read off directly. Only built in with debug logging.
+ */
+static void trace_record_log(TraceRecord const * p_record, void * p_context)
+{
+    static uint32_t previous;
+
+    UNUSED_PARAMETER(p_context);
+    NRF_LOG_DEBUG("trace %d 0x%x +%u\n", p_record->probe, p_record->data, p_record->timestamp - previous);
+    previous = p_record->timestamp;
+}
+
+
 /**@brief Function for handling the idle state (main loop).
  *
  * @details If there is no pending log operation, then sleep until next the next event occurs.
@@ -161,6 +182,7 @@ static void power_management_init(void)
 static void idle_state_handle(void)
 {
     app_sched_execute();
+    TRACE_drain(trace_record_log, NULL);
     if (NRF_LOG_PROCESS() == false)
     {
         nrf_pwr_mgmt_run();
@@ -185,6 +207,11 @@ void uart_error_handle(app_uart_evt_t * p_event)
 
 volatile bool peripheralAvailable;
 volatile uint_fast8_t RXData[BUFFER_SIZE];
+static bool deviceStarted;
+/* Indexed by poller slot: a slot is reused once the poller frees it, on removal from a hub
+ * or a detach, so the bridge and its report map go with it */
+static HidReportMap reportMaps[POLL_MAX_ENDPOINTS];
+static Bridge bridges[POLL_MAX_ENDPOINTS];
 void busStateChanged(uint_fast8_t newState) {
 	uint_fast8_t result = MAX_scanBus();
 	if (result == 0x01 || result == 0x02)
@@ -192,6 +219,68 @@ void busStateChanged(uint_fast8_t newState) {
 	else
 		peripheralAvailable = false;
 }
+
+void reportReceived(uint8_t const * data, uint_fast8_t length, void * context) {
+	NRF_LOG_INFO("Report: %d bytes\n", length);
+}
+
+/* Start the data pipes of a freshly configured device */
+void startDevice(USBDevice * device) {
+	DeviceModel const * model = &device->model;
+	EndpointInfo const * endpoint;
+	InterfaceInfo const * interface;
+	Bridge * bridge;
+	uint_fast8_t it, slot;
+
+	/* Hubs enumerate what is plugged into them and hand it back to us */
+	if (model->deviceClass == clsHUB) {
+		HUB_start(device, startDevice);
+		return;
+	}
+
+	/* Interrupt endpoints are polled on their bInterval; those of HID interfaces feed the
+	 * BLE reports through a bridge */
+	for (it = 0; it < model->endpointCount; it++) {
+		endpoint = &model->endpoints[it];
+		if (endpoint->type != epINTERRUPT || !(endpoint->address & epDIR_IN))
+			continue;
+
+		interface = &model->interfaces[endpoint->interface];
+		slot = POLL_nextSlot();
+		if (slot == POLL_MAX_ENDPOINTS) {
+			NRF_LOG_INFO("No poller slot for endpoint 0x%x\n", endpoint->address);
+			continue;
+		}
+		if (interface->interfaceClass != clsHID) {
+			POLL_addEndpoint(device->address, endpoint, reportReceived, NULL);
+			continue;
+		}
+		bridge = &bridges[slot];
+
+		/* Boot mice skip the report descriptor altogether. SET_IDLE may be STALLed */
+		if (HID_isBootMouse(interface) && !HID_setProtocol(device, interface, HID_PROTOCOL_BOOT)) {
+			HID_setIdle(device, interface, 0);
+			BRIDGE_bindBoot(bridge);
+		}
+		/* Otherwise the report descriptor is compiled once, so reports are decoded from a table */
+		else if (HID_readReportMap(device, interface, &reportMaps[slot])
+		         || !BRIDGE_bind(bridge, &reportMaps[slot])) {
+			NRF_LOG_INFO("Interface %d has no reports to bridge\n", interface->number);
+			POLL_addEndpoint(device->address, endpoint, reportReceived, NULL);
+			continue;
+		}
+
+		POLL_addEndpoint(device->address, endpoint, BRIDGE_reportReceived, bridge);
+	}
+
+#if BENCH_ENABLED
+	/* A bulk device on the root port is the bench device: measure the data path. Devices
+	 * behind a hub are started from the scheduler, where the suite can't run */
+	if (!device->parent && DESC_findEndpoint(model, epBULK, true))
+		BENCH_runSuite(device);
+#endif
+}
+
 /**@brief Function for application main entry.
  */
 int main(void)
@@ -200,6 +289,7 @@ int main(void)
 	bool erase_bonds;
 
     // Initialize.
+    TRACE_init();
     log_init();
     timers_init();
     NRF_Bsp.buttons_leds_init(&erase_bonds);
@@ -218,6 +308,7 @@ int main(void)
     timers_start();
 	NRF_Advertising.advertising_start(erase_bonds);
 	
+	USB_init();
 	MAX_start(true);
 	MAX_setStateChangeIRQ(&busStateChanged);
 
@@ -241,28 +332,15 @@ int main(void)
     // Enter main loop.
     for (;;)
     {
-	    if (peripheralAvailable) {
-		    NRF_LOG_INFO("SUCCESS!!!!!!!!!");
-
-		    /* Make sure the RX buffer is free */
-		    MAX_writeRegister(rHIRQ, BIT2);
-
-		    uint_fast8_t i, result;
-		    uint_fast32_t totalRcvd = 0;
-
-		    printf("Requesting data...\n");
-		    printf("(Address: %d)\n", MAX_readRegister(rPERADDR));
-		    MAX_writeRegister(rHIRQ, BIT2);
-		    for (i = 0; i < 1000; i++) {
-			    result = requestData((uint_fast8_t *) RXData, 64);
-			    if (result != 0) {
-				    printf("Result error: 0x%x (%d)\n", result, i);
-			    }
-			    else {
-				    totalRcvd += 64;
-			    }
+	    if (peripheralAvailable && USB_getState() == USB_STATE_READY) {
+		    if (!deviceStarted) {
+			    deviceStarted = true;
+			    NRF_LOG_INFO("SUCCESS!!!!!!!!!");
+			    startDevice(USB_getRootDevice());
 		    }
-		    printf("Received %d bytes!\n", totalRcvd);
+	    }
+	    else {
+		    deviceStarted = false;
 	    }
 		idle_state_handle();
     }
@@ -6,6 +6,9 @@
  */
 
 #include "max3421e.h"
+#include "poller.h"
+#include "trace.h"
+#include "app_timer.h"
 #define NRF_LOG_MODULE_NAME max3421e
 #include "nrf_log.h"
 NRF_LOG_MODULE_REGISTER();
@@ -23,9 +26,40 @@ volatile uint_fast8_t lastTransferResult;
 
 volatile void(*handlePtr)(uint_fast8_t);
 
+/* Control registers mirrored locally, so setting or clearing bits needs no read-back. Not
+ * rHCTL: its bits are strobes the module clears itself, and every write must go out */
+#define SHADOWED_REGISTERS ((1UL << rEPIEN) | (1UL << rUSBIEN) | (1UL << rCPUCTL) | (1UL << rPINCTL) | \
+                            (1UL << rHIEN) | (1UL << rMODE) | (1UL << rPERADDR))
+
+volatile uint_fast8_t shadowRegisters[32];
+
+/* Interrupt flags latched by in_pin_handler and handed to the scheduler */
+typedef struct {
+	uint8_t irq;
+	uint8_t epirq;
+} MAXInterruptEvent;
+
+static volatile uint_fast8_t latchedIRQ;
+static volatile uint_fast8_t latchedEPIRQ;
+
+/* Set from the INT edge until the service event runs: one pending event is enough, the
+ * flags stay set until they are cleared and the service checks the line again */
+static volatile bool latchPending;
+
+/* Nesting depth of MAX_holdInterrupts */
+static volatile uint_fast8_t latchHolds;
+
+/* Posts the service event again when the scheduler queue was full */
+APP_TIMER_DEF(latchTimer);
+
 /* PROTOTYPES FOR PRIVATE FUNCTIONS */
 
 uint_fast8_t _getCommandByte(uint_fast8_t, uint_fast8_t);
+bool _isShadowed(uint_fast8_t);
+void _updateShadow(uint_fast8_t, uint_fast8_t);
+static void _latchInterrupts(void);
+static void _serviceInterrupts(void *, uint16_t);
+static void _latchTimeout(void *);
 
 /* PUBLIC FUNCTIONS */
 void MAX_start(uint_fast8_t startAsMaster) {
@@ -55,6 +89,9 @@ void MAX_start(uint_fast8_t startAsMaster) {
 	ret_code_t err_code = nrf_drv_gpiote_in_init(MAX_IRQ_PIN, &in_config, in_pin_handler);
 	APP_ERROR_CHECK(err_code);
 
+	err_code = app_timer_create(&latchTimer, APP_TIMER_MODE_SINGLE_SHOT, _latchTimeout);
+	APP_ERROR_CHECK(err_code);
+
 	nrf_drv_gpiote_in_event_enable(MAX_IRQ_PIN, true);
 
 	if (startAsMaster) {
@@ -81,6 +118,9 @@ void MAX_reset(void) {
 	DELAY_WITH_TIMEOUT(!(MAX_readRegister(13) & BIT0));
 	NRF_LOG_INFO("Oscillator stabilized\n");
 
+	/* CHIPRES reloaded the defaults, so refresh the cached control registers */
+	MAX_syncShadowRegisters();
+
 	/* Reset the interrupt state */
 	MAX_disableInterruptsMaster();
 	if (mode) {
@@ -100,10 +140,19 @@ void MAX_reset(void) {
 	ACKSTAT = false;
 }
 
+void MAX_syncShadowRegisters(void) {
+	uint_fast8_t address;
+
+	for (address = 0; address < 32; address++) {
+		if (_isShadowed(address))
+			_updateShadow(address, MAX_readRegister(address));
+	}
+}
+
 void MAX_enableInterrupts(uint_fast8_t flags) {
-	/* Enable the interrupts */
+	/* Enable the interrupts; FRAME waits for the release of a hold */
 	if (mode)
-		MAX_enableOptions(26, flags);
+		MAX_enableOptions(26, latchHolds ? flags & ~MAX_IRQ_FRAME : flags);
 	else
 		MAX_enableOptions(14, flags);
 
@@ -141,11 +190,11 @@ void MAX_disableEPInterrupts(uint_fast8_t flags) {
 }
 
 void MAX_clearInterruptStatus(uint_fast8_t flags) {
-	/* Clear the specified interrupts */
+	/* Clear the specified interrupts (write-1-to-clear, so no read-back is needed) */
 	if (mode)
-		MAX_enableOptions(25, flags);
+		MAX_writeRegister(rHIRQ, flags);
 	else
-		MAX_enableOptions(13, flags);
+		MAX_writeRegister(rUSBIRQ, flags);
 }
 
 void MAX_clearEPInterruptStatus(uint_fast8_t flags) {
@@ -163,6 +212,25 @@ void MAX_disableInterruptsMaster(void) {
 	MAX_disableOptions(16, BIT0);
 }
 
+void MAX_holdInterrupts(void) {
+	/* FRAME would hold the INT line low from one SOF to the next, so the blocked caller
+	 * could never sleep on it. Mask it in the module; the poller can't run meanwhile anyway */
+	if (!latchHolds++ && mode && enabledIRQ & MAX_IRQ_FRAME)
+		MAX_disableOptions(rHIEN, MAX_IRQ_FRAME);
+}
+
+void MAX_releaseInterrupts(void) {
+	if (!latchHolds || --latchHolds)
+		return;
+
+	if (mode && enabledIRQ & MAX_IRQ_FRAME)
+		MAX_enableOptions(rHIEN, MAX_IRQ_FRAME);
+
+	/* Edges seen while held were dropped; a flag that is still pending keeps the line low */
+	if (!nrf_gpio_pin_read(MAX_IRQ_PIN))
+		_latchInterrupts();
+}
+
 uint_fast8_t MAX_getInterruptStatus(void) {
 	if (mode)
 		return MAX_readRegister(rHIRQ);
@@ -175,6 +243,10 @@ uint_fast8_t MAX_getEnabledInterruptStatus(void) {
 	return result & enabledIRQ;
 }
 
+uint_fast8_t MAX_getEnabledInterrupts(void) {
+	return enabledIRQ;
+}
+
 uint_fast8_t MAX_getEPInterruptStatus(void) {
 	return MAX_readRegister(rEPIRQ);
 }
@@ -192,10 +264,24 @@ uint_fast8_t MAX_writeRegister(uint_fast8_t address, uint_fast8_t value) {
 	/* Transmit the data */
 	//result = SIMSPI_transmitByte(value);
 
-	
+	if (_isShadowed(address))
+		_updateShadow(address, value);
+
 	return result;
 }
 
+void MAX_updateRegister(uint_fast8_t address, uint_fast8_t value) {
+	if (_isShadowed(address) && shadowRegisters[address] == value)
+		return;
+	MAX_writeRegister(address, value);
+}
+
+void MAX_updateOptions(uint_fast8_t address, uint_fast8_t mask, uint_fast8_t flags) {
+	uint_fast8_t regVal = _isShadowed(address) ? shadowRegisters[address] : MAX_readRegister(address);
+
+	MAX_updateRegister(address, (regVal & ~mask) | (flags & mask));
+}
+
 uint_fast8_t MAX_writeRegisterAS(uint_fast8_t address, uint_fast8_t value) {
 	ACKSTAT = true;
 	return MAX_writeRegister(address, value);
@@ -204,17 +290,8 @@ uint_fast8_t MAX_writeRegisterAS(uint_fast8_t address, uint_fast8_t value) {
 uint_fast8_t MAX_multiWriteRegister( uint_fast8_t address,
 	uint_fast8_t * values,
 	uint_fast8_t length) {
-	uint_fast8_t result;
-
-	
-
-	/* Build and transmit the command byte */
-	SIMSPI_transmitByte(_getCommandByte(address, DIR_WRITE),0);
-	/* Transmit the data */
-	result = SIMSPI_transmitBytes(values, length);
-
-	
-	return result;
+	/* Transmit the command byte and the data in a single burst */
+	return SIMSPI_transferBurst(_getCommandByte(address, DIR_WRITE), values, NULL, length);
 }
 
 uint_fast8_t MAX_readRegister(uint_fast8_t address) {
@@ -239,20 +316,32 @@ void MAX_multiReadRegister( uint_fast8_t address,
 	uint_fast8_t * buffer,
 	uint_fast8_t length) {
 
-	
+	TRACE(TRACE_SPI_READ, address << 8 | length);
 
-	/* Transmit the command byte */
-	SIMSPI_transmitByte(_getCommandByte(address, DIR_READ),0);
+	/* Transmit the command byte followed by 0s in a single burst, as we don't actually care
+	 * about what's written but we do about the response */
+	SIMSPI_transferBurst(_getCommandByte(address, DIR_READ), NULL, buffer, length);
+}
 
-	/* Transmit 0s, as we don't actually care about what's written but we do about the response */
-	SIMSPI_readBytes(buffer, length);
+ret_code_t MAX_multiWriteRegisterAsync(uint_fast8_t address,
+	uint_fast8_t * values,
+	uint_fast8_t length,
+	SPICallback callback,
+	void * context) {
+	return SIMSPI_schedule(_getCommandByte(address, DIR_WRITE), values, NULL, length, callback, context);
+}
 
-	
+ret_code_t MAX_multiReadRegisterAsync(uint_fast8_t address,
+	uint_fast8_t * buffer,
+	uint_fast8_t length,
+	SPICallback callback,
+	void * context) {
+	return SIMSPI_schedule(_getCommandByte(address, DIR_READ), NULL, buffer, length, callback, context);
 }
 
 void MAX_enableOptions(uint_fast8_t address, uint_fast8_t flags) {
-	/* Read the current state of the register */
-	uint_fast8_t regVal = MAX_readRegister(address);
+	/* Get the current state of the register */
+	uint_fast8_t regVal = _isShadowed(address) ? shadowRegisters[address] : MAX_readRegister(address);
 
 	/* Enable the given bits */
 	regVal |= flags;
@@ -262,8 +351,8 @@ void MAX_enableOptions(uint_fast8_t address, uint_fast8_t flags) {
 }
 
 void MAX_disableOptions(uint_fast8_t address, uint_fast8_t flags) {
-	/* Read the current state of the register */
-	uint_fast8_t regVal = MAX_readRegister(address);
+	/* Get the current state of the register */
+	uint_fast8_t regVal = _isShadowed(address) ? shadowRegisters[address] : MAX_readRegister(address);
 
 	/* Disable the given bits */
 	regVal &= ~flags;
@@ -278,12 +367,22 @@ void MAX_setStateChangeIRQ(void(*handle)(uint_fast8_t)) {
 }
 
 uint_fast8_t MAX_scanBus(void) {
-	/* Enable SAMPLEBUS */
-	MAX_enableOptions(rHCTL, BIT2);
-	while (!(MAX_readRegister(rHCTL) & BIT2))
-		nrf_delay_ms(200);
+	/* SAMPLEBUS clears itself once the J/K bits are updated, which takes microseconds */
+	MAX_writeRegister(rHCTL, HCTL_SAMPLEBUS);
+	while (MAX_readRegister(rHCTL) & HCTL_SAMPLEBUS) ;
 	/* Return the J/K state bits */
-	return (MAX_readRegister(rHRSL) & 0xC0) >> 6;
+	return (MAX_readRegister(rHRSL) & (HRSL_JSTATUS | HRSL_KSTATUS)) >> 6;
+}
+
+uint_fast8_t MAX_detectSpeed(void) {
+	uint_fast8_t bus = MAX_scanBus();
+	bool lowSpeedMode = shadowRegisters[rMODE] & MODE_LOWSPEED;
+
+	if (bus != 0x1 && bus != 0x2)
+		return USB_SPEED_NONE;
+
+	/* J in full-speed mode or K in low-speed mode: D+ is pulled up */
+	return ((bus == 0x2) == lowSpeedMode) ? USB_SPEED_LOW : USB_SPEED_FULL;
 }
 
 /* PRIVATE FUNCTIONS */
@@ -297,17 +396,85 @@ uint_fast8_t _getCommandByte(uint_fast8_t address, uint_fast8_t direction) {
 	return result;
 }
 
+bool _isShadowed(uint_fast8_t address) {
+	return address < 32 && (SHADOWED_REGISTERS & (1UL << address));
+}
+
+void _updateShadow(uint_fast8_t address, uint_fast8_t value) {
+	shadowRegisters[address] = value;
+}
+
 /* INTERRUPT HANDLERS */
 
 void in_pin_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action){
+	TRACE(TRACE_PIN_IRQ, 0);
+
+	/* Only latch the interrupt flags here; the work is done from the scheduler */
+	_latchInterrupts();
+}
+
+/* SCHEDULED HANDLERS */
+
+static void _latchDone(ret_code_t result, void * context) {
+	MAXInterruptEvent event;
+
+	UNUSED_PARAMETER(context);
+	event.irq = (uint8_t) latchedIRQ;
+	event.epirq = (uint8_t) latchedEPIRQ;
+	if (result != NRF_SUCCESS)
+		event.irq = event.epirq = 0;
+
+	/* The queue is full of other work: the flags stay pending in the module, latch them
+	 * again once the queue had time to drain */
+	if (app_sched_event_put(&event, sizeof(event), _serviceInterrupts) != NRF_SUCCESS)
+		app_timer_start(latchTimer, APP_TIMER_MIN_TIMEOUT_TICKS, NULL);
+}
+
+static void _latchInterrupts(void) {
+	ret_code_t err_code;
+
+	if (latchPending || latchHolds)
+		return;
+	latchPending = true;
 
-	NRF_LOG_INFO("Interrupt handler\n");
+	latchedEPIRQ = 0;
+	if (mode) {
+		err_code = MAX_multiReadRegisterAsync(rHIRQ, (uint_fast8_t *) &latchedIRQ, 1, _latchDone, NULL);
+	}
+	else {
+		err_code = MAX_multiReadRegisterAsync(rEPIRQ, (uint_fast8_t *) &latchedEPIRQ, 1, NULL, NULL);
+		if (err_code == NRF_SUCCESS)
+			err_code = MAX_multiReadRegisterAsync(rUSBIRQ, (uint_fast8_t *) &latchedIRQ, 1, _latchDone, NULL);
+	}
 
-	uint_fast8_t regval, USBStatus, USBEPStatus;
+	/* The SPI queue is full: post an empty event, the INT line is checked again after it runs */
+	if (err_code != NRF_SUCCESS)
+		_latchDone(err_code, NULL);
+}
+
+static void _serviceInterrupts(void * p_event_data, uint16_t event_size) {
+	MAXInterruptEvent * event = (MAXInterruptEvent *) p_event_data;
+	uint_fast8_t speed, USBStatus, USBEPStatus;
+
+	UNUSED_PARAMETER(event_size);
+	latchPending = false;
 
 	/* Get the IQR status */
-	USBStatus = MAX_getEnabledInterruptStatus();
-	USBEPStatus = MAX_getEnabledEPInterruptStatus();
+	USBStatus = event->irq & enabledIRQ;
+	USBEPStatus = event->epirq & enabledEPIRQ;
+
+	/* Host: a transfer finished. Handled first as it is on the data path */
+	if (mode && USBStatus & MAX_IRQ_HXFRDN) {
+		transferCompleteHandler();
+	}
+
+	/* Host: start of a frame, time for the periodic transfers */
+	if (mode && USBStatus & MAX_IRQ_FRAME) {
+		POLL_frameHandler();
+	}
+
+	if (USBStatus & ~(MAX_IRQ_HXFRDN | MAX_IRQ_FRAME) || USBEPStatus)
+		NRF_LOG_INFO("Interrupt handler\n");
 
 	/* Peripheral: we got a setup package */
 	if (USBEPStatus & MAX_IRQ_SUDAV) {
@@ -346,38 +513,24 @@ void in_pin_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action){
 	/* Host: a peripheral connected or disconnected */
 	if (mode && USBStatus & MAX_IRQ_CONDET) {
 
-		regval = MAX_readRegister(31);
-		if (regval & 0xC0) {
+		speed = MAX_detectSpeed();
+		if (speed != USB_SPEED_NONE) {
 			peripheralConnected = 1;
 
-			
-
-			/* Enable the SOF generator */
-			MAX_enableOptions(27, BIT3);
-			while (!(MAX_readRegister(rHIRQ) & MAX_IRQ_FRAME)) ;
-
-			USB_busReset();
-
-			nrf_delay_ms(4000000);
-
-			if (USB_doEnumeration())
-			{
-				NRF_LOG_INFO("Enumeration Failed...\n");				
-			}
-			else
-			{
-				NRF_LOG_INFO("Done with enumeration!\n");				
-			}
+			/* Talk to the root port at the device's speed; low-speed mode also turns the
+			 * SOF packets into keep-alives */
+			MAX_updateOptions(rMODE, MODE_LOWSPEED | MODE_HUBPRE, speed == USB_SPEED_LOW ? MODE_LOWSPEED : 0);
+			NRF_LOG_INFO("%s-speed device attached\n", speed == USB_SPEED_LOW ? "Low" : "Full");
 
-			/* Add a delay to stabilise the bus */
-			nrf_delay_ms(8000000);
+			/* Enumeration runs from timers, so the main loop keeps running meanwhile */
+			USB_deviceAttached(speed);
 		}
 		else {
 			peripheralConnected = 0;
-			/* Disable the SOF generator */
-			MAX_disableOptions(27, BIT3);
+			USB_deviceDetached();
 
-			
+			/* Disable the SOF generator */
+			MAX_disableOptions(rMODE, MODE_SOFKAENAB);
 		}
 
 		if (handlePtr != 0)
@@ -386,4 +539,15 @@ void in_pin_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action){
 		MAX_writeRegister(rHIRQ, BIT5);
 
 	}
+
+	/* GPIOTE only sees the falling edge of the level INT line; if anything is still
+	 * pending the line never went high again, so latch the flags once more */
+	if (!nrf_gpio_pin_read(MAX_IRQ_PIN))
+		_latchInterrupts();
+}
+
+static void _latchTimeout(void * context) {
+	UNUSED_PARAMETER(context);
+	latchPending = false;
+	_latchInterrupts();
 }
\ No newline at end of file
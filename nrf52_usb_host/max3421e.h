@@ -17,6 +17,7 @@
 #include "nrf_delay.h"
 #include "nrf_drv_gpiote.h"
 #include "nrf_spi_mngr.h"
+#include "app_scheduler.h"
 
 
 /*** MACROs ***/
@@ -67,6 +68,30 @@
 #define MAX_IRQ_VBUS        BIT6
 #define MAX_IRQ_URESDN      BIT7
 
+/* rHCTL bits (all are strobes) */
+#define HCTL_BUSRST         BIT0
+#define HCTL_FRMRST         BIT1
+#define HCTL_SAMPLEBUS      BIT2
+#define HCTL_SIGRSM         BIT3
+#define HCTL_RCVTOG0        BIT4
+#define HCTL_RCVTOG1        BIT5
+#define HCTL_SNDTOG0        BIT6
+#define HCTL_SNDTOG1        BIT7
+
+/* rHRSL bits */
+#define HRSL_RESULT         0x0F
+#define HRSL_RCVTOGRD       BIT4
+#define HRSL_SNDTOGRD       BIT5
+#define HRSL_KSTATUS        BIT6
+#define HRSL_JSTATUS        BIT7
+
+/* rMODE bits (host mode; bit 0 is MODE_HOST) */
+#define MODE_LOWSPEED       BIT1
+#define MODE_HUBPRE         BIT2
+#define MODE_SOFKAENAB      BIT3
+#define MODE_DMPULLDN       BIT6
+#define MODE_DPPULLDN       BIT7
+
 /* the End Point interrupts (EPIRQ) */
 #define MAX_IRQ_IN0BAV      BIT0
 #define MAX_IRQ_OUT0DAV     BIT1
@@ -151,6 +176,26 @@ void MAX_reset(void);
  */
 uint_fast8_t MAX_writeRegister(uint_fast8_t, uint_fast8_t);
 
+/**
+ * Write to the specified register, unless it is shadowed and already holds the value
+ *
+ * Parameters:
+ * uint_fast8_t address: register address to write to
+ * uint_fast8_t value: the value to write to the specified register
+ */
+void MAX_updateRegister(uint_fast8_t, uint_fast8_t);
+
+/**
+ * Replace the bits under a mask in one go, skipping the write if a shadowed register
+ * already holds them
+ *
+ * Parameters:
+ * uint_fast8_t address: register address to update
+ * uint_fast8_t mask: the bits to replace
+ * uint_fast8_t flags: the new value of those bits
+ */
+void MAX_updateOptions(uint_fast8_t, uint_fast8_t, uint_fast8_t);
+
 /**
  * Write to the specified register, including the ACKSTAT bit set to true
  *
@@ -187,6 +232,36 @@ uint_fast8_t MAX_multiWriteRegister(uint_fast8_t, uint_fast8_t *, uint_fast8_t);
  */
 void MAX_multiReadRegister(uint_fast8_t, uint_fast8_t *, uint_fast8_t);
 
+/**
+ * Queue a multi-byte register write and return immediately
+ *
+ * Parameters:
+ * uint_fast8_t address: register address to write to
+ * uint_fast8_t * values: the values to write (copied before returning)
+ * uint_fast8_t length: the length of the 'values' array
+ * SPICallback callback: called from the SPI interrupt when the write is done, may be NULL
+ * void * context: passed to the callback
+ *
+ * Returns:
+ * ret_code_t: NRF_SUCCESS if the write was queued
+ */
+ret_code_t MAX_multiWriteRegisterAsync(uint_fast8_t, uint_fast8_t *, uint_fast8_t, SPICallback, void *);
+
+/**
+ * Queue a multi-byte register read and return immediately
+ *
+ * Parameters:
+ * uint_fast8_t address: register address to read from
+ * uint_fast8_t * buffer: filled with the result before the callback runs; must stay valid
+ * uint_fast8_t length: the number of bytes to read
+ * SPICallback callback: called from the SPI interrupt when the read is done, may be NULL
+ * void * context: passed to the callback
+ *
+ * Returns:
+ * ret_code_t: NRF_SUCCESS if the read was queued
+ */
+ret_code_t MAX_multiReadRegisterAsync(uint_fast8_t, uint_fast8_t *, uint_fast8_t, SPICallback, void *);
+
 /**
  * Read multiple bytes from a register, setting ACKSTAT to true
  *
@@ -210,7 +285,8 @@ uint_fast8_t MAX_readRegisterAS(uint_fast8_t);
 uint_fast8_t MAX_readRegister(uint_fast8_t);
 
 /**
- * Enable the specified bits
+ * Enable the specified bits. Cached control registers (see MAX_syncShadowRegisters) are
+ * updated with a single write; other registers are read back first
  *
  * Parameters:
  * uint_fast8_t address: register address to enable the bits in
@@ -219,7 +295,7 @@ uint_fast8_t MAX_readRegister(uint_fast8_t);
 void MAX_enableOptions(uint_fast8_t, uint_fast8_t);
 
 /**
- * Disable the specified bits
+ * Disable the specified bits. Cached control registers are updated with a single write
  *
  * Parameters:
  * uint_fast8_t address: register address to disable the bits in
@@ -229,6 +305,13 @@ void MAX_disableOptions(uint_fast8_t, uint_fast8_t);
 
 
 
+/**
+ * Reload the locally cached copies of the control registers from the module.
+ * Must be called whenever the module may have changed them behind the driver's back,
+ * e.g. after a chip reset
+ */
+void MAX_syncShadowRegisters(void);
+
 /**
  * Enable interrupts
  *
@@ -287,6 +370,19 @@ void MAX_enableInterruptsMaster(void);
  */
 void MAX_disableInterruptsMaster(void);
 
+/**
+ * Stop handing INT edges to the scheduler, for a caller that blocks on a transfer and
+ * services HXFRDN itself. FRAME is masked in the module until the release, so the INT
+ * line only drops for the transfer. Calls nest
+ */
+void MAX_holdInterrupts(void);
+
+/**
+ * Undo MAX_holdInterrupts. When the last hold is released and the INT line is still low,
+ * the flags are latched and serviced from the scheduler as usual
+ */
+void MAX_releaseInterrupts(void);
+
 /**
  * Get the status of the interrupts
  *
@@ -303,6 +399,14 @@ uint_fast8_t MAX_getInterruptStatus(void);
  */
 uint_fast8_t MAX_getEnabledInterruptStatus(void);
 
+/**
+ * Get the interrupts that are currently enabled
+ *
+ * Returns:
+ * uint_fast8_t: the enabled interrupt flags
+ */
+uint_fast8_t MAX_getEnabledInterrupts(void);
+
 /**
  * Get the status of the EP interrupts
  *
@@ -334,4 +438,18 @@ void MAX_setStateChangeIRQ(void(*handle)(uint_fast8_t));
  */
 uint_fast8_t MAX_scanBus(void);
 
+/**
+ * Find the speed of the device on the root port from the idle state of the bus. J is D+
+ * high at full speed and D- high at low speed, and the module reports J and K relative to
+ * the current LOWSPEED setting, so the result is corrected for it
+ *
+ * Returns:
+ * uint_fast8_t: USB_SPEED_FULL, USB_SPEED_LOW or USB_SPEED_NONE if nothing is attached
+ */
+uint_fast8_t MAX_detectSpeed(void);
+
+/**
+ * GPIOTE handler for the INT pin. Latches the interrupt flags with a non-blocking SPI read
+ * and posts them to the app_scheduler queue, where they are serviced from the main loop
+ */
 void in_pin_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action);
@@ -0,0 +1,570 @@
+/*
+ * max_sim.c
+ *
+ * Behavioural model of the MAX3421E in host mode, plugged in as the SPI transport. Only
+ * what the host driver relies on is modelled; peripheral mode and the GPIO pins are not
+ */
+
+#include <string.h>
+
+#include "max_sim.h"
+#include "max3421e.h"
+
+/* rUSBCTL and rUSBIRQ bits used to bring the module up */
+#define USBCTL_CHIPRES      BIT5
+#define USBIRQ_OSCOKIRQ     BIT0
+#define CPUCTL_IE           BIT0
+
+/* rHXFR: the token type is in the upper nibble, the endpoint in the lower */
+#define HXFR_TOKEN          0xF0
+#define HXFR_EP             0x0F
+
+/* Bit times of the parts of a transaction. Every packet has a SYNC, PID and EOP (19), a
+ * token adds the address, endpoint and CRC5 (16), a data packet a CRC16 (16). Bit stuffing
+ * makes the payload up to 7/6 longer. A turnaround is counted as 8 bit times, a timeout
+ * as the 18 the host waits for an answer. A PRE preamble costs 20 full-speed bit times,
+ * the hub setup time included */
+#define BITS_HANDSHAKE      19
+#define BITS_TOKEN          35
+#define BITS_DATA(length)   (35 + (length) * 28 / 3)
+#define BITS_TURNAROUND     8
+#define BITS_TIMEOUT        18
+#define BITS_PREAMBLE       20
+
+typedef struct {
+	uint8_t data[MAXSIM_FIFO_SIZE];
+	uint8_t length;
+} FifoHalf;
+
+static uint8_t registers[32];
+static MaxSimPort * port;
+
+/* RCVFIFO: filled by the SIE, the CPU reads the oldest half until it clears RCVDAV */
+static FifoHalf rcvFifo[2];
+static uint_fast8_t rcvHead;
+static uint_fast8_t rcvCount;
+static uint_fast8_t rcvRead;
+
+/* SNDFIFO: loaded by the CPU, writing SNDBC hands a half to the SIE, which sends the
+ * oldest one. Like the chip it drops the half when the device does not ACK it, so a
+ * retry that was not reloaded goes out as a zero-length packet */
+static FifoHalf sndFifo[2];
+static uint_fast8_t sndHead;
+static uint_fast8_t sndCount;
+static uint_fast8_t sndWrite;
+
+static uint8_t setupFifo[8];
+static uint_fast8_t setupWrite;
+
+static bool rcvToggle;
+static bool sndToggle;
+static uint_fast8_t lastResult;
+static uint_fast8_t lineState;      /* HRSL_JSTATUS / HRSL_KSTATUS as of the last sample */
+
+/* The transaction on the wire: the device answered when it was issued, the module makes
+ * the result visible when the wire time is over */
+static bool transferBusy;
+static uint64_t transferDoneAt;
+static uint_fast8_t transferToken;
+static uint_fast8_t transferResult;
+static FifoHalf transferIn;
+
+static bool busResetting;
+static uint64_t busResetDoneAt;
+static uint64_t nextFrameAt;
+
+static uint64_t now;
+
+/* MAXSIM_clock counts from here */
+static uint64_t clockBase;
+
+/* Transfers queued with SIMSPI_schedule, completed by MAXSIM_serviceSpi */
+static SPIRequest * queued[SIMSPI_REQUEST_SLOTS];
+static uint_fast8_t queuedHead;
+static uint_fast8_t queuedCount;
+
+static MaxSimStats stats;
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static void _start(void);
+static ret_code_t _perform(uint8_t *, uint8_t *, uint8_t);
+static ret_code_t _schedule(SPIRequest *, uint_fast8_t);
+
+static void _chipReset(void);
+static void _transfer(uint8_t const *, uint8_t *, uint_fast8_t);
+static uint_fast8_t _read(uint_fast8_t);
+static void _write(uint_fast8_t, uint_fast8_t);
+static void _strobe(uint_fast8_t);
+static void _sampleBus(void);
+static void _updateSendAvailable(void);
+static void _startTransfer(uint_fast8_t);
+static void _finishTransfer(void);
+static uint64_t _transactionNs(uint_fast8_t, uint_fast8_t, uint_fast8_t);
+static bool _nextEvent(uint64_t *);
+static void _advanceTo(uint64_t);
+static void _clockStart(void);
+static uint32_t _clockNow(void);
+
+SPITransport const MAXSIM_transport = {
+	.start = _start,
+	.perform = _perform,
+	.schedule = _schedule
+};
+
+BenchClock const MAXSIM_clock = {
+	.start = _clockStart,
+	.now = _clockNow
+};
+
+/* PUBLIC FUNCTIONS */
+
+void MAXSIM_attach(MaxSimPort * device) {
+	port = device;
+	_sampleBus();
+	registers[rHIRQ] |= MAX_IRQ_CONDET;
+}
+
+void MAXSIM_detach(void) {
+	port = NULL;
+	_sampleBus();
+	registers[rHIRQ] |= MAX_IRQ_CONDET;
+}
+
+bool MAXSIM_intAsserted(void) {
+	return (registers[rCPUCTL] & CPUCTL_IE) && (registers[rHIRQ] & registers[rHIEN]);
+}
+
+bool MAXSIM_idle(uint64_t until) {
+	uint64_t at;
+
+	if (!_nextEvent(&at) || at > until) {
+		if (until != UINT64_MAX)
+			_advanceTo(until);
+		return false;
+	}
+	_advanceTo(at);
+	return true;
+}
+
+void MAXSIM_advance(uint64_t ns) {
+	_advanceTo(now + ns);
+}
+
+void MAXSIM_serviceSpi(void) {
+	SPIRequest * request;
+
+	while (queuedCount) {
+		request = queued[queuedHead];
+		queuedHead = (queuedHead + 1) % SIMSPI_REQUEST_SLOTS;
+		queuedCount--;
+
+		_transfer(request->tx, request->rx, request->length);
+		SIMSPI_complete(request, NRF_SUCCESS);
+	}
+}
+
+uint64_t MAXSIM_now(void) {
+	return now;
+}
+
+void MAXSIM_getStats(MaxSimStats * result) {
+	*result = stats;
+}
+
+void MAXSIM_resetStats(void) {
+	memset(&stats, 0, sizeof(stats));
+}
+
+/* PRIVATE FUNCTIONS */
+
+static void _start(void) {
+	queuedHead = 0;
+	queuedCount = 0;
+	_chipReset();
+}
+
+static ret_code_t _perform(uint8_t * tx, uint8_t * rx, uint8_t length) {
+	_transfer(tx, rx, length);
+	return NRF_SUCCESS;
+}
+
+static ret_code_t _schedule(SPIRequest * request, uint_fast8_t slot) {
+	UNUSED_PARAMETER(slot);
+	if (queuedCount >= SIMSPI_REQUEST_SLOTS)
+		return NRF_ERROR_NO_MEM;
+	queued[(queuedHead + queuedCount++) % SIMSPI_REQUEST_SLOTS] = request;
+	return NRF_SUCCESS;
+}
+
+/* Power-on and CHIPRES state. The oscillator is taken to be stable at once */
+static void _chipReset(void) {
+	memset(registers, 0, sizeof(registers));
+	registers[rREVISION] = MAXSIM_REVISION;
+	registers[rUSBIRQ] = USBIRQ_OSCOKIRQ;
+
+	rcvHead = rcvCount = rcvRead = 0;
+	sndHead = sndCount = sndWrite = 0;
+	setupWrite = 0;
+	rcvToggle = sndToggle = false;
+	lastResult = rslSUCCES;
+	transferBusy = false;
+	busResetting = false;
+
+	_updateSendAvailable();
+	_sampleBus();
+}
+
+/* One chip-select cycle: the command byte, then every byte reads or writes the same register.
+ * In full-duplex mode the module shifts out rHIRQ while it receives the command byte */
+static void _transfer(uint8_t const * tx, uint8_t * rx, uint_fast8_t length) {
+	uint_fast8_t address = tx[0] >> 3;
+	bool write = tx[0] & (DIR_WRITE << 1);
+	uint_fast8_t it;
+
+	rx[0] = registers[rHIRQ];
+	for (it = 1; it < length; it++) {
+		if (write) {
+			_write(address, tx[it]);
+			rx[it] = 0;
+		}
+		else {
+			rx[it] = (uint8_t) _read(address);
+		}
+	}
+
+	stats.spiTransactions++;
+	stats.spiBytes += length;
+	stats.spiNs += MAXSIM_SPI_CS_NS + (uint64_t) length * 8 * 1000000000ULL / MAXSIM_SPI_HZ;
+	_advanceTo(now + MAXSIM_SPI_CS_NS + (uint64_t) length * 8 * 1000000000ULL / MAXSIM_SPI_HZ);
+}
+
+static uint_fast8_t _read(uint_fast8_t address) {
+	FifoHalf const * half = &rcvFifo[rcvHead];
+
+	switch (address) {
+	case rRCVFIFO:
+		return (rcvCount && rcvRead < half->length) ? half->data[rcvRead++] : 0;
+	case rRCVBC:
+		return rcvCount ? half->length : 0;
+	case rHCTL:
+		/* SAMPLEBUS and the toggle strobes are done at once, BUSRST takes its time */
+		return busResetting ? HCTL_BUSRST : 0;
+	case rHRSL:
+		return lastResult | lineState | (rcvToggle ? HRSL_RCVTOGRD : 0) | (sndToggle ? HRSL_SNDTOGRD : 0);
+	default:
+		return registers[address];
+	}
+}
+
+static void _write(uint_fast8_t address, uint_fast8_t value) {
+	FifoHalf * half;
+
+	switch (address) {
+	case rSNDFIFO:
+		if (sndCount < 2 && sndWrite < MAXSIM_FIFO_SIZE)
+			sndFifo[(sndHead + sndCount) % 2].data[sndWrite++] = value;
+		break;
+
+	case rSNDBC:
+		registers[rSNDBC] = value;
+		if (!value) {
+			/* The reload sequence starts with a zero count: only restart the loading */
+			sndWrite = 0;
+		}
+		else if (sndCount < 2) {
+			half = &sndFifo[(sndHead + sndCount++) % 2];
+			half->length = MIN(value, MAXSIM_FIFO_SIZE);
+			sndWrite = 0;
+			_updateSendAvailable();
+		}
+		break;
+
+	case rSUDFIFO:
+		setupFifo[setupWrite++ % sizeof(setupFifo)] = value;
+		break;
+
+	case rHIRQ:
+		/* Write-1-to-clear, except SNDBAV which follows the SNDFIFO. Clearing RCVDAV frees
+		 * the half that was read; it is set again if the other one holds a packet */
+		if ((value & MAX_IRQ_RCVDAV) && rcvCount) {
+			rcvHead = (rcvHead + 1) % 2;
+			rcvCount--;
+			rcvRead = 0;
+		}
+		registers[rHIRQ] &= ~(value & ~MAX_IRQ_SNDBAV);
+		if (rcvCount)
+			registers[rHIRQ] |= MAX_IRQ_RCVDAV;
+		break;
+
+	case rUSBIRQ:
+		registers[rUSBIRQ] &= ~value;
+		break;
+
+	case rUSBCTL:
+		if (value & USBCTL_CHIPRES)
+			_chipReset();
+		registers[rUSBCTL] = value;
+		break;
+
+	case rMODE:
+		/* Frames start counting when the SOF generator is switched on */
+		if ((value & MODE_SOFKAENAB) && !(registers[rMODE] & MODE_SOFKAENAB))
+			nextFrameAt = now + MAXSIM_FRAME_NS;
+		registers[rMODE] = value;
+		_sampleBus();
+		break;
+
+	case rHCTL:
+		_strobe(value);
+		break;
+
+	case rHXFR:
+		registers[rHXFR] = value;
+		_startTransfer(value);
+		break;
+
+	case rRCVFIFO:
+	case rRCVBC:
+	case rREVISION:
+	case rHRSL:
+		/* Read-only */
+		break;
+
+	default:
+		registers[address] = value;
+		break;
+	}
+}
+
+static void _strobe(uint_fast8_t value) {
+	if (value & HCTL_BUSRST) {
+		busResetting = true;
+		busResetDoneAt = now + MAXSIM_BUSRST_NS;
+		if (port && port->busReset)
+			port->busReset(port);
+	}
+	if (value & HCTL_FRMRST)
+		nextFrameAt = now + MAXSIM_FRAME_NS;
+	if (value & HCTL_SAMPLEBUS)
+		_sampleBus();
+	if (value & HCTL_RCVTOG0)
+		rcvToggle = false;
+	if (value & HCTL_RCVTOG1)
+		rcvToggle = true;
+	if (value & HCTL_SNDTOG0)
+		sndToggle = false;
+	if (value & HCTL_SNDTOG1)
+		sndToggle = true;
+}
+
+/* The idle state is J: D+ high for a full-speed device, D- high for a low-speed one. The
+ * module names the states for the speed in rMODE, so a mismatch reads as K */
+static void _sampleBus(void) {
+	bool lowSpeedMode = registers[rMODE] & MODE_LOWSPEED;
+
+	if (!port)
+		lineState = 0;
+	else
+		lineState = ((port->speed == USB_SPEED_LOW) == lowSpeedMode) ? HRSL_JSTATUS : HRSL_KSTATUS;
+}
+
+/* SNDBAV is set while a SNDFIFO half is free for the CPU */
+static void _updateSendAvailable(void) {
+	if (sndCount < 2)
+		registers[rHIRQ] |= MAX_IRQ_SNDBAV;
+	else
+		registers[rHIRQ] &= ~MAX_IRQ_SNDBAV;
+}
+
+static void _startTransfer(uint_fast8_t hxfr) {
+	uint_fast8_t token = hxfr & HXFR_TOKEN;
+	uint_fast8_t ep = hxfr & HXFR_EP;
+	bool lowSpeedMode = registers[rMODE] & MODE_LOWSPEED;
+	bool hubPreamble = registers[rMODE] & MODE_HUBPRE;
+	FifoHalf const * half;
+	uint_fast8_t length = 0;
+	uint64_t ns;
+
+	if (transferBusy) {
+		stats.collisions++;
+		return;
+	}
+
+	memset(&transferIn, 0, sizeof(transferIn));
+	switch (token) {
+	case xfrSETUP:
+		memcpy(transferIn.data, setupFifo, sizeof(setupFifo));
+		length = sizeof(setupFifo);
+		break;
+	case xfrOUT:
+	case xfrISOOUT:
+		/* With nothing committed the SIE sends a zero-length packet */
+		if (sndCount) {
+			half = &sndFifo[sndHead];
+			memcpy(transferIn.data, half->data, half->length);
+			length = half->length;
+		}
+		break;
+	default:
+		break;
+	}
+
+	/* Without a preamble the device only understands packets at its own speed */
+	if (!port || busResetting || (!hubPreamble && (port->speed == USB_SPEED_LOW) != lowSpeedMode)) {
+		transferResult = rslTIMEOUT;
+	}
+	else if ((token == xfrIN || token == xfrISOIN) && rcvCount == 2) {
+		/* Both RCVFIFO halves are full: there is nowhere to put the data, so the SIE does
+		 * not acknowledge it and the device keeps it for the next token */
+		stats.overruns++;
+		transferResult = rslNAK;
+	}
+	else {
+		transferResult = port->token(port, token, registers[rPERADDR], ep, transferIn.data, &length);
+		length = MIN(length, MAXSIM_FIFO_SIZE);
+	}
+	transferIn.length = length;
+	transferToken = token;
+
+	switch (transferResult) {
+	case rslSUCCES:
+		stats.usbBytes += length;
+		break;
+	case rslNAK:
+		stats.naks++;
+		break;
+	case rslSTALL:
+		stats.stalls++;
+		break;
+	default:
+		stats.errors++;
+		break;
+	}
+
+	ns = _transactionNs(token, length, transferResult);
+	stats.usbTransactions++;
+	stats.usbNs += ns;
+	transferBusy = true;
+	transferDoneAt = now + ns;
+}
+
+static void _finishTransfer(void) {
+	FifoHalf * half;
+
+	transferBusy = false;
+	lastResult = transferResult;
+
+	if (transferResult == rslSUCCES) {
+		switch (transferToken) {
+		case xfrIN:
+		case xfrISOIN:
+			half = &rcvFifo[(rcvHead + rcvCount) % 2];
+			*half = transferIn;
+			if (!rcvCount++)
+				rcvRead = 0;
+			registers[rHIRQ] |= MAX_IRQ_RCVDAV;
+			if (transferToken == xfrIN)
+				rcvToggle = !rcvToggle;
+			break;
+		case xfrOUT:
+			sndToggle = !sndToggle;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* The half is released whether it was ACKed or not */
+	if ((transferToken == xfrOUT || transferToken == xfrISOOUT) && sndCount) {
+		sndHead = (sndHead + 1) % 2;
+		sndCount--;
+		_updateSendAvailable();
+	}
+
+	registers[rHIRQ] |= MAX_IRQ_HXFRDN;
+}
+
+static uint64_t _transactionNs(uint_fast8_t token, uint_fast8_t length, uint_fast8_t result) {
+	bool out = token == xfrSETUP || token == xfrOUT || token == xfrOUTHS || token == xfrISOOUT;
+	bool iso = token == xfrISOIN || token == xfrISOOUT;
+	bool lowSpeed = registers[rMODE] & MODE_LOWSPEED;
+	uint_fast8_t hostPackets = 1;
+	uint64_t bits = BITS_TOKEN;
+
+	if (out) {
+		bits += BITS_DATA(length);
+		hostPackets++;
+	}
+
+	switch (result) {
+	case rslSUCCES:
+		if (!out)
+			bits += BITS_TURNAROUND + BITS_DATA(length);
+		if (!iso) {
+			bits += BITS_TURNAROUND + BITS_HANDSHAKE;
+			hostPackets += out ? 0 : 1;
+		}
+		break;
+	case rslNAK:
+	case rslSTALL:
+		bits += BITS_TURNAROUND + BITS_HANDSHAKE;
+		break;
+	default:
+		bits += BITS_TIMEOUT;
+		break;
+	}
+
+	if (!lowSpeed)
+		return bits * 1000 / 12;
+	if (registers[rMODE] & MODE_HUBPRE)
+		return bits * 2000 / 3 + hostPackets * BITS_PREAMBLE * 1000 / 12;
+	return bits * 2000 / 3;
+}
+
+/* The earliest thing the module does on its own */
+static bool _nextEvent(uint64_t * at) {
+	bool found = false;
+
+	if (transferBusy) {
+		*at = transferDoneAt;
+		found = true;
+	}
+	if (busResetting && (!found || busResetDoneAt < *at)) {
+		*at = busResetDoneAt;
+		found = true;
+	}
+	if ((registers[rMODE] & MODE_SOFKAENAB) && (!found || nextFrameAt < *at)) {
+		*at = nextFrameAt;
+		found = true;
+	}
+	return found;
+}
+
+static void _advanceTo(uint64_t target) {
+	uint64_t at;
+
+	while (_nextEvent(&at) && at <= target) {
+		now = MAX(now, at);
+		if (transferBusy && transferDoneAt == at) {
+			_finishTransfer();
+		}
+		else if (busResetting && busResetDoneAt == at) {
+			busResetting = false;
+			registers[rHIRQ] |= MAX_IRQ_BUSEVENT;
+		}
+		else {
+			registers[rHIRQ] |= MAX_IRQ_FRAME;
+			nextFrameAt += MAXSIM_FRAME_NS;
+		}
+	}
+	now = MAX(now, target);
+}
+
+static void _clockStart(void) {
+	clockBase = now;
+}
+
+static uint32_t _clockNow(void) {
+	return (uint32_t)((now - clockBase) / 1000);
+}
@@ -0,0 +1,145 @@
+#pragma once
+/*
+ * max_sim.h
+ *
+ * Behavioural model of the MAX3421E in host mode, to run the driver without the chip.
+ * It is installed as the SPI transport underneath SIMSPI_transmitByte, decodes the command
+ * bytes and keeps the register file, the double-buffered RCVFIFO and SNDFIFO, the HIRQ
+ * flags and the INT pin. Every HXFR token is run against the device model on the port.
+ *
+ * Time is simulated: SPI transfers and USB transactions take their wire time on a clock
+ * that only moves when the driver talks to the module or the harness idles, so the same
+ * run always gives the same numbers
+ *
+ * Usage: SIMSPI_setTransport(&MAXSIM_transport) before MAX_start, MAXSIM_attach to plug a
+ * device in. Where the firmware sleeps, the harness calls MAXSIM_idle; where the SPI
+ * interrupt would run, MAXSIM_serviceSpi; while MAXSIM_intAsserted, the INT pin is low.
+ * Host-only: host/platform.c is that harness and host/CMakeLists.txt builds the tests
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "simple_spi.h"
+#include "bench.h"
+
+/* SPI clock of the nrf_spi_mngr transport (SPI_FREQUENCY_FREQUENCY_M4) */
+#define MAXSIM_SPI_HZ           4000000UL
+
+/* Chip-select setup and hold around every transfer, plus the EasyDMA start (ns) */
+#define MAXSIM_SPI_CS_NS        1000UL
+
+/* Value of rREVISION */
+#define MAXSIM_REVISION         0x13
+
+/* How long the module drives a bus reset before it clears BUSRST (ns) */
+#define MAXSIM_BUSRST_NS        50000000ULL
+
+/* Frame length while SOFKAENAB is set (ns) */
+#define MAXSIM_FRAME_NS         1000000ULL
+
+/* Size of each half of the RCVFIFO and SNDFIFO */
+#define MAXSIM_FIFO_SIZE        64
+
+/* The device side of the root port. Device models embed this as their first member.
+ * token is called once for every transaction the module puts on the wire:
+ *   SETUP: data holds the 8 setup bytes
+ *   OUT, OUTHS: data holds *length bytes
+ *   IN, INHS: the model fills data with up to MAXSIM_FIFO_SIZE bytes and sets *length
+ * and returns the handshake as a result code: rslSUCCES (ACK), rslNAK, rslSTALL, or an
+ * error such as rslTIMEOUT when it does not answer */
+typedef struct MaxSimPort {
+	uint_fast8_t(*token)(struct MaxSimPort *, uint_fast8_t, uint_fast8_t, uint_fast8_t, uint8_t *, uint_fast8_t *);
+	void(*busReset)(struct MaxSimPort *);   /* may be NULL */
+	uint8_t speed;                          /* USB_SPEED_FULL or USB_SPEED_LOW */
+} MaxSimPort;
+
+typedef struct {
+	uint32_t spiTransactions;   /* chip-select cycles */
+	uint32_t spiBytes;          /* bytes clocked, command bytes included */
+	uint32_t usbTransactions;   /* HXFR tokens put on the wire */
+	uint32_t usbBytes;          /* payload bytes that were acknowledged */
+	uint32_t naks;
+	uint32_t stalls;
+	uint32_t errors;            /* timeouts and other error results */
+	uint32_t overruns;          /* IN tokens issued with both RCVFIFO halves full */
+	uint32_t collisions;        /* HXFR written while a transaction was still on the wire */
+	uint64_t spiNs;             /* time the SPI bus was busy */
+	uint64_t usbNs;             /* time the USB was busy with tokens */
+} MaxSimStats;
+
+/* The SPI transport to pass to SIMSPI_setTransport */
+extern SPITransport const MAXSIM_transport;
+
+/* The simulated time as a benchmark clock, to pass to BENCH_setClock */
+extern BenchClock const MAXSIM_clock;
+
+/**
+ * Plug a device into the root port. Sets CONDETIRQ
+ *
+ * Parameters:
+ * MaxSimPort * port: the device model, must stay valid until MAXSIM_detach
+ */
+void MAXSIM_attach(MaxSimPort *);
+
+/**
+ * Unplug the device from the root port. Sets CONDETIRQ; a token on the wire times out
+ */
+void MAXSIM_detach(void);
+
+/**
+ * Check the INT pin: asserted while IE is set and an enabled HIRQ flag is pending
+ *
+ * Returns:
+ * bool: true if the (active low) pin is driven low
+ */
+bool MAXSIM_intAsserted(void);
+
+/**
+ * Let time pass until the next thing the module does on its own: a transaction finishes,
+ * a bus reset ends or a frame starts. Stands in for the MCU sleeping
+ *
+ * Parameters:
+ * uint64_t until: wake up at this time at the latest (the next timer of the harness),
+ *                 UINT64_MAX for no limit
+ *
+ * Returns:
+ * bool: true if the module did something, false if it slept until 'until' or had nothing
+ *       pending (the clock did not move then)
+ */
+bool MAXSIM_idle(uint64_t);
+
+/**
+ * Let time pass
+ *
+ * Parameters:
+ * uint64_t ns: the time to add to the clock
+ */
+void MAXSIM_advance(uint64_t);
+
+/**
+ * Perform the transfers queued with SIMSPI_schedule and complete them, in order. Stands
+ * in for the SPI interrupt
+ */
+void MAXSIM_serviceSpi(void);
+
+/**
+ * Get the simulated time
+ *
+ * Returns:
+ * uint64_t: simulated time in ns
+ */
+uint64_t MAXSIM_now(void);
+
+/**
+ * Get the traffic counters
+ *
+ * Parameters:
+ * MaxSimStats * result: filled in with a copy of the counters
+ */
+void MAXSIM_getStats(MaxSimStats *);
+
+/**
+ * Reset the traffic counters; the clock keeps running
+ */
+void MAXSIM_resetStats(void);
@@ -0,0 +1,206 @@
+/*
+ * motion.c
+ *
+ * Coalescing of mouse input between the USB polls and the BLE notifications. USB mice
+ * report every 1 to 8 ms, a connection event comes every 7.5 ms or more, so whatever
+ * can't be notified yet is merged into the report that is waiting instead of queued
+ */
+
+#include <string.h>
+
+#include "motion.h"
+#include "nrf_services.h"
+#include "latency.h"
+
+/* The button and media state the motion in it was made with */
+typedef struct {
+	int16_t x;
+	int16_t y;
+	int8_t wheel;
+	int8_t pan;
+	uint8_t buttons;
+	uint8_t media;
+	uint32_t since;             /* when the oldest input in it came in */
+} MotionSegment;
+
+static MotionSegment segments[MOTION_SEGMENTS];
+static uint_fast8_t head;
+static uint_fast8_t count;
+
+/* The state the peer was last sent */
+static uint8_t sentButtons;
+static uint8_t sentMedia;
+
+static MotionStats stats;
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static int32_t _clamp(int32_t, int32_t);
+static int32_t _saturate(int32_t, int32_t);
+static bool _held(ret_code_t);
+static bool _sendSegment(MotionSegment *);
+static bool _sendBoot(MotionSegment *);
+
+/* PUBLIC FUNCTIONS */
+
+void MOTION_add(MotionInput const * input) {
+	MotionSegment * segment = count ? &segments[(head + count - 1) % MOTION_SEGMENTS] : NULL;
+	uint8_t buttons = segment ? segment->buttons : sentButtons;
+	uint8_t media = segment ? segment->media : sentMedia;
+
+	stats.inputs++;
+	if (!input->x && !input->y && !input->wheel && !input->pan && input->buttons == buttons && input->media == media)
+		return;
+
+	/* A new state starts a segment so the edge reaches the peer; without a free segment the
+	 * intermediate state is lost, but the motion still adds up */
+	if (!segment || input->buttons != buttons || input->media != media) {
+		if (count < MOTION_SEGMENTS) {
+			segment = &segments[(head + count++) % MOTION_SEGMENTS];
+			memset(segment, 0, sizeof(MotionSegment));
+			segment->since = input->received;
+		}
+		else {
+			stats.edgesLost++;
+		}
+		segment->buttons = input->buttons;
+		segment->media = input->media;
+	}
+	else {
+		stats.merged++;
+	}
+
+	segment->x = (int16_t) _saturate(segment->x + input->x, MOTION_MOVEMENT_MAX);
+	segment->y = (int16_t) _saturate(segment->y + input->y, MOTION_MOVEMENT_MAX);
+	segment->wheel = (int8_t) _saturate(segment->wheel + input->wheel, MOTION_BYTE_MAX);
+	segment->pan = (int8_t) _saturate(segment->pan + input->pan, MOTION_BYTE_MAX);
+
+	MOTION_flush();
+}
+
+void MOTION_addMovement(int32_t x, int32_t y) {
+	MotionSegment const * segment = count ? &segments[(head + count - 1) % MOTION_SEGMENTS] : NULL;
+	MotionInput input;
+
+	memset(&input, 0, sizeof(input));
+	input.x = x;
+	input.y = y;
+	input.buttons = segment ? segment->buttons : sentButtons;
+	input.media = segment ? segment->media : sentMedia;
+	input.received = LATENCY_now();
+	MOTION_add(&input);
+}
+
+void MOTION_flush(void) {
+	uint32_t dropped;
+	bool done;
+
+	while (count) {
+		dropped = stats.dropped;
+		if (NRF_Services.in_boot_mode())
+			done = _sendBoot(&segments[head]);
+		else
+			done = _sendSegment(&segments[head]);
+		if (!done)
+			return;
+
+		/* The input is through once its last report went out; reports nobody got don't count */
+		if (stats.dropped == dropped)
+			LATENCY_record(segments[head].since);
+		head = (head + 1) % MOTION_SEGMENTS;
+		count--;
+	}
+}
+
+void MOTION_reset(void) {
+	head = 0;
+	count = 0;
+	sentButtons = 0;
+	sentMedia = 0;
+}
+
+bool MOTION_pending(void) {
+	return count != 0;
+}
+
+void MOTION_getStats(MotionStats * result) {
+	*result = stats;
+}
+
+/* PRIVATE FUNCTIONS */
+
+static int32_t _clamp(int32_t value, int32_t limit) {
+	return (value > limit) ? limit : (value < -limit) ? -limit : value;
+}
+
+static int32_t _saturate(int32_t value, int32_t limit) {
+	if (value > limit || value < -limit)
+		stats.saturated++;
+	return _clamp(value, limit);
+}
+
+/* Count a send. Returns true if it was refused for now and should be tried again */
+static bool _held(ret_code_t err_code) {
+	if (err_code == NRF_SUCCESS) {
+		stats.sent++;
+		return false;
+	}
+	if (err_code == NRF_ERROR_RESOURCES || err_code == NRF_ERROR_BUSY) {
+		stats.held++;
+		return true;
+	}
+	stats.dropped++;
+	return false;
+}
+
+/* Send the reports of a segment in report mode, buttons first as the motion was made with
+ * them. Parts that went out are cleared, so a segment that is held halfway continues where
+ * it stopped */
+static bool _sendSegment(MotionSegment * segment) {
+	uint8_t buffer[INPUT_REP_BUTTONS_LEN];
+
+	if (segment->buttons != sentButtons || segment->wheel || segment->pan) {
+		buffer[0] = segment->buttons;
+		buffer[1] = (uint8_t) segment->wheel;
+		buffer[2] = (uint8_t) segment->pan;
+		if (_held(NRF_Services.input_report_send(INPUT_REP_BUTTONS_INDEX, buffer, INPUT_REP_BUTTONS_LEN)))
+			return false;
+		sentButtons = segment->buttons;
+		segment->wheel = segment->pan = 0;
+	}
+
+	if (segment->x || segment->y) {
+		buffer[0] = segment->x & 0x00ff;
+		buffer[1] = ((segment->y & 0x000f) << 4) | ((segment->x & 0x0f00) >> 8);
+		buffer[2] = (segment->y & 0x0ff0) >> 4;
+		if (_held(NRF_Services.input_report_send(INPUT_REP_MOVEMENT_INDEX, buffer, INPUT_REP_MOVEMENT_LEN)))
+			return false;
+		segment->x = segment->y = 0;
+	}
+
+	if (segment->media != sentMedia) {
+		buffer[0] = segment->media;
+		if (_held(NRF_Services.input_report_send(INPUT_REP_MPLAYER_INDEX, buffer, INPUT_REP_MEDIA_PLAYER_LEN)))
+			return false;
+		sentMedia = segment->media;
+	}
+	return true;
+}
+
+/* Boot mode has one 8-bit report and no media keys: larger movement goes out in steps */
+static bool _sendBoot(MotionSegment * segment) {
+	int8_t x = (int8_t) _clamp(segment->x, MOTION_BYTE_MAX);
+	int8_t y = (int8_t) _clamp(segment->y, MOTION_BYTE_MAX);
+
+	sentMedia = segment->media;
+	if (!x && !y && !segment->wheel && segment->buttons == sentButtons)
+		return true;
+
+	if (_held(NRF_Services.boot_mouse_report_send(segment->buttons, x, y, segment->wheel)))
+		return false;
+	sentButtons = segment->buttons;
+	segment->x -= x;
+	segment->y -= y;
+	segment->wheel = 0;
+	return !segment->x && !segment->y;
+}
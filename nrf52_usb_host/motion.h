@@ -0,0 +1,84 @@
+#pragma once
+/*
+ * motion.h
+ *
+ * Coalescing of mouse input between the USB polls and the BLE notifications: deltas are
+ * summed while no notification buffer is free, button and media edges are kept in order
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Pending button/media states. A new state opens a segment, motion is summed into the last */
+#define MOTION_SEGMENTS         4
+
+/* Report ranges: 12-bit movement report, 8-bit wheel, pan and boot report */
+#define MOTION_MOVEMENT_MAX     2047
+#define MOTION_BYTE_MAX         127
+
+/* One translated USB report */
+typedef struct {
+	int32_t x;
+	int32_t y;
+	int32_t wheel;
+	int32_t pan;
+	uint8_t buttons;
+	uint8_t media;
+	uint32_t received;          /* LATENCY_now when the report came in */
+} MotionInput;
+
+typedef struct {
+	uint32_t inputs;            /* USB reports added */
+	uint32_t merged;            /* inputs summed into a report that was still pending */
+	uint32_t sent;              /* BLE reports handed to the SoftDevice */
+	uint32_t held;              /* sends refused for lack of buffers, kept for the next slot */
+	uint32_t dropped;           /* reports discarded: no connection or notifications off */
+	uint32_t saturated;         /* deltas clipped to the report range */
+	uint32_t edgesLost;         /* button/media states overwritten because all segments were in use */
+} MotionStats;
+
+/**
+ * Add the input of one USB report and send what the SoftDevice accepts right away
+ *
+ * Parameters:
+ * MotionInput const * input: the deltas since the last report and the current button and
+ *                            media state
+ */
+void MOTION_add(MotionInput const *);
+
+/**
+ * Add movement that comes with no button state of its own, like the BSP buttons: it is
+ * made with the buttons and media keys that are pressed right now
+ *
+ * Parameters:
+ * int32_t x: the horizontal movement
+ * int32_t y: the vertical movement
+ */
+void MOTION_addMovement(int32_t, int32_t);
+
+/**
+ * Send pending reports until the SoftDevice runs out of notification buffers. Called when
+ * a buffer frees up
+ */
+void MOTION_flush(void);
+
+/**
+ * Drop everything pending and forget the state the peer has, after a disconnect
+ */
+void MOTION_reset(void);
+
+/**
+ * Check whether anything is waiting for a notification buffer
+ *
+ * Returns:
+ * bool: true if reports are pending
+ */
+bool MOTION_pending(void);
+
+/**
+ * Get the coalescing counters
+ *
+ * Parameters:
+ * MotionStats * result: filled in with a copy of the counters
+ */
+void MOTION_getStats(MotionStats *);
@@ -1,20 +1,37 @@
 #include "nrf_battery.h"
+#include "nrf_pacer.h"
 
 static sensorsim_cfg_t   m_battery_sim_cfg; /**< Battery Level sensor simulator configuration. */
 static sensorsim_state_t m_battery_sim_state; /**< Battery Level sensor simulator state. */
 BLE_BAS_DEF(m_bas); /**< Battery service instance. */
+static uint8_t           m_pending_level; /**< Battery level held back while HID input had the notification queue. */
+static bool              m_level_pending; /**< Whether m_pending_level still has to be sent. */
 
 
-/**@brief Function for performing a battery measurement, and update the Battery Level characteristic in the Battery Service.
+/**@brief Function for notifying a battery level.
+ *
+ * @details The level is held back while the notification queue is busy with HID input and
+ *          sent by battery_level_flush once a slot frees up.
+ *
+ * @param[in]   battery_level   Battery level in percent.
  */
-static void battery_level_update(void)
+static void battery_level_send(uint8_t battery_level)
 {
 	ret_code_t err_code;
-	uint8_t  battery_level;
 
-	battery_level = (uint8_t)sensorsim_measure(&m_battery_sim_state, &m_battery_sim_cfg);
+	if (!NRF_Pacer.acquire(NOTIFY_PRIO_LOW))
+	{
+		m_pending_level = battery_level;
+		m_level_pending = true;
+		return;
+	}
+	m_level_pending = false;
 
 	err_code = ble_bas_battery_level_update(&m_bas, battery_level, BLE_CONN_HANDLE_ALL);
+	if (err_code != NRF_SUCCESS)
+	{
+		NRF_Pacer.release();
+	}
 	if ((err_code != NRF_SUCCESS) &&
 	    (err_code != NRF_ERROR_BUSY) &&
 	    (err_code != NRF_ERROR_RESOURCES) &&
@@ -25,6 +42,21 @@ static void battery_level_update(void)
 		APP_ERROR_HANDLER(err_code);
 	}
 }
+/**@brief Function for performing a battery measurement, and update the Battery Level characteristic in the Battery Service.
+ */
+static void battery_level_update(void)
+{
+	battery_level_send((uint8_t)sensorsim_measure(&m_battery_sim_state, &m_battery_sim_cfg));
+}
+/**@brief Function for sending a battery level that was held back, once the notification queue has room.
+ */
+static void battery_level_flush(void)
+{
+	if (m_level_pending)
+	{
+		battery_level_send(m_pending_level);
+	}
+}
 /**@brief Function for handling the Battery measurement timer timeout.
  *
  * @details This function will be called each time the battery level measurement timer expires.
@@ -75,6 +107,7 @@ static void sensor_simulator_init(void)
 
 const struct nrf_battery NRF_Battery= { 
 	.battery_level_update = battery_level_update,
+	.battery_level_flush = battery_level_flush,
 	.battery_level_meas_timeout_handler = battery_level_meas_timeout_handler,
 	.bas_init = bas_init,
 	.sensor_simulator_init = sensor_simulator_init,
@@ -44,6 +44,7 @@
 
 struct nrf_battery {
 	void(*battery_level_update)(void);
+	void(*battery_level_flush)(void);
 	void(*battery_level_meas_timeout_handler)(void * p_context);
 	void(*bas_init)(void);
 	void(*sensor_simulator_init)(void);	
@@ -1,4 +1,7 @@
 #include "nrf_ble_stack.h"
+#include "motion.h"
+#include "nrf_pacer.h"
+#include "nrf_latency.h"
 
 extern uint16_t m_conn_handle;
 NRF_BLE_QWR_DEF(m_qwr); /**< Context for the Queued Write module.*/
@@ -12,6 +15,10 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
 {
 	ret_code_t err_code;
 
+	// Notification queue slots are tracked first, so that sends below see them.
+	NRF_Pacer.on_ble_evt(p_ble_evt);
+	NRF_Latency.on_ble_evt(p_ble_evt);
+
 	switch (p_ble_evt->header.evt_id)
 	{
 	case BLE_GAP_EVT_CONNECTED:
@@ -30,6 +37,9 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
 		// LED indication will be changed when advertising starts.
 
 		m_conn_handle = BLE_CONN_HANDLE_INVALID;
+
+		// Motion that was not sent is stale by the next connection.
+		MOTION_reset();
 		break;
 
 	case BLE_GAP_EVT_PHY_UPDATE_REQUEST:
@@ -82,6 +92,9 @@ static void ble_stack_init(void)
 	err_code = nrf_sdh_ble_default_cfg_set(APP_BLE_CONN_CFG_TAG, &ram_start);
 	APP_ERROR_CHECK(err_code);
 
+	// Let the SoftDevice queue several notifications per link.
+	NRF_Pacer.gatts_cfg_set(ram_start);
+
 	// Enable BLE stack.
 	err_code = nrf_sdh_ble_enable(&ram_start);
 	APP_ERROR_CHECK(err_code);
@@ -0,0 +1,165 @@
+#include "nrf_latency.h"
+
+static uint16_t                 m_service_handle;                                   /**< Handle of the latency service. */
+static ble_gatts_char_handles_t m_histogram_handles;                                /**< Handles of the histogram characteristic. */
+static uint8_t                  m_histogram_value[LATENCY_HISTOGRAM_LEN];           /**< Snapshot handed out by the last read. */
+
+
+/**@brief Function for encoding the current histogram as the characteristic value.
+ *
+ * @param[out]  p_data   Buffer of LATENCY_HISTOGRAM_LEN bytes.
+ */
+static void histogram_encode(uint8_t * p_data)
+{
+	LatencyHistogram histogram;
+	uint8_t          offset = 4;
+	uint8_t          i;
+
+	LATENCY_getHistogram(&histogram);
+
+	p_data[0] = LATENCY_FORMAT_VERSION;
+	p_data[1] = LATENCY_BUCKETS;
+	p_data[2] = LATENCY_BUCKET_SHIFT;
+	p_data[3] = 0;
+	offset += uint32_encode(histogram.samples, &p_data[offset]);
+	offset += uint32_encode(histogram.maxUs, &p_data[offset]);
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		offset += uint32_encode(histogram.counts[i], &p_data[offset]);
+	}
+}
+/**@brief Function for answering a read or write of the histogram characteristic.
+ *
+ * @details Reads are authorized so the value is taken from the live histogram instead of
+ *          being kept up to date on every input. A long read arrives as several requests;
+ *          only the first one takes a new snapshot, so the pieces fit together.
+ *
+ * @param[in]   p_ble_evt   Bluetooth stack event of type BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST.
+ */
+static void on_rw_authorize_request(ble_evt_t const * p_ble_evt)
+{
+	ret_code_t                                    err_code;
+	ble_gatts_evt_rw_authorize_request_t const *  p_request = &p_ble_evt->evt.gatts_evt.params.authorize_request;
+	ble_gatts_rw_authorize_reply_params_t         reply;
+
+	memset(&reply, 0, sizeof(reply));
+
+	if (p_request->type == BLE_GATTS_AUTHORIZE_TYPE_READ)
+	{
+		if (p_request->request.read.handle != m_histogram_handles.value_handle)
+		{
+			return;
+		}
+
+		reply.type                     = BLE_GATTS_AUTHORIZE_TYPE_READ;
+		reply.params.read.gatt_status  = BLE_GATT_STATUS_SUCCESS;
+		if (p_request->request.read.offset == 0)
+		{
+			histogram_encode(m_histogram_value);
+			reply.params.read.update   = 1;
+			reply.params.read.len      = LATENCY_HISTOGRAM_LEN;
+			reply.params.read.p_data   = m_histogram_value;
+		}
+	}
+	else if (p_request->type == BLE_GATTS_AUTHORIZE_TYPE_WRITE)
+	{
+		if (p_request->request.write.handle != m_histogram_handles.value_handle)
+		{
+			return;
+		}
+
+		// Any write starts a new measurement. The SoftDevice wants the written data stored,
+		// the next read replaces it with the histogram again.
+		LATENCY_reset();
+		reply.type                     = BLE_GATTS_AUTHORIZE_TYPE_WRITE;
+		reply.params.write.gatt_status = BLE_GATT_STATUS_SUCCESS;
+		reply.params.write.update      = 1;
+		reply.params.write.offset      = p_request->request.write.offset;
+		reply.params.write.len         = p_request->request.write.len;
+		reply.params.write.p_data      = p_request->request.write.data;
+	}
+	else
+	{
+		return;
+	}
+
+	err_code = sd_ble_gatts_rw_authorize_reply(p_ble_evt->evt.gatts_evt.conn_handle, &reply);
+	if ((err_code != NRF_SUCCESS) &&
+	    (err_code != NRF_ERROR_INVALID_STATE) &&
+	    (err_code != BLE_ERROR_INVALID_CONN_HANDLE))
+	{
+		APP_ERROR_HANDLER(err_code);
+	}
+}
+/**@brief Function for handling the events of the latency service.
+ *
+ * @param[in]   p_ble_evt   Bluetooth stack event.
+ */
+static void on_ble_evt(ble_evt_t const * p_ble_evt)
+{
+	switch (p_ble_evt->header.evt_id)
+	{
+	case BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST:
+		on_rw_authorize_request(p_ble_evt);
+		break;
+
+	default:
+		// No implementation needed.
+		break;
+	}
+}
+/**@brief Function for initializing the latency service.
+ *
+ * @details A vendor specific service with one characteristic that holds the USB-to-BLE input
+ *          latency histogram, for a desktop tool to read in the field.
+ */
+static void latency_service_init(void)
+{
+	ret_code_t          err_code;
+	ble_uuid128_t       base_uuid = {LATENCY_UUID_BASE};
+	ble_uuid_t          service_uuid;
+	ble_uuid_t          char_uuid;
+	ble_gatts_char_md_t char_md;
+	ble_gatts_attr_md_t attr_md;
+	ble_gatts_attr_t    attr_char_value;
+
+	err_code = sd_ble_uuid_vs_add(&base_uuid, &service_uuid.type);
+	APP_ERROR_CHECK(err_code);
+	service_uuid.uuid = LATENCY_UUID_SERVICE;
+
+	err_code = sd_ble_gatts_service_add(BLE_GATTS_SRVC_TYPE_PRIMARY, &service_uuid, &m_service_handle);
+	APP_ERROR_CHECK(err_code);
+
+	memset(&char_md, 0, sizeof(char_md));
+	char_md.char_props.read  = 1;
+	char_md.char_props.write = 1;
+
+	memset(&attr_md, 0, sizeof(attr_md));
+	BLE_GAP_CONN_SEC_MODE_SET_ENC_NO_MITM(&attr_md.read_perm);
+	BLE_GAP_CONN_SEC_MODE_SET_ENC_NO_MITM(&attr_md.write_perm);
+	attr_md.vloc    = BLE_GATTS_VLOC_STACK;
+	attr_md.rd_auth = 1;
+	attr_md.wr_auth = 1;
+	attr_md.vlen    = 1;
+
+	char_uuid.type = service_uuid.type;
+	char_uuid.uuid = LATENCY_UUID_HISTOGRAM_CHAR;
+
+	histogram_encode(m_histogram_value);
+
+	memset(&attr_char_value, 0, sizeof(attr_char_value));
+	attr_char_value.p_uuid    = &char_uuid;
+	attr_char_value.p_attr_md = &attr_md;
+	attr_char_value.init_len  = LATENCY_HISTOGRAM_LEN;
+	attr_char_value.max_len   = LATENCY_HISTOGRAM_LEN;
+	attr_char_value.p_value   = m_histogram_value;
+
+	err_code = sd_ble_gatts_characteristic_add(m_service_handle, &char_md, &attr_char_value, &m_histogram_handles);
+	APP_ERROR_CHECK(err_code);
+}
+
+
+const struct nrf_latency NRF_Latency = {
+	.latency_service_init = latency_service_init,
+	.on_ble_evt = on_ble_evt
+};
@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "nordic_common.h"
+#include "app_error.h"
+#include "app_util.h"
+#include "ble.h"
+#include "ble_gatts.h"
+#include "ble_srv_common.h"
+
+#include "nrf_log.h"
+
+#include "latency.h"
+
+#define LATENCY_UUID_BASE               {0x5B, 0x1E, 0x7A, 0x42, 0x93, 0x0C, 0x4D, 0x8E, \
+                                         0xA1, 0x56, 0x2F, 0xC8, 0x00, 0x00, 0x3D, 0x71} /**< Vendor specific base UUID of the latency service (little endian). */
+#define LATENCY_UUID_SERVICE            0x0001                                      /**< 16-bit part of the latency service UUID. */
+#define LATENCY_UUID_HISTOGRAM_CHAR     0x0002                                      /**< 16-bit part of the histogram characteristic UUID. */
+
+#define LATENCY_FORMAT_VERSION          1                                           /**< Layout version of the histogram characteristic value. */
+#define LATENCY_HISTOGRAM_LEN           (12 + 4 * LATENCY_BUCKETS)                  /**< Length of the histogram characteristic value. */
+
+/* Histogram characteristic value, all fields little endian:
+ *   uint8_t  version         LATENCY_FORMAT_VERSION
+ *   uint8_t  bucket_count    LATENCY_BUCKETS
+ *   uint8_t  bucket_shift    LATENCY_BUCKET_SHIFT
+ *   uint8_t  reserved
+ *   uint32_t samples
+ *   uint32_t max_us
+ *   uint32_t counts[bucket_count]
+ * Reads return a snapshot taken when the read starts. Writing any value clears the histogram.
+ * NRF_SDH_BLE_VS_UUID_COUNT in sdk_config.h counts the base UUID */
+
+struct nrf_latency {
+	void(*latency_service_init)(void);
+	void(*on_ble_evt)(ble_evt_t const * p_ble_evt);
+};
+
+extern const struct nrf_latency NRF_Latency;
@@ -0,0 +1,118 @@
+#include "nrf_pacer.h"
+#include "nrf_advertising.h"
+#include "nrf_battery.h"
+#include "motion.h"
+
+static bool              m_connected;                                               /**< Whether a peer is connected; without one the SoftDevice refuses by itself. */
+static uint8_t           m_free_slots;                                              /**< Notification queue slots the SoftDevice has free. */
+static nrf_pacer_stats_t m_stats;                                                   /**< Notification counters. */
+
+/**@brief Function for setting the notification queue size.
+ *
+ * @details Must be called between nrf_sdh_ble_default_cfg_set and nrf_sdh_ble_enable. A queue
+ *          of several notifications lets one connection event carry the reports that piled up
+ *          since the last one.
+ *
+ * @param[in]   ram_start   Start of the application RAM, from nrf_sdh_ble_default_cfg_set.
+ */
+static void gatts_cfg_set(uint32_t ram_start)
+{
+	ret_code_t err_code;
+	ble_cfg_t  ble_cfg;
+
+	memset(&ble_cfg, 0, sizeof(ble_cfg));
+	ble_cfg.conn_cfg.conn_cfg_tag                            = APP_BLE_CONN_CFG_TAG;
+	ble_cfg.conn_cfg.params.gatts_conn_cfg.hvn_tx_queue_size = NOTIFY_QUEUE_SIZE;
+
+	err_code = sd_ble_cfg_set(BLE_CONN_CFG_GATTS, &ble_cfg, ram_start);
+	APP_ERROR_CHECK(err_code);
+}
+/**@brief Function for tracking the notification queue.
+ *
+ * @details Freed slots go to HID input first; status updates that were held back follow.
+ *
+ * @param[in]   p_ble_evt   Bluetooth stack event.
+ */
+static void on_ble_evt(ble_evt_t const * p_ble_evt)
+{
+	uint8_t count;
+
+	switch (p_ble_evt->header.evt_id)
+	{
+	case BLE_GAP_EVT_CONNECTED:
+		m_connected  = true;
+		m_free_slots = NOTIFY_QUEUE_SIZE;
+		break;
+
+	case BLE_GAP_EVT_DISCONNECTED:
+		m_connected = false;
+		break;
+
+	case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+		count            = p_ble_evt->evt.gatts_evt.params.hvn_tx_complete.count;
+		m_stats.completed += count;
+		m_free_slots     = MIN(m_free_slots + count, NOTIFY_QUEUE_SIZE);
+
+		MOTION_flush();
+		NRF_Battery.battery_level_flush();
+		break;
+
+	default:
+		// No implementation needed.
+		break;
+	}
+}
+/**@brief Function for taking a notification queue slot before submitting a notification.
+ *
+ * @details Low priority notifications only get a slot while no HID input is waiting and
+ *          NOTIFY_HID_RESERVE slots stay free.
+ *
+ * @param[in]   prio   Priority of the notification.
+ *
+ * @return      true if the notification can be submitted, false to hold it back.
+ */
+static bool acquire(nrf_pacer_prio_t prio)
+{
+	uint8_t reserve = (prio == NOTIFY_PRIO_HID) ? 0 : NOTIFY_HID_RESERVE;
+
+	if (!m_connected)
+	{
+		return true;
+	}
+
+	if ((m_free_slots <= reserve) || ((prio != NOTIFY_PRIO_HID) && MOTION_pending()))
+	{
+		m_stats.refused++;
+		return false;
+	}
+
+	m_free_slots--;
+	m_stats.submitted++;
+	return true;
+}
+/**@brief Function for giving back a slot of a notification the SoftDevice did not accept.
+ */
+static void release(void)
+{
+	if (m_connected)
+	{
+		m_free_slots++;
+		m_stats.submitted--;
+	}
+}
+/**@brief Function for getting the notification counters.
+ *
+ * @param[out]  p_stats   Copy of the counters.
+ */
+static void stats_get(nrf_pacer_stats_t * p_stats)
+{
+	*p_stats = m_stats;
+}
+
+const struct nrf_pacer NRF_Pacer = {
+	.gatts_cfg_set = gatts_cfg_set,
+	.on_ble_evt = on_ble_evt,
+	.acquire = acquire,
+	.release = release,
+	.stats_get = stats_get
+};
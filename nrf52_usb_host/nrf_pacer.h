@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "nordic_common.h"
+#include "app_error.h"
+#include "ble.h"
+#include "ble_gatts.h"
+#include "nrf_sdh_ble.h"
+
+#include "nrf_log.h"
+
+#define NOTIFY_QUEUE_SIZE               4                                           /**< Handle Value Notifications the SoftDevice can queue per link (hvn_tx_queue_size). */
+#define NOTIFY_HID_RESERVE              1                                           /**< Queue slots low priority notifications must leave free for HID input. */
+
+/**@brief Priority of a notification. */
+typedef enum
+{
+	NOTIFY_PRIO_HID,                                                                /**< HID input reports: may use every free slot. */
+	NOTIFY_PRIO_LOW                                                                 /**< Battery level and other status: only when HID input is idle. */
+} nrf_pacer_prio_t;
+
+/**@brief Notification counters. */
+typedef struct
+{
+	uint32_t submitted;                                                             /**< Notifications handed to the SoftDevice. */
+	uint32_t completed;                                                             /**< Notifications the SoftDevice reported as sent. */
+	uint32_t refused;                                                               /**< Submissions held back because no slot was free. */
+} nrf_pacer_stats_t;
+
+struct nrf_pacer {
+	void(*gatts_cfg_set)(uint32_t ram_start);
+	void(*on_ble_evt)(ble_evt_t const * p_ble_evt);
+	bool(*acquire)(nrf_pacer_prio_t prio);
+	void(*release)(void);
+	void(*stats_get)(nrf_pacer_stats_t * p_stats);
+};
+
+extern const struct nrf_pacer NRF_Pacer;
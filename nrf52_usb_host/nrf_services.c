@@ -1,4 +1,8 @@
 #include "nrf_services.h"
+#include "nrf_pacer.h"
+#include "trace.h"
+#include "nrf_latency.h"
+#include "motion.h"
 
 static bool              m_in_boot_mode = false; /**< Current protocol mode. */
 NRF_BLE_QWR_DEF(m_qwr); /**< Context for the Queued Write module.*/
@@ -63,56 +67,107 @@ static void on_hids_evt(ble_hids_t * p_hids, ble_hids_evt_t * p_evt)
 		break;
 	}
 }
+/**@brief Function for checking the result of sending an input report.
+ *
+ * @details Reports that can't be sent right now (no connection, no notification buffers) are
+ *          dropped and give their notification queue slot back; anything else is an error.
+ *
+ * @param[in]   err_code   Result of the send.
+ */
+static void input_report_check(ret_code_t err_code)
+{
+	TRACE(TRACE_BLE_INPUT, err_code);
+
+	if ((err_code != NRF_SUCCESS) &&
+	    (err_code != NRF_ERROR_INVALID_STATE) &&
+	    (err_code != NRF_ERROR_RESOURCES) &&
+	    (err_code != NRF_ERROR_BUSY) &&
+	    (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
+	{
+		APP_ERROR_HANDLER(err_code);
+	}
+	if (err_code != NRF_SUCCESS)
+	{
+		NRF_Pacer.release();
+	}
+}
 /**@brief Function for sending a Mouse Movement.
+ *
+ * @details The movement goes through the motion coalescer like the USB input, so a
+ *          movement that finds no free notification slot is summed into the pending
+ *          report and sent on the next TX complete instead of lost.
  *
  * @param[in]   x_delta   Horizontal movement.
  * @param[in]   y_delta   Vertical movement.
+ *
+ * @return      NRF_SUCCESS if the movement went out, NRF_ERROR_RESOURCES if it is held for
+ *              the next free slot.
  */
-static void mouse_movement_send(int16_t x_delta, int16_t y_delta)
+static ret_code_t mouse_movement_send(int16_t x_delta, int16_t y_delta)
+{
+	MOTION_addMovement(x_delta, y_delta);
+	return MOTION_pending() ? NRF_ERROR_RESOURCES : NRF_SUCCESS;
+}
+/**@brief Function for sending an input report in report mode.
+ *
+ * @param[in]   index     Index of the input report (INPUT_REP_*_INDEX).
+ * @param[in]   p_data    Report data, in the layout of the report map.
+ * @param[in]   len       Length of the report.
+ *
+ * @return      NRF_SUCCESS, NRF_ERROR_RESOURCES if the notification queue is full, or the error
+ *              of a report that was dropped.
+ */
+static ret_code_t input_report_send(uint8_t index, uint8_t * p_data, uint16_t len)
 {
 	ret_code_t err_code;
 
-	if (m_in_boot_mode)
+	if (!NRF_Pacer.acquire(NOTIFY_PRIO_HID))
 	{
-		x_delta = MIN(x_delta, 0x00ff);
-		y_delta = MIN(y_delta, 0x00ff);
-
-		err_code = ble_hids_boot_mouse_inp_rep_send(&m_hids,
-			0x00,
-			(int8_t)x_delta,
-			(int8_t)y_delta,
-			0,
-			NULL,
-			m_conn_handle);
+		return NRF_ERROR_RESOURCES;
 	}
-	else
-	{
-		uint8_t buffer[INPUT_REP_MOVEMENT_LEN];
 
-		APP_ERROR_CHECK_BOOL(INPUT_REP_MOVEMENT_LEN == 3);
+	err_code = ble_hids_inp_rep_send(&m_hids, index, len, p_data, m_conn_handle);
 
-		x_delta = MIN(x_delta, 0x0fff);
-		y_delta = MIN(y_delta, 0x0fff);
-
-		buffer[0] = x_delta & 0x00ff;
-		buffer[1] = ((y_delta & 0x000f) << 4) | ((x_delta & 0x0f00) >> 8);
-		buffer[2] = (y_delta & 0x0ff0) >> 4;
-
-		err_code = ble_hids_inp_rep_send(&m_hids,
-			INPUT_REP_MOVEMENT_INDEX,
-			INPUT_REP_MOVEMENT_LEN,
-			buffer,
-			m_conn_handle);
-	}
+	input_report_check(err_code);
+	return err_code;
+}
+/**@brief Function for sending a boot mouse input report.
+ *
+ * @param[in]   buttons   Button bitmap.
+ * @param[in]   x_delta   Horizontal movement.
+ * @param[in]   y_delta   Vertical movement.
+ * @param[in]   wheel     Wheel movement, sent as the optional data byte.
+ *
+ * @return      NRF_SUCCESS, NRF_ERROR_RESOURCES if the notification queue is full, or the error
+ *              of a report that was dropped.
+ */
+static ret_code_t boot_mouse_report_send(uint8_t buttons, int8_t x_delta, int8_t y_delta, int8_t wheel)
+{
+	ret_code_t err_code;
 
-	if ((err_code != NRF_SUCCESS) &&
-	    (err_code != NRF_ERROR_INVALID_STATE) &&
-	    (err_code != NRF_ERROR_RESOURCES) &&
-	    (err_code != NRF_ERROR_BUSY) &&
-	    (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
+	if (!NRF_Pacer.acquire(NOTIFY_PRIO_HID))
 	{
-		APP_ERROR_HANDLER(err_code);
+		return NRF_ERROR_RESOURCES;
 	}
+
+	err_code = ble_hids_boot_mouse_inp_rep_send(&m_hids,
+		buttons,
+		x_delta,
+		y_delta,
+		wheel ? 1 : 0,
+		(uint8_t *)&wheel,
+		m_conn_handle);
+
+	input_report_check(err_code);
+	return err_code;
+}
+/**@brief Function for getting the protocol mode the peer selected.
+ *
+ * @return      true in boot mode, false in report mode.
+ */
+static bool in_boot_mode(void)
+{
+	return m_in_boot_mode;
 }
 /**@brief Function for handling Service errors.
  *
@@ -452,6 +507,7 @@ static void services_init(void)
 	qwr_init();
 	dis_init();
 	NRF_Battery.bas_init();
+	NRF_Latency.latency_service_init();
 	hids_init();
 }
 
@@ -460,6 +516,9 @@ const struct nrf_services NRF_Services = {
 	.dis_init = dis_init,
 	.on_hids_evt = on_hids_evt,
 	.services_init = services_init,
-	.mouse_movement_send = mouse_movement_send
+	.mouse_movement_send = mouse_movement_send,
+	.input_report_send = input_report_send,
+	.boot_mouse_report_send = boot_mouse_report_send,
+	.in_boot_mode = in_boot_mode
 	
 };
@@ -59,7 +59,10 @@ struct nrf_services {
 	void(*dis_init)(void);
 	void(*on_hids_evt)(ble_hids_t * p_hids, ble_hids_evt_t * p_evt);
 	void(*services_init)(void);
-	void(*mouse_movement_send)(int16_t x_delta, int16_t y_delta);
+	ret_code_t(*mouse_movement_send)(int16_t x_delta, int16_t y_delta);
+	ret_code_t(*input_report_send)(uint8_t index, uint8_t * p_data, uint16_t len);
+	ret_code_t(*boot_mouse_report_send)(uint8_t buttons, int8_t x_delta, int8_t y_delta, int8_t wheel);
+	bool(*in_boot_mode)(void);
 };
 
 extern const struct nrf_services NRF_Services;
\ No newline at end of file
@@ -8,49 +8,222 @@
 #include "max3421e.h"
 #include "usb.h"
 #include "packets.h"
-#include "nrf_delay.h"
 #include "nrf_log.h"
+#include "nrf_pwr_mgmt.h"
+#include "app_timer.h"
+#include "trace.h"
 
 volatile uint_fast8_t TXData[BUFFER_SIZE];
-volatile uint_fast8_t ControlBuffer[2];
+volatile uint_fast8_t ControlBuffer[BUFFER_SIZE];
 
-uint_fast8_t transmitPacket(uint_fast8_t token, uint_fast8_t ep) {
-	uint_fast8_t regval;
-	uint16_t timeout;
+/* The host transfer currently on the wire */
+typedef struct {
+	bool busy;
+	bool backingOff;            /* waiting for retryAt before re-issuing a NAK'd token */
+	uint_fast8_t address;
+	uint_fast8_t token;
+	uint_fast8_t ep;
+	uint_fast16_t naksLeft;
+	uint_fast8_t errorsLeft;
+	uint_fast8_t backoffMs;
+	uint_fast8_t maxBackoffMs;
+	uint32_t retryAt;
+	TransferCallback callback;
+	void * context;
+} HostTransfer;
 
-	/* Instruct the module to send the data as the specified type */
-	MAX_writeRegister(rHXFR, token | ep);
+static volatile HostTransfer currentTransfer;
+static volatile uint32_t transfersFinished;
 
-	nrf_delay_ms(1000);
+/* The OUT packet last committed to the SNDFIFO. The module does not keep it for a token
+ * that was not ACKed, so it is loaded again before every OUT token after the first */
+static uint_fast8_t sendPacket[BUFFER_SIZE];
+static uint_fast8_t sendLength;
+static bool sendFresh;
 
-	timeout = 0xFFFF;
-	while (timeout) {
-		regval = MAX_readRegister(rHRSL) & 0x0F;
-		if (regval == rslBUSY) {
-			nrf_delay_ms(100);
-		}
-		else if (regval == rslNAK) {
-			timeout--;
-			MAX_writeRegister(rHXFR, token | ep);
-			nrf_delay_ms(200);
+RetryPolicy const RETRY_BULK = { NAK_LIMIT, 3, 0, 0 };
+RetryPolicy const RETRY_INTERRUPT = { 0, 0, 0, 0 };
+RetryPolicy const RETRY_CONTROL = { 64, 3, 1, 32 };
+
+/* The pipes (address and endpoint) the module's receive and send toggles belong to */
+#define NO_PIPE             0xFFFF
+#define PIPE(address, ep)   (((address) << 4) | ((ep) & 0x0F))
+
+static uint_fast16_t rcvPipe = NO_PIPE;
+static uint_fast16_t sndPipe = NO_PIPE;
+
+APP_TIMER_DEF(retryTimer);
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static void _transferDone(uint_fast8_t, void *);
+static void _selectPipe(uint_fast8_t, uint_fast8_t, uint_fast8_t);
+static void _saveToggle(uint_fast8_t);
+static bool _shouldRetry(uint_fast8_t);
+static void _retryIfDue(void);
+static void _retryTimeout(void *);
+static void _reissue(void);
+static void _reloadSendFifo(void);
+static uint_fast8_t _controlReadStage(ControlPacket *, uint_fast16_t, uint_fast8_t);
+static uint_fast8_t _controlWriteStage(ControlPacket *, uint_fast16_t, uint_fast8_t);
+
+void initTransfers(void) {
+	ret_code_t err_code = app_timer_create(&retryTimer,
+		APP_TIMER_MODE_SINGLE_SHOT,
+		_retryTimeout);
+	APP_ERROR_CHECK(err_code);
+}
+
+void setRetryPolicy(uint_fast8_t address, uint_fast8_t ep, RetryPolicy const * policy) {
+	USBDevice * device = USB_findDevice(address);
+
+	if (device)
+		device->retryPolicies[ep & 0x0F] = policy;
+}
+
+uint_fast8_t transmitPacket(uint_fast8_t address, uint_fast8_t token, uint_fast8_t ep) {
+	volatile uint_fast8_t regval = TRANSFER_PENDING;
+	uint_fast8_t waits = 0;
+	uint32_t finished;
+
+	/* Completions are normally delivered through the scheduler, which can't run while we
+	 * block here. Keep the INT edges out of its queue and service HXFRDN directly */
+	MAX_holdInterrupts();
+
+	/* Let a poll that is on the wire finish; a stream would keep the engine forever */
+	while (transmitPacketAsync(address, token, ep, _transferDone, (void *) &regval)) {
+		if (++waits > ENGINE_WAIT_LIMIT) {
+			MAX_releaseInterrupts();
+			return rslBUSY;
 		}
-		else {
-			break;
+		finished = transfersFinished;
+		while (currentTransfer.busy && transfersFinished == finished) {
+			if (nrf_gpio_pin_read(MAX_IRQ_PIN))
+				nrf_pwr_mgmt_run();
+			transferCompleteHandler();
 		}
 	}
-	//regval = MAX_readRegister(rHRSL) & 0x0F;
+
+	/* Sleep until the INT line drops (or the backoff timer ticks) */
+	while (regval == TRANSFER_PENDING) {
+		if (nrf_gpio_pin_read(MAX_IRQ_PIN))
+			nrf_pwr_mgmt_run();
+		transferCompleteHandler();
+	}
+	MAX_releaseInterrupts();
+
 	if(regval)
 	    NRF_LOG_INFO("Error or timeout: 0x%x.\n", regval);
 
 	return regval;
 }
 
+uint_fast8_t transmitPacketAsync(uint_fast8_t address,
+	uint_fast8_t token,
+	uint_fast8_t ep,
+	TransferCallback callback,
+	void * context) {
+	USBDevice const * device = USB_findDevice(address);
+	RetryPolicy const * policy = device ? device->retryPolicies[ep & 0x0F] : NULL;
+
+	if (currentTransfer.busy)
+		return rslBUSY;
+
+	if (!policy)
+		policy = (ep & 0x0F) ? &RETRY_BULK : &RETRY_CONTROL;
+
+	currentTransfer.busy = true;
+	currentTransfer.backingOff = false;
+	currentTransfer.address = address;
+	currentTransfer.token = token;
+	currentTransfer.ep = ep;
+	currentTransfer.naksLeft = policy->nakLimit;
+	currentTransfer.errorsLeft = policy->errorLimit;
+	currentTransfer.backoffMs = policy->backoffMs;
+	currentTransfer.maxBackoffMs = policy->maxBackoffMs;
+	currentTransfer.callback = callback;
+	currentTransfer.context = context;
+
+	/* Make sure the module tells us when it is done */
+	if (!(MAX_getEnabledInterrupts() & MAX_IRQ_HXFRDN))
+		MAX_enableInterrupts(MAX_IRQ_HXFRDN);
+
+	_selectPipe(address, token, ep);
+
+	if (token == xfrOUT) {
+		if (!sendFresh)
+			_reloadSendFifo();
+		sendFresh = false;
+	}
+
+	/* Instruct the module to send the data as the specified type */
+	TRACE(TRACE_XFER_ISSUE, token | ep);
+	MAX_writeRegister(rHXFR, token | ep);
+	return rslSUCCES;
+}
+
+void transferCompleteHandler(void) {
+	uint_fast8_t regval;
+	TransferCallback callback;
+	void * context;
+
+	/* No token is on the wire while backing off */
+	if (currentTransfer.backingOff) {
+		_retryIfDue();
+		return;
+	}
+
+	/* Latched flags may be stale by the time they are serviced, so check the live state */
+	if (!(MAX_readRegister(rHIRQ) & MAX_IRQ_HXFRDN))
+		return;
+
+	MAX_clearInterruptStatus(MAX_IRQ_HXFRDN);
+	if (!currentTransfer.busy)
+		return;
+
+	regval = MAX_readRegister(rHRSL);
+	if (_shouldRetry(regval & HRSL_RESULT))
+		return;
+
+	_saveToggle(regval);
+	regval &= HRSL_RESULT;
+	TRACE(TRACE_XFER_DONE, regval);
+
+	/* Free the engine before calling back, so the callback can issue the next token */
+	callback = currentTransfer.callback;
+	context = currentTransfer.context;
+	currentTransfer.busy = false;
+	transfersFinished++;
+	if (callback)
+		callback(regval, context);
+}
+
+void loadSendFifo(uint_fast8_t const * data, uint_fast8_t length) {
+	uint_fast8_t it;
+
+	sendLength = MIN(length, BUFFER_SIZE);
+	for (it = 0; it < sendLength; it++)
+		sendPacket[it] = data[it];
+
+	MAX_multiWriteRegister(rSNDFIFO, sendPacket, sendLength);
+
+	/* Writing the byte count hands the buffer to the SIE */
+	MAX_writeRegister(rSNDBC, sendLength);
+	sendFresh = true;
+}
+
 uint_fast8_t sendControl(ControlPacket * packet) {
-	uint_fast8_t rescode;
-	uint_fast8_t timeout;
+	USBDevice const * device = USB_findDevice(packet->perAddress);
+	uint_fast8_t rescode, maxPacketSize;
+	uint_fast16_t length;
+
+	packet->actualLength = 0;
 
-	/* Make sure the peripheral address is correct */
-	MAX_writeRegister(rPERADDR, packet->perAddress);
+	/* Every device supports at least 8 bytes on endpoint 0 */
+	maxPacketSize = (device && device->model.maxPacketSize0) ? device->model.maxPacketSize0 : 8;
+
+	/* Without a caller buffer the data stage has to fit in the ControlBuffer */
+	length = packet->data ? packet->wLength : MIN(packet->wLength, BUFFER_SIZE);
 
 	/* Load the contents from the given packet and send this as a Control packet */
 	TXData[0] = packet->bmRequestType;
@@ -63,101 +236,234 @@ uint_fast8_t sendControl(ControlPacket * packet) {
 	TXData[7] = (uint_fast8_t)(packet->wLength >> 8);
 
 	/* Write the data into the DUPFIFO */
-	MAX_multiWriteRegister(4, (uint_fast8_t *) TXData, 8);
+	MAX_multiWriteRegister(rSUDFIFO, (uint_fast8_t *) TXData, 8);
 	NRF_LOG_INFO("Sending bRequest: 0x%x. (addr %d)\n",
 		packet->bRequest,
 		packet->perAddress);
 
 	/* Start the transaction */
-	rescode = transmitPacket(0x10, 0);
-	if (rescode)
-		return rescode;
+	rescode = transmitPacket(packet->perAddress, xfrSETUP, 0);
 
-	/* Check whether we need a data stage (request only at the moment) and perform */
-	if (packet->wLength > 0 && packet->direction == DIR_IN) {
-		rescode = transmitPacket(xfrIN, 0);
-		if (rescode)
-			return rescode;
-		timeout = 0xFFFF;
-		while (!(MAX_readRegister(rHIRQ) & MAX_IRQ_RCVDAV) && timeout) {
-			timeout--;
-			nrf_delay_ms(100);
+	/* The data stage starts with DATA1 and alternates from there */
+	if (!rescode && length > 0) {
+		if (packet->direction == DIR_IN) {
+			MAX_writeRegister(rHCTL, HCTL_RCVTOG1);
+			rescode = _controlReadStage(packet, length, maxPacketSize);
 		}
-
-		if (timeout == 0) {
-			NRF_LOG_INFO("Timeout! HIRQ: 0x%x\n", MAX_readRegister(rHIRQ));
-		}
-
-		/* Check if we got data and read if available */
-		if (MAX_readRegister(rHIRQ) & MAX_IRQ_RCVDAV) {
-			uint8_t readlength = MAX_readRegister(rRCVBC);
-			MAX_multiReadRegister(rRCVFIFO,
-				(uint_fast8_t *) ControlBuffer,
-				readlength);
-			NRF_LOG_INFO("Got control data: %d bytes (0x%x 0x%x)\n",
-				readlength,
-				ControlBuffer[0],
-				ControlBuffer[1]);
-			MAX_writeRegister(rHIRQ, MAX_IRQ_RCVDAV);
+		else {
+			MAX_writeRegister(rHCTL, HCTL_SNDTOG1);
+			rescode = _controlWriteStage(packet, length, maxPacketSize);
 		}
 	}
 
 	/* Send an HS-IN or HS-OUT. */
-	if (packet->direction == DIR_OUT) {
-		rescode = transmitPacket(0x80, 0);
-	}
-	else {
-		rescode = transmitPacket(0xA0, 0);
+	if (!rescode) {
+		if (packet->direction == DIR_OUT || length == 0) {
+			rescode = transmitPacket(packet->perAddress, xfrINHS, 0);
+		}
+		else {
+			rescode = transmitPacket(packet->perAddress, xfrOUTHS, 0);
+		}
 	}
+
 	return rescode;
 }
 
 uint_fast8_t requestData(uint_fast8_t * rxbuffer, uint_fast8_t nbytes) {
-	uint_fast8_t it, timeout, readlength, result;
-
-	/* Send a BULK-IN request packet */
-	transmitPacket(xfrIN, 2);
-
-	/* Wait until we have a reply, or timeout */
-	timeout = 0xFF;
-	while ((!MAX_readRegister(rHIRQ) & MAX_IRQ_RCVDAV) && timeout) {
-		nrf_delay_ms(300);
-		timeout--;
-	}
+	uint_fast8_t readlength, result;
+	USBDevice const * device = USB_getRootDevice();
+	EndpointInfo const * endpoint = DESC_findEndpoint(USB_getDevice(), epBULK, true);
 
-	/* Quit if we got a timeout */
-	if (!timeout)
-		return 0xFF;
+	if (!device)
+		return rslBADREQ;
 
-	/* This delay is apparently necessary, as the RX FIFO isn't directly ready (first byte will randomly corrupt) */
-	nrf_delay_ms(500);
+	/* Send a BULK-IN request packet to the first bulk IN endpoint (EP2 if none was found).
+	 * Once the transfer is done the packet is in the RCVFIFO */
+	result = transmitPacket(device->address, xfrIN, endpoint ? endpoint->address & 0x0F : 2);
+	if (result)
+		return result;
 
 	/* Get the length of the received data (should be the same as nbytes) */
 	readlength = MAX_readRegister(rRCVBC);
 	if (readlength != nbytes) {
 		NRF_LOG_INFO("Error: expected %d bytes, but got %d!\n", nbytes, readlength);
+		MAX_writeRegister(rHIRQ, MAX_IRQ_RCVDAV);
 		return 0xF0;
 	}
-	//totalRcvd += readlength;
-
-	/* Check the transfer result code: if it's an error, then quit */
-	result = MAX_readRegister(rHRSL) & 0x0F;
-	if (result && result != rslBUSY) {
-		return result;
-	}
 
 	/* No error, so read the actual data */
 	MAX_multiReadRegister(rRCVFIFO, rxbuffer, readlength);
 
-	/* A simple test for now */
-	/* TODO remove! */
-	for (it = 0; it < 64; it++) {
-		if (rxbuffer[it] > 9)
-			NRF_LOG_INFO("Byte error: %d (%d)...\n", rxbuffer[it], it);
-	}
-
 	/* Clear the interrupt */
 	MAX_writeRegister(rHIRQ, MAX_IRQ_RCVDAV);
 
 	return 0;
-}
\ No newline at end of file
+}
+
+/* PRIVATE FUNCTIONS */
+
+static void _transferDone(uint_fast8_t result, void * context) {
+	*(volatile uint_fast8_t *) context = result;
+}
+
+/* Point the module at the device and load the toggle of the endpoint, if it changed */
+static void _selectPipe(uint_fast8_t address, uint_fast8_t token, uint_fast8_t ep) {
+	USBDevice const * device = USB_findDevice(address);
+	uint_fast16_t pipe = PIPE(address, ep);
+
+	MAX_updateRegister(rPERADDR, address);
+
+	/* Low-speed devices behind a hub are reached through a PRE preamble at full speed */
+	if (device) {
+		MAX_updateOptions(rMODE, MODE_LOWSPEED | MODE_HUBPRE,
+			device->speed != USB_SPEED_LOW ? 0 : device->parent ? MODE_LOWSPEED | MODE_HUBPRE : MODE_LOWSPEED);
+	}
+
+	if (!(ep & 0x0F)) {
+		/* Control transfers set their toggles per stage */
+		rcvPipe = NO_PIPE;
+		sndPipe = NO_PIPE;
+	}
+	else if (token == xfrIN && rcvPipe != pipe) {
+		MAX_writeRegister(rHCTL, USB_getToggle(address, ep, true) ? HCTL_RCVTOG1 : HCTL_RCVTOG0);
+		rcvPipe = pipe;
+	}
+	else if (token == xfrOUT && sndPipe != pipe) {
+		MAX_writeRegister(rHCTL, USB_getToggle(address, ep, false) ? HCTL_SNDTOG1 : HCTL_SNDTOG0);
+		sndPipe = pipe;
+	}
+}
+
+/* Keep the toggle the finished transfer left in rHRSL with its endpoint */
+static void _saveToggle(uint_fast8_t hrsl) {
+	if (!(currentTransfer.ep & 0x0F))
+		return;
+	if (currentTransfer.token == xfrIN)
+		USB_setToggle(currentTransfer.address, currentTransfer.ep, true, hrsl & HRSL_RCVTOGRD);
+	else if (currentTransfer.token == xfrOUT)
+		USB_setToggle(currentTransfer.address, currentTransfer.ep, false, hrsl & HRSL_SNDTOGRD);
+}
+
+/* Apply the retry policy to a finished token. Returns true if it was (or will be) re-issued */
+static bool _shouldRetry(uint_fast8_t result) {
+	switch (result) {
+	case rslNAK:
+		if (!currentTransfer.naksLeft)
+			return false;
+		currentTransfer.naksLeft--;
+
+		if (currentTransfer.backoffMs) {
+			/* Give a busy device some time, twice as much after every NAK */
+			currentTransfer.backingOff = true;
+			currentTransfer.retryAt = app_timer_cnt_get() + APP_TIMER_TICKS(currentTransfer.backoffMs);
+			app_timer_start(retryTimer, APP_TIMER_TICKS(currentTransfer.backoffMs), NULL);
+			currentTransfer.backoffMs = MIN(currentTransfer.backoffMs * 2, currentTransfer.maxBackoffMs);
+			return true;
+		}
+		break;
+	case rslTIMEOUT:
+	case rslCRCERR:
+	case rslTOGERR:
+	case rslPKTERR:
+	case rslPIDERR:
+		/* Errors on the wire: the usual three strikes */
+		if (!currentTransfer.errorsLeft)
+			return false;
+		currentTransfer.errorsLeft--;
+		break;
+	default:
+		return false;
+	}
+
+	/* Re-issue straight away; the module times the retry to the next frame slot */
+	_reissue();
+	return true;
+}
+
+static void _retryIfDue(void) {
+	uint32_t now = app_timer_cnt_get();
+	uint32_t remaining = app_timer_cnt_diff_compute(currentTransfer.retryAt, now);
+
+	/* The counter is 24 bits: a 'remaining' beyond the longest backoff means retryAt has passed */
+	if (remaining && remaining <= APP_TIMER_TICKS(0xFF)) {
+		/* Early (a stale timer event): wait for the rest */
+		app_timer_start(retryTimer, MAX(remaining, APP_TIMER_MIN_TIMEOUT_TICKS), NULL);
+		return;
+	}
+
+	currentTransfer.backingOff = false;
+	_reissue();
+}
+
+static void _retryTimeout(void * context) {
+	UNUSED_PARAMETER(context);
+	if (currentTransfer.busy && currentTransfer.backingOff)
+		_retryIfDue();
+}
+
+static void _reissue(void) {
+	if (currentTransfer.token == xfrOUT)
+		_reloadSendFifo();
+	MAX_writeRegister(rHXFR, currentTransfer.token | currentTransfer.ep);
+}
+
+/* The host OUT NAK workaround: clear the byte count, write the packet and commit it again */
+static void _reloadSendFifo(void) {
+	MAX_writeRegister(rSNDBC, 0);
+	MAX_multiWriteRegister(rSNDFIFO, sendPacket, sendLength);
+	MAX_writeRegister(rSNDBC, sendLength);
+}
+
+/* Read IN packets until 'length' bytes or a short packet arrived */
+static uint_fast8_t _controlReadStage(ControlPacket * packet, uint_fast16_t length, uint_fast8_t maxPacketSize) {
+	uint_fast8_t rescode, readlength, chunk, it;
+	uint_fast16_t received = 0;
+
+	while (received < length) {
+		rescode = transmitPacket(packet->perAddress, xfrIN, 0);
+		if (rescode)
+			return rescode;
+
+		/* The transfer succeeded, so the packet is in the RCVFIFO */
+		readlength = MIN(MAX_readRegister(rRCVBC), BUFFER_SIZE);
+		chunk = MIN(readlength, length - received);
+		MAX_multiReadRegister(rRCVFIFO,
+			(uint_fast8_t *) ControlBuffer,
+			chunk);
+		MAX_writeRegister(rHIRQ, MAX_IRQ_RCVDAV);
+
+		if (packet->data) {
+			for (it = 0; it < chunk; it++)
+				packet->data[received + it] = (uint8_t) ControlBuffer[it];
+		}
+		received += chunk;
+		packet->actualLength = received;
+
+		/* A short packet ends the data stage */
+		if (readlength < maxPacketSize)
+			break;
+	}
+	NRF_LOG_INFO("Got control data: %d bytes\n", received);
+	return rslSUCCES;
+}
+
+/* Send 'length' bytes as OUT packets of at most bMaxPacketSize0 */
+static uint_fast8_t _controlWriteStage(ControlPacket * packet, uint_fast16_t length, uint_fast8_t maxPacketSize) {
+	uint_fast8_t rescode, chunk, it;
+	uint_fast16_t sent = 0;
+
+	while (sent < length) {
+		chunk = MIN(length - sent, maxPacketSize);
+		for (it = 0; it < chunk; it++)
+			TXData[it] = packet->data ? packet->data[sent + it] : ControlBuffer[sent + it];
+
+		loadSendFifo((uint_fast8_t const *) TXData, chunk);
+		rescode = transmitPacket(packet->perAddress, xfrOUT, 0);
+		if (rescode)
+			return rescode;
+
+		sent += chunk;
+		packet->actualLength = sent;
+	}
+	return rslSUCCES;
+}
@@ -9,10 +9,108 @@
 
 #include "max3421e.h"
 
-uint_fast8_t transmitPacket(uint_fast8_t, uint_fast8_t);
+/* Maximum number of times a NAK'd bulk token is re-issued before the transfer gives up */
+#define NAK_LIMIT           0xFFFF
+
+/* Status of a transfer that has not completed yet (never returned by the module) */
+#define TRANSFER_PENDING    0xFF
+
+/* Number of other transfers transmitPacket lets finish before it gives up on the engine */
+#define ENGINE_WAIT_LIMIT   16
+
+/* Called when a host transfer finishes, with the rHRSL result code */
+typedef void(*TransferCallback)(uint_fast8_t, void *);
+
+/* What the transfer engine does when a token is NAK'd or fails on the wire. The MAX3421E
+ * has no NAK limit of its own, every retry is a new write to rHXFR */
+typedef struct RetryPolicy {
+	uint_fast16_t nakLimit;     /* re-issues after a NAK, 0 to report the first NAK */
+	uint_fast8_t errorLimit;    /* re-issues after a timeout, CRC, PID or toggle error */
+	uint_fast8_t backoffMs;     /* wait before the first NAK retry, 0 to retry at once */
+	uint_fast8_t maxBackoffMs;  /* the wait doubles after every NAK up to this */
+} RetryPolicy;
+
+/* Bulk: re-issue NAK'd tokens straight away (the default for endpoints other than 0) */
+extern RetryPolicy const RETRY_BULK;
+
+/* Interrupt: a NAK means there's no new report this interval, give up at once */
+extern RetryPolicy const RETRY_INTERRUPT;
+
+/* Control: back off exponentially so a busy device can't lock up the firmware (endpoint 0) */
+extern RetryPolicy const RETRY_CONTROL;
+
+/**
+ * Set up the transfer engine. Call once after app_timer_init
+ */
+void initTransfers(void);
+
+/**
+ * Set the retry policy used for an endpoint of a device. Policies are kept in the device
+ * table, so they are dropped with the device
+ *
+ * Parameters:
+ * uint_fast8_t address: the device address
+ * uint_fast8_t ep: the endpoint number
+ * RetryPolicy const * policy: the policy (must stay valid), NULL for the default
+ */
+void setRetryPolicy(uint_fast8_t, uint_fast8_t, RetryPolicy const *);
+
+/**
+ * Issue a token and wait for the transfer to finish, retrying per the endpoint's policy.
+ * If another transfer (e.g. a periodic poll) is on the wire, it is completed first.
+ * While waiting the MCU sleeps until the INT line signals HXFRDN. Must be called from
+ * thread mode
+ *
+ * Parameters:
+ * uint_fast8_t address: the device address
+ * uint_fast8_t token: the transfer token (xfrSETUP, xfrIN, ...)
+ * uint_fast8_t ep: the endpoint number
+ *
+ * Returns:
+ * uint_fast8_t: the rHRSL result code
+ */
+uint_fast8_t transmitPacket(uint_fast8_t, uint_fast8_t, uint_fast8_t);
+
+/**
+ * Issue a token and return immediately. NAKs and errors are retried as the endpoint's
+ * RetryPolicy says before the callback is called. rPERADDR is only written when the
+ * address changes, and the toggle of a bulk or interrupt endpoint is loaded from (and
+ * saved to) the device table when the module last served another endpoint
+ *
+ * Parameters:
+ * uint_fast8_t address: the device address
+ * uint_fast8_t token: the transfer token (xfrSETUP, xfrIN, ...)
+ * uint_fast8_t ep: the endpoint number
+ * TransferCallback callback: called with the result code once the transfer is done
+ * void * context: passed to the callback
+ *
+ * Returns:
+ * uint_fast8_t: rslSUCCES if the token was issued, rslBUSY if a transfer is in progress
+ */
+uint_fast8_t transmitPacketAsync(uint_fast8_t, uint_fast8_t, uint_fast8_t, TransferCallback, void *);
+
+/**
+ * Handle a HXFRDN interrupt: retry on NAK or finish the transfer in progress.
+ * Does nothing if the module does not currently report HXFRDN and no backoff expired
+ */
+void transferCompleteHandler(void);
+
+/**
+ * Load an OUT packet into the SNDFIFO and commit it for the next xfrOUT token. A copy is
+ * kept: the module drops the packet when the device does not ACK it, so every retry and
+ * every later OUT token without a new load writes it again
+ *
+ * Parameters:
+ * uint_fast8_t const * data: the packet
+ * uint_fast8_t length: its length, at most BUFFER_SIZE
+ */
+void loadSendFifo(uint_fast8_t const *, uint_fast8_t);
 
 /**
- * Send the given Setup Packet
+ * Perform a complete control transfer: SETUP, an optional IN or OUT data stage split
+ * into bMaxPacketSize0 packets, and the status stage. IN data stages end after wLength
+ * bytes or a short packet; the number of bytes moved is stored in packet->actualLength.
+ * The packet size is the bMaxPacketSize0 in the device table, 8 for unknown devices
  *
  *
  * \param packet: a reference to the packet to transmit
@@ -21,7 +119,8 @@ uint_fast8_t transmitPacket(uint_fast8_t, uint_fast8_t);
 uint_fast8_t sendControl(ControlPacket *);
 
 /**
- * Request data and checks whether it is the correct amount
+ * Request a single packet from the bulk IN endpoint and check whether it is the correct
+ * amount. Use BULK_startStream for sustained transfers
  *
  * Parameters:
  * uint_fast8_t * rxbuffer: a buffer to hold the data
@@ -0,0 +1,198 @@
+/*
+ * poller.c
+ *
+ * Periodic polling of interrupt IN endpoints, scheduled on the MAX3421E FRAME interrupt
+ */
+
+#include "poller.h"
+#include "max3421e.h"
+#include "nrf_log.h"
+
+typedef struct {
+	PollCallback callback;
+	void * context;
+	uint_fast8_t address;
+	uint_fast8_t ep;
+	uint_fast8_t interval;      /* in frames */
+	uint_fast8_t countdown;     /* frames until the next poll, 0 when due */
+	uint_fast16_t cost;         /* bus time of one poll (us) */
+	bool active;
+} PolledEndpoint;
+
+static PolledEndpoint endpoints[POLL_MAX_ENDPOINTS];
+static PollStats stats;
+
+/* The slot whose token is on the wire, POLL_MAX_ENDPOINTS if none */
+static uint_fast8_t inFlight = POLL_MAX_ENDPOINTS;
+
+/* Bus time left in the current frame (us) */
+static uint_fast16_t budgetLeft = POLL_FRAME_BUDGET_US;
+
+static uint_fast8_t reportBuffer[BUFFER_SIZE];
+static uint8_t report[BUFFER_SIZE];
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static uint_fast16_t _pollCost(uint_fast8_t, uint_fast16_t);
+static void _issueNext(void);
+static void _pollDone(uint_fast8_t, void *);
+
+/* PUBLIC FUNCTIONS */
+
+uint_fast8_t POLL_addEndpoint(uint_fast8_t address,
+	EndpointInfo const * endpoint,
+	PollCallback callback,
+	void * context) {
+	uint_fast8_t slot = POLL_nextSlot();
+
+	if (slot == POLL_MAX_ENDPOINTS)
+		return slot;
+
+	endpoints[slot].callback = callback;
+	endpoints[slot].context = context;
+	endpoints[slot].address = address;
+	endpoints[slot].ep = endpoint->address & 0x0F;
+	endpoints[slot].interval = endpoint->interval ? endpoint->interval : 1;
+	endpoints[slot].countdown = 0;
+	endpoints[slot].cost = _pollCost(address, endpoint->maxPacketSize);
+	endpoints[slot].active = true;
+
+	/* No NAK retries: a NAK just means there's no new report this interval */
+	setRetryPolicy(address, endpoints[slot].ep, &RETRY_INTERRUPT);
+
+	/* FRAME fires on every SOF, only listen while there is something to poll */
+	if (!(MAX_getEnabledInterrupts() & MAX_IRQ_FRAME)) {
+		MAX_clearInterruptStatus(MAX_IRQ_FRAME);
+		MAX_enableInterrupts(MAX_IRQ_FRAME);
+	}
+	return slot;
+}
+
+uint_fast8_t POLL_nextSlot(void) {
+	uint_fast8_t slot;
+
+	for (slot = 0; slot < POLL_MAX_ENDPOINTS; slot++) {
+		if (!endpoints[slot].active)
+			break;
+	}
+	return slot;
+}
+
+void POLL_stop(void) {
+	uint_fast8_t slot;
+
+	MAX_disableInterrupts(MAX_IRQ_FRAME);
+	for (slot = 0; slot < POLL_MAX_ENDPOINTS; slot++)
+		endpoints[slot].active = false;
+	inFlight = POLL_MAX_ENDPOINTS;
+}
+
+void POLL_removeDevice(uint_fast8_t address) {
+	uint_fast8_t slot;
+
+	/* A token in flight completes normally, its report is dropped as the slot is inactive */
+	for (slot = 0; slot < POLL_MAX_ENDPOINTS; slot++) {
+		if (endpoints[slot].address == address)
+			endpoints[slot].active = false;
+	}
+}
+
+void POLL_frameHandler(void) {
+	uint_fast8_t slot;
+
+	MAX_clearInterruptStatus(MAX_IRQ_FRAME);
+	budgetLeft = POLL_FRAME_BUDGET_US;
+
+	for (slot = 0; slot < POLL_MAX_ENDPOINTS; slot++) {
+		if (!endpoints[slot].active)
+			continue;
+		if (endpoints[slot].countdown)
+			endpoints[slot].countdown--;
+		else if (slot != inFlight)
+			stats.deferred++;
+	}
+	_issueNext();
+}
+
+void POLL_getStats(PollStats * result) {
+	*result = stats;
+}
+
+/* PRIVATE FUNCTIONS */
+
+/* Worst-case bus time of an interrupt IN transaction, after USB 2.0 5.11.3: bit-stuffed data
+ * plus fixed protocol overhead. A low-speed packet takes eight times as long, and behind a
+ * hub it is also preceded by a full-speed PRE */
+static uint_fast16_t _pollCost(uint_fast8_t address, uint_fast16_t maxPacketSize) {
+	USBDevice const * device = USB_findDevice(address);
+
+	if (device && device->speed == USB_SPEED_LOW)
+		return 65 + (maxPacketSize * 56) / 9;
+	return 10 + (maxPacketSize * 7) / 9;
+}
+
+/* Start the first endpoint that is due and fits in the frame, the others follow from its
+ * completion */
+static void _issueNext(void) {
+	uint_fast8_t slot;
+	PolledEndpoint * endpoint;
+
+	if (inFlight != POLL_MAX_ENDPOINTS)
+		return;
+
+	for (slot = 0; slot < POLL_MAX_ENDPOINTS; slot++) {
+		endpoint = &endpoints[slot];
+		if (!endpoint->active || endpoint->countdown)
+			continue;
+
+		/* Leave it due for the next frame rather than run into the EOF interval */
+		if (endpoint->cost > budgetLeft)
+			continue;
+
+		if (transmitPacketAsync(endpoint->address, xfrIN, endpoint->ep, _pollDone, (void *) (uintptr_t) slot))
+			return;
+
+		inFlight = slot;
+		budgetLeft -= endpoint->cost;
+		endpoint->countdown = endpoint->interval;
+		stats.polls++;
+		return;
+	}
+}
+
+static void _pollDone(uint_fast8_t result, void * context) {
+	uint_fast8_t slot = (uint_fast8_t) (uintptr_t) context;
+	PolledEndpoint * endpoint = &endpoints[slot];
+	uint_fast8_t it, length;
+
+	inFlight = POLL_MAX_ENDPOINTS;
+
+	switch (result) {
+	case rslSUCCES:
+		length = MIN(MAX_readRegister(rRCVBC), BUFFER_SIZE);
+		MAX_multiReadRegister(rRCVFIFO, reportBuffer, length);
+		MAX_writeRegister(rHIRQ, MAX_IRQ_RCVDAV);
+		stats.reports++;
+
+		if (endpoint->active && endpoint->callback) {
+			for (it = 0; it < length; it++)
+				report[it] = (uint8_t) reportBuffer[it];
+			endpoint->callback(report, length, endpoint->context);
+		}
+		break;
+	case rslNAK:
+		stats.naks++;
+		break;
+	case rslSTALL:
+		NRF_LOG_INFO("Interrupt endpoint %d of device %d stalled\n", endpoint->ep, endpoint->address);
+		endpoint->active = false;
+		stats.errors++;
+		break;
+	default:
+		stats.errors++;
+		break;
+	}
+
+	/* Endpoints that became due in the same frame */
+	_issueNext();
+}
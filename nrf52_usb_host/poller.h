@@ -0,0 +1,80 @@
+#pragma once
+/*
+ * poller.h
+ *
+ * Periodic polling of interrupt IN endpoints, scheduled on the MAX3421E FRAME interrupt
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "descriptors.h"
+
+/* Number of interrupt endpoints that can be polled at the same time */
+#define POLL_MAX_ENDPOINTS  4
+
+/* Bus time (us) the polls may take per 1 ms frame; USB 2.0 5.7.4 reserves 90% for
+ * periodic transfers */
+#define POLL_FRAME_BUDGET_US    900
+
+/* Called with the data of every report an endpoint delivered */
+typedef void(*PollCallback)(uint8_t const *, uint_fast8_t, void *);
+
+typedef struct {
+	uint32_t polls;             /* IN tokens issued */
+	uint32_t reports;           /* polls that returned data */
+	uint32_t naks;              /* polls the device had nothing for */
+	uint32_t deferred;          /* polls pushed to the next frame: engine busy or frame full */
+	uint32_t errors;
+} PollStats;
+
+/**
+ * Poll an interrupt IN endpoint every bInterval frames. Endpoints of several devices can
+ * be polled next to each other. Must be called from thread mode
+ *
+ * Parameters:
+ * uint_fast8_t address: the device address
+ * EndpointInfo const * endpoint: the endpoint from the device model
+ * PollCallback callback: called with every report
+ * void * context: passed to the callback
+ *
+ * Returns:
+ * uint_fast8_t: the poller slot, or POLL_MAX_ENDPOINTS if the table is full
+ */
+uint_fast8_t POLL_addEndpoint(uint_fast8_t, EndpointInfo const *, PollCallback, void *);
+
+/**
+ * The slot the next POLL_addEndpoint takes. A slot is free again once its device is
+ * removed or the poller stopped, so per-endpoint state of the caller can be kept by slot
+ *
+ * Returns:
+ * uint_fast8_t: the poller slot, or POLL_MAX_ENDPOINTS if the table is full
+ */
+uint_fast8_t POLL_nextSlot(void);
+
+/**
+ * Stop polling the endpoints of one device, when it is removed from a hub
+ *
+ * Parameters:
+ * uint_fast8_t address: the device address
+ */
+void POLL_removeDevice(uint_fast8_t);
+
+/**
+ * Stop polling all endpoints and disable the FRAME interrupt. Called when the device is
+ * detached
+ */
+void POLL_stop(void);
+
+/**
+ * Handle a FRAME interrupt: issue the IN token of the endpoint whose interval elapsed
+ */
+void POLL_frameHandler(void);
+
+/**
+ * Get the poll counters
+ *
+ * Parameters:
+ * PollStats * result: filled in with a copy of the counters
+ */
+void POLL_getStats(PollStats *);
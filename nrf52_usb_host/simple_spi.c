@@ -10,31 +10,46 @@
 NRF_SPI_MNGR_DEF(m_nrf_spi_mngr, ST7565_QUEUE_LENGTH, ST7565_SPI_INSTANCE_ID);
 extern nrf_drv_spi_t spi;
 
+/* EasyDMA needs contiguous byte buffers, so bursts are staged here */
+static uint8_t burstTX[SIMSPI_BURST_LENGTH];
+static uint8_t burstRX[SIMSPI_BURST_LENGTH];
+
+static SPIStats stats;
+
+/* Ring of in-flight requests; they complete in the order they were scheduled */
+static SPIRequest requests[SIMSPI_REQUEST_SLOTS];
+static volatile uint_fast8_t requestHead;
+static volatile uint_fast8_t requestCount;
+
+/* Slots the transport refused; they are released once every slot before them is done */
+static volatile bool requestFailed[SIMSPI_REQUEST_SLOTS];
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static void _perform(uint8_t *, uint8_t *, uint8_t);
+static void _releaseFailed(void);
+
+static void _nrfStart(void);
+static ret_code_t _nrfPerform(uint8_t *, uint8_t *, uint8_t);
+static ret_code_t _nrfSchedule(SPIRequest *, uint_fast8_t);
+
+static const SPITransport nrfTransport = {
+	.start = _nrfStart,
+	.perform = _nrfPerform,
+	.schedule = _nrfSchedule
+};
+
+static SPITransport const * transport = &nrfTransport;
+
 void SIMSPI_startSPI(void) {
-	nrf_drv_spi_config_t const m_master0_config =
-	{
-		.sck_pin = SPI_SCK_PIN,
-		.mosi_pin = SPI_MOSI_PIN,
-		.miso_pin = SPI_MISO_PIN,
-		.ss_pin = SPI_SS_PIN,
-		.irq_priority = APP_IRQ_PRIORITY_LOWEST,
-		.orc = 0x00,
-		.frequency = SPI_FREQUENCY_FREQUENCY_M4,
-		.mode = NRF_DRV_SPI_MODE_0,
-		.bit_order = NRF_DRV_SPI_BIT_ORDER_MSB_FIRST
-	};
-	nrf_spi_mngr_init(&m_nrf_spi_mngr, &m_master0_config);
+	transport->start();
 }
 
 uint_fast8_t SIMSPI_transmitByte(uint_fast8_t byte1, uint_fast8_t byte2) {
-	uint_fast8_t rx[2];
+	uint8_t rx[2];
 	uint8_t tx[] = { (uint8_t)byte1, (uint8_t)byte2 };
 	// MAX_CS_PORT->BSRR = (uint32_t)MAX_CS_PIN << 16;
-	nrf_spi_mngr_transfer_t const transfers[] =
-	{
-		NRF_SPI_MNGR_TRANSFER(tx, 2, rx, 2),		
-	};
-	nrf_spi_mngr_perform(&m_nrf_spi_mngr, NULL, transfers, ARRAY_SIZE(transfers), NULL);
+	_perform(tx, rx, 2);
 
 	return rx[1];
 }
@@ -69,4 +84,199 @@ uint_fast8_t SIMSPI_readBytes(uint_fast8_t * rxbuffer, uint_fast8_t length) {
 		rxbuffer[it] = SIMSPI_transmitByte(0,0);
 	}
 	return 0;
-}
\ No newline at end of file
+}
+
+uint_fast8_t SIMSPI_transferBurst(uint_fast8_t command,
+	uint_fast8_t * txbuffer,
+	uint_fast8_t * rxbuffer,
+	uint_fast8_t length) {
+	uint_fast8_t it;
+
+	/* Longer payloads go out as several bursts, each with the command byte. The FIFOs
+	 * are a single register address, so the next burst carries on where the last ended */
+	while (length > SIMSPI_MAX_PAYLOAD) {
+		SIMSPI_transferBurst(command, txbuffer, rxbuffer, SIMSPI_MAX_PAYLOAD);
+		if (txbuffer)
+			txbuffer += SIMSPI_MAX_PAYLOAD;
+		if (rxbuffer)
+			rxbuffer += SIMSPI_MAX_PAYLOAD;
+		length -= SIMSPI_MAX_PAYLOAD;
+	}
+
+	/* Stage the command byte and the payload back to back */
+	burstTX[0] = (uint8_t) command;
+	for (it = 0; it < length; it++)
+		burstTX[it + 1] = txbuffer ? (uint8_t) txbuffer[it] : 0;
+
+	/* Keep chip-select asserted for the whole command + payload */
+	_perform(burstTX, burstRX, length + 1);
+
+	if (rxbuffer) {
+		for (it = 0; it < length; it++)
+			rxbuffer[it] = burstRX[it + 1];
+	}
+	return burstRX[length];
+}
+
+void SIMSPI_getStats(SPIStats * result) {
+	*result = stats;
+}
+
+void SIMSPI_resetStats(void) {
+	stats.transactions = 0;
+	stats.bytes = 0;
+}
+
+ret_code_t SIMSPI_schedule(uint_fast8_t command,
+	uint_fast8_t * txbuffer,
+	uint_fast8_t * rxbuffer,
+	uint_fast8_t length,
+	SPICallback callback,
+	void * context) {
+	SPIRequest * request;
+	uint_fast8_t it, slot;
+	ret_code_t result;
+
+	if (length > SIMSPI_MAX_PAYLOAD)
+		return NRF_ERROR_INVALID_LENGTH;
+
+	/* Claim the next slot; completions may run from the SPI interrupt */
+	CRITICAL_REGION_ENTER();
+	if (requestCount < SIMSPI_REQUEST_SLOTS) {
+		slot = requestHead;
+		requestHead = (requestHead + 1) % SIMSPI_REQUEST_SLOTS;
+		requestCount++;
+	}
+	else {
+		slot = SIMSPI_REQUEST_SLOTS;
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (slot == SIMSPI_REQUEST_SLOTS)
+		return NRF_ERROR_NO_MEM;
+
+	request = &requests[slot];
+	request->tx[0] = (uint8_t) command;
+	for (it = 0; it < length; it++)
+		request->tx[it + 1] = txbuffer ? (uint8_t) txbuffer[it] : 0;
+	request->length = length + 1;
+	request->rxbuffer = rxbuffer;
+	request->callback = callback;
+	request->context = context;
+
+	result = transport->schedule(request, slot);
+	if (result != NRF_SUCCESS) {
+		/* Requests may have been queued behind this slot meanwhile, so it can't simply be
+		 * given back; it is released in order, without a callback, as the caller gets the
+		 * error here */
+		CRITICAL_REGION_ENTER();
+		requestFailed[slot] = true;
+		_releaseFailed();
+		CRITICAL_REGION_EXIT();
+	}
+	return result;
+}
+
+void SIMSPI_complete(SPIRequest * request, ret_code_t result) {
+	uint_fast8_t it;
+	SPICallback callback = request->callback;
+	void * context = request->context;
+
+	if (result == NRF_SUCCESS && request->rxbuffer) {
+		for (it = 1; it < request->length; it++)
+			request->rxbuffer[it - 1] = request->rx[it];
+	}
+	stats.transactions++;
+	stats.bytes += request->length;
+
+	/* Release the slot first so the callback can schedule the next transfer */
+	CRITICAL_REGION_ENTER();
+	requestCount--;
+	_releaseFailed();
+	CRITICAL_REGION_EXIT();
+
+	if (callback)
+		callback(result, context);
+}
+
+bool SIMSPI_isIdle(void) {
+	return requestCount == 0;
+}
+
+void SIMSPI_setTransport(SPITransport const * newTransport) {
+	transport = newTransport ? newTransport : &nrfTransport;
+}
+
+/* PRIVATE FUNCTIONS */
+
+static void _perform(uint8_t * tx, uint8_t * rx, uint8_t length) {
+	transport->perform(tx, rx, length);
+
+	stats.transactions++;
+	stats.bytes += length;
+}
+
+/* Release the failed slots at the old end of the ring. Call from a critical region */
+static void _releaseFailed(void) {
+	uint_fast8_t oldest;
+
+	while (requestCount) {
+		oldest = (requestHead + SIMSPI_REQUEST_SLOTS - requestCount) % SIMSPI_REQUEST_SLOTS;
+		if (!requestFailed[oldest])
+			break;
+		requestFailed[oldest] = false;
+		requestCount--;
+	}
+}
+
+/* NRF_SPI_MNGR TRANSPORT */
+
+static nrf_spi_mngr_transfer_t nrfTransfers[SIMSPI_REQUEST_SLOTS];
+static nrf_spi_mngr_transaction_t nrfTransactions[SIMSPI_REQUEST_SLOTS];
+
+static void _nrfStart(void) {
+	nrf_drv_spi_config_t const m_master0_config =
+	{
+		.sck_pin = SPI_SCK_PIN,
+		.mosi_pin = SPI_MOSI_PIN,
+		.miso_pin = SPI_MISO_PIN,
+		.ss_pin = SPI_SS_PIN,
+		.irq_priority = APP_IRQ_PRIORITY_LOWEST,
+		.orc = 0x00,
+		.frequency = SPI_FREQUENCY_FREQUENCY_M4,
+		.mode = NRF_DRV_SPI_MODE_0,
+		.bit_order = NRF_DRV_SPI_BIT_ORDER_MSB_FIRST
+	};
+	nrf_spi_mngr_init(&m_nrf_spi_mngr, &m_master0_config);
+}
+
+static ret_code_t _nrfPerform(uint8_t * tx, uint8_t * rx, uint8_t length) {
+	nrf_spi_mngr_transfer_t const transfers[] =
+	{
+		NRF_SPI_MNGR_TRANSFER(tx, length, rx, length),
+	};
+	return nrf_spi_mngr_perform(&m_nrf_spi_mngr, NULL, transfers, ARRAY_SIZE(transfers), NULL);
+}
+
+static void _nrfScheduleDone(ret_code_t result, void * p_user_data) {
+	SIMSPI_complete((SPIRequest *) p_user_data, result);
+}
+
+static ret_code_t _nrfSchedule(SPIRequest * request, uint_fast8_t slot) {
+	nrf_spi_mngr_transfer_t * transfer = &nrfTransfers[slot];
+	nrf_spi_mngr_transaction_t * transaction = &nrfTransactions[slot];
+
+	transfer->p_tx_data = request->tx;
+	transfer->tx_length = request->length;
+	transfer->p_rx_data = request->rx;
+	transfer->rx_length = request->length;
+
+	transaction->begin_callback = NULL;
+	transaction->end_callback = _nrfScheduleDone;
+	transaction->p_user_data = request;
+	transaction->p_transfers = transfer;
+	transaction->number_of_transfers = 1;
+	transaction->p_required_spi_cfg = NULL;
+
+	return nrf_spi_mngr_schedule(&m_nrf_spi_mngr, transaction);
+}
@@ -9,8 +9,10 @@
 /*** Defines ***/
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "nrf_spi_mngr.h"
 #include "nordic_common.h"
+#include "app_util_platform.h"
 
 
 #define SPI_SCK_PIN 3
@@ -21,6 +23,9 @@
 #define ST7565_QUEUE_LENGTH     15
 #define ST7565_SPI_INSTANCE_ID  0
 #define SPI_TIMEOUT         2400000
+#define SIMSPI_MAX_PAYLOAD  64
+#define SIMSPI_BURST_LENGTH (SIMSPI_MAX_PAYLOAD + 1)
+#define SIMSPI_REQUEST_SLOTS 8
 
 /*** MACROs ***/
 
@@ -28,6 +33,35 @@
                                         while(__it__ < SPI_TIMEOUT && STATEMENT) { __it__++; }
 
 
+/*** TYPES ***/
+
+/* Running SPI traffic counters, used to measure how many bytes each chip-select cycle moves */
+typedef struct {
+	uint32_t transactions;
+	uint32_t bytes;
+} SPIStats;
+
+/* Called once a scheduled transfer has finished; runs in the SPI interrupt context */
+typedef void(*SPICallback)(ret_code_t, void *);
+
+/* A queued command + payload transfer. The buffers stay valid until the transfer completes */
+typedef struct {
+	uint8_t tx[SIMSPI_BURST_LENGTH];
+	uint8_t rx[SIMSPI_BURST_LENGTH];
+	uint8_t length;
+	uint_fast8_t * rxbuffer;
+	SPICallback callback;
+	void * context;
+} SPIRequest;
+
+/* The bus underneath the driver. The default one wraps nrf_spi_mngr; a mock or a simulator
+ * can be installed with SIMSPI_setTransport to run the driver without hardware */
+typedef struct {
+	void(*start)(void);
+	ret_code_t(*perform)(uint8_t *, uint8_t *, uint8_t);
+	ret_code_t(*schedule)(SPIRequest *, uint_fast8_t);
+} SPITransport;
+
 /*** PROTOTYPES ***/
 
 /**
@@ -72,3 +106,74 @@ uint_fast8_t SIMSPI_transmitBytes(uint_fast8_t *, uint_fast8_t);
 uint_fast8_t SIMSPI_transmitBytesReadAll(uint_fast8_t *, uint_fast8_t *, uint_fast8_t);
 
 uint_fast8_t SIMSPI_readBytes(uint_fast8_t *, uint_fast8_t);
+
+/**
+ * Transmit a command byte followed by a payload in a single chip-select-held transfer
+ *
+ * Parameters:
+ * uint_fast8_t command: the command byte sent before the payload
+ * uint_fast8_t * txbuffer: the payload to send, or NULL to clock out zeros
+ * uint_fast8_t * rxbuffer: a buffer for the bytes received during the payload, or NULL
+ * uint_fast8_t length: the payload length; longer than SIMSPI_MAX_PAYLOAD is sent as
+ *                      several bursts, each with the command byte
+ *
+ * Returns:
+ * uint_fast8_t: the byte received while the last byte was transmitted
+ */
+uint_fast8_t SIMSPI_transferBurst(uint_fast8_t, uint_fast8_t *, uint_fast8_t *, uint_fast8_t);
+
+/**
+ * Copy the SPI traffic counters
+ *
+ * Parameters:
+ * SPIStats * stats: the structure to store the counters in
+ */
+void SIMSPI_getStats(SPIStats *);
+
+/**
+ * Reset the SPI traffic counters
+ */
+void SIMSPI_resetStats(void);
+
+/**
+ * Queue a command byte and payload for transmission without waiting for it
+ *
+ * Parameters:
+ * uint_fast8_t command: the command byte sent before the payload
+ * uint_fast8_t * txbuffer: the payload to send (copied), or NULL to clock out zeros
+ * uint_fast8_t * rxbuffer: a buffer for the received payload, filled before the callback runs
+ * uint_fast8_t length: the payload length (at most SIMSPI_MAX_PAYLOAD)
+ * SPICallback callback: called on completion, may be NULL
+ * void * context: passed to the callback
+ *
+ * Returns:
+ * ret_code_t: NRF_SUCCESS, NRF_ERROR_NO_MEM if all request slots are in use,
+ *             NRF_ERROR_INVALID_LENGTH if the payload is too long, or the transport's
+ *             error; the callback is only called on NRF_SUCCESS
+ */
+ret_code_t SIMSPI_schedule(uint_fast8_t, uint_fast8_t *, uint_fast8_t *, uint_fast8_t, SPICallback, void *);
+
+/**
+ * Finish a scheduled request. Called by the transport when the transfer is done
+ *
+ * Parameters:
+ * SPIRequest * request: the request that finished
+ * ret_code_t result: the transfer result
+ */
+void SIMSPI_complete(SPIRequest *, ret_code_t);
+
+/**
+ * Check whether any scheduled requests are still outstanding
+ *
+ * Returns:
+ * bool: true if the request queue is empty
+ */
+bool SIMSPI_isIdle(void);
+
+/**
+ * Replace the transport used for all transfers. Must be called before SIMSPI_startSPI
+ *
+ * Parameters:
+ * SPITransport const * transport: the new transport, or NULL to restore the nrf_spi_mngr one
+ */
+void SIMSPI_setTransport(SPITransport const *);
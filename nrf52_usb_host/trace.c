@@ -0,0 +1,47 @@
+/*
+ * trace.c
+ *
+ * Ring of timestamped probe records, drained from the main loop
+ */
+
+#include "trace.h"
+
+TraceRecord TRACE_ring[TRACE_RING_SLOTS];
+uint32_t TRACE_head;
+
+/* Next record to drain, as a running count like TRACE_head */
+static uint32_t tail;
+static uint32_t dropped;
+
+/* PUBLIC FUNCTIONS */
+
+void TRACE_init(void) {
+#if defined(__arm__)
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+uint_fast16_t TRACE_drain(TraceSink sink, void * context) {
+	uint32_t head = __atomic_load_n(&TRACE_head, __ATOMIC_ACQUIRE);
+	uint_fast16_t drained = 0;
+
+	/* Interrupts finish their probe before thread mode resumes, so every claimed slot up
+	 * to head holds a complete record. Those that were lapped are gone */
+	if (head - tail > TRACE_RING_SLOTS) {
+		dropped += head - tail - TRACE_RING_SLOTS;
+		tail = head - TRACE_RING_SLOTS;
+	}
+
+	while (tail != head) {
+		sink(&TRACE_ring[tail & (TRACE_RING_SLOTS - 1)], context);
+		tail++;
+		drained++;
+	}
+	return drained;
+}
+
+uint32_t TRACE_getDropped(void) {
+	return dropped;
+}
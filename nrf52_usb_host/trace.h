@@ -0,0 +1,102 @@
+#pragma once
+/*
+ * trace.h
+ *
+ * Timestamped probes on the path from the INT pin to the BLE notification. A probe claims
+ * a slot of a ring with one atomic add and stores an 8-byte record, a handful of cycles,
+ * so the probes stay in production builds. The main loop drains the ring. Timestamps are
+ * DWT->CYCCNT cycles on the target and monotonic ns on a host build.
+ * Build with TRACE_ENABLED 0 to compile the probes out
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(__arm__)
+#include "nrf.h"
+#else
+#include <time.h>
+#endif
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED           1
+#endif
+
+/* Records the ring holds between two drains (power of two) */
+#define TRACE_RING_SLOTS        128
+
+typedef enum {
+	TRACE_PIN_IRQ,              /* in_pin_handler entered */
+	TRACE_XFER_ISSUE,           /* token written to rHXFR, data: token | ep */
+	TRACE_XFER_DONE,            /* transfer finished, data: the rHRSL result */
+	TRACE_SPI_READ,             /* MAX_multiReadRegister, data: register << 8 | length */
+	TRACE_BLE_INPUT,            /* input report handed to the SoftDevice, data: the error code */
+	TRACE_PROBE_COUNT
+} TraceProbe;
+
+typedef struct {
+	uint32_t timestamp;         /* cycles or ns, wraps */
+	uint8_t probe;
+	uint8_t reserved;
+	uint16_t data;
+} TraceRecord;
+
+/* Called by TRACE_drain for every record, oldest first */
+typedef void(*TraceSink)(TraceRecord const *, void *);
+
+/* The ring; only the probes below should write it */
+extern TraceRecord TRACE_ring[TRACE_RING_SLOTS];
+extern uint32_t TRACE_head;
+
+/**
+ * Start the cycle counter. Call once at boot, before the first probe
+ */
+void TRACE_init(void);
+
+/**
+ * Hand the records stored since the last drain to a sink. Records that were overwritten
+ * before they could be drained are counted as dropped. Must be called from thread mode
+ *
+ * Parameters:
+ * TraceSink sink: called for every record
+ * void * context: passed to the sink
+ *
+ * Returns:
+ * uint_fast16_t: the number of records handed to the sink
+ */
+uint_fast16_t TRACE_drain(TraceSink, void *);
+
+/**
+ * Get the number of records lost because the ring was not drained in time
+ *
+ * Returns:
+ * uint32_t: the records dropped since boot
+ */
+uint32_t TRACE_getDropped(void);
+
+static inline uint32_t TRACE_timestamp(void) {
+#if defined(__arm__)
+	return DWT->CYCCNT;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)((uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec);
+#endif
+}
+
+/* Safe from any interrupt priority: the slot is claimed with LDREX/STREX */
+static inline void TRACE_probe(uint_fast8_t probe, uint_fast16_t data) {
+	uint32_t slot = __atomic_fetch_add(&TRACE_head, 1, __ATOMIC_RELAXED) & (TRACE_RING_SLOTS - 1);
+	TraceRecord * record = &TRACE_ring[slot];
+
+	record->timestamp = TRACE_timestamp();
+	record->probe = (uint8_t) probe;
+	record->data = (uint16_t) data;
+}
+
+#if TRACE_ENABLED
+#define TRACE(probe, data)      TRACE_probe((probe), (data))
+#else
+#define TRACE(probe, data)      ((void) 0)
+#endif
@@ -5,96 +5,254 @@
  *      Author: Stefan van der Linden
  */
 
+#include <string.h>
+
 #include "usb.h"
 #include "packets.h"
 #include "max3421e.h"
+#include "poller.h"
+#include "hub.h"
 #include "nrf_delay.h"
 #include "nrf_log.h"
+#include "app_timer.h"
+#include "app_scheduler.h"
+
+extern volatile uint_fast8_t ControlBuffer[];
+
+APP_TIMER_DEF(enumerationTimer);
+
+static volatile USBState state = USB_STATE_DETACHED;
+static USBStepper enumeration;
+static uint_fast8_t tries;
+
+/* All addressed devices, the one on the root port and the raw configuration descriptor
+ * of the device being enumerated */
+static USBDevice devices[USB_MAX_DEVICES];
+static USBDevice * rootDevice;
+static USBDevice * addressingDevice;    /* the device answering at address 0 */
+static uint_fast8_t rootSpeed;
+static DeviceModel const emptyModel;
+static uint8_t descriptorArena[DESCRIPTOR_ARENA_SIZE];
+
+static uint32_t attachStart;
+static uint32_t stageStart;
+static EnumerationTiming timing;
+
+/* Every state machine gets a generation no other one uses, so a token finds its owner */
+static USBStepper * steppers[USB_MAX_STEPPERS];
+static uint_fast8_t stepperCount;
+static uint32_t stepGeneration;
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static uint32_t _ticksToMs(uint32_t);
+static void _enterState(USBState);
+static void _retry(void);
+static void _startReset(void);
+static void _enumerationStep(void);
+static void _runStep(uint32_t);
+static void _stepTimeout(void *);
+static void _stepEvent(void *, uint16_t);
 
 /* Host functions */
 
 uint_fast8_t USB_setNewPeripheralAddress(uint_fast8_t peraddress) {
+	uint_fast8_t result;
 
 	ControlPacket addrPacket = {
-		0,
-		/* perAddress */
-	0x10,
-		/* type */
-	0,
-		/* endPoint */
-	0,
-		/*bmRequestType*/
-	0x05,
-		/* bRequest */
-	peraddress,
-		/* wValue */
-	0,
-		/* wIndex */
-	0,
-		/* wLength */
-	DIR_OUT /* direction */
+		.perAddress = 0,
+		.type = 0x10,
+		.endPoint = 0,
+		.bmRequestType = 0,
+		.bRequest = reqSET_ADDRESS,
+		.wValue = peraddress,
+		.wIndex = 0,
+		.wLength = 0,
+		.direction = DIR_OUT
 	};
-	return sendControl(&addrPacket);
+
+	/* The entry that gets the address is the device still at 0, so the engine picks its speed */
+	addressingDevice = USB_findDevice(peraddress);
+	result = sendControl(&addrPacket);
+	addressingDevice = NULL;
+	return result;
 }
 
 uint_fast8_t USB_requestStatus(uint_fast8_t * resultBuffer) {
+	uint8_t status[2];
+	uint_fast8_t result;
 	ControlPacket packet = {
-		PERIPHERAL_ADDRESS,
-		/* perAddress */
-	0x10,
-		/* type */
-	0,
-		/* endPoint */
-	0x80,
-		/*bmRequestType*/
-	reqGET_STATUS,
-		/* bRequest */
-	0,
-		/* wValue */
-	0,
-		/* wIndex */
-	2,
-		/* wLength */
-	DIR_IN
+		.perAddress = rootDevice ? rootDevice->address : 0,
+		.type = 0x10,
+		.endPoint = 0,
+		.bmRequestType = 0x80,
+		.bRequest = reqGET_STATUS,
+		.wValue = 0,
+		.wIndex = 0,
+		.wLength = sizeof(status),
+		.direction = DIR_IN,
+		.data = status
 	};
-	return sendControl(&packet);
+
+	/* The buffer is uint_fast8_t, which may be wider than a byte: copy the status over */
+	result = sendControl(&packet);
+	if (!result) {
+		resultBuffer[0] = status[0];
+		resultBuffer[1] = status[1];
+	}
+	return result;
 }
 
-uint_fast8_t USB_doEnumeration(void) {
-	uint16_t tries = 0;
-	MAX_enableOptions(rHCTL, BIT7);
-	MAX_disableOptions(rHCTL, BIT6);
-	MAX_enableOptions(rHCTL, BIT5);
-	MAX_disableOptions(rHCTL, BIT4);
+void USB_init(void) {
+	USB_createStepper(&enumeration, &enumerationTimer, _enumerationStep);
+	initTransfers();
+}
 
-	while (tries < 20) {
-		if (tries) {
-			NRF_LOG_INFO("Enumeration failed. Retrying...\n");
-			USB_busReset();
-			nrf_delay_ms(4000000);
-		}
-		tries++;
-		MAX_writeRegister(rPERADDR, 0);
-		if (!USB_setNewPeripheralAddress(PERIPHERAL_ADDRESS)) {
-			MAX_writeRegister(rPERADDR, PERIPHERAL_ADDRESS);
-			nrf_delay_ms(500000);
-		}
-		else {
-			continue;
+void USB_deviceAttached(uint_fast8_t speed) {
+	USB_cancelSteps(&enumeration);
+	tries = 0;
+	rootSpeed = speed;
+	if (rootDevice)
+		USB_freeDevice(rootDevice);
+	rootDevice = NULL;
+	memset(&timing, 0, sizeof(timing));
+	attachStart = app_timer_cnt_get();
+	stageStart = attachStart;
+
+	_startReset();
+}
+
+void USB_deviceDetached(void) {
+	USB_cancelSteps(&enumeration);
+	POLL_stop();
+	HUB_stop();
+	state = USB_STATE_DETACHED;
+
+	/* Everything downstream of the root port is gone as well */
+	memset(devices, 0, sizeof(devices));
+	rootDevice = NULL;
+	addressingDevice = NULL;
+}
+
+DeviceModel const * USB_getDevice(void) {
+	return rootDevice ? &rootDevice->model : &emptyModel;
+}
+
+USBDevice * USB_getRootDevice(void) {
+	return rootDevice;
+}
+
+USBDevice * USB_allocateDevice(void) {
+	uint_fast8_t it;
+
+	for (it = 0; it < USB_MAX_DEVICES; it++) {
+		if (!devices[it].used) {
+			memset(&devices[it], 0, sizeof(USBDevice));
+			devices[it].used = true;
+			devices[it].address = it + 1;
+			return &devices[it];
 		}
-		if (!USB_requestStatus(0))
-			break;
 	}
-	if (tries < 20) {
-		MAX_enableOptions(rHCTL, BIT6);
-		MAX_disableOptions(rHCTL, BIT7);
-		MAX_enableOptions(rHCTL, BIT4);
-		MAX_disableOptions(rHCTL, BIT5);
-		return 0;
+	return NULL;
+}
+
+void USB_freeDevice(USBDevice * device) {
+	device->used = false;
+}
+
+USBDevice * USB_findDevice(uint_fast8_t address) {
+	if (!address)
+		return addressingDevice;
+	if (address > USB_MAX_DEVICES || !devices[address - 1].used)
+		return NULL;
+	return &devices[address - 1];
+}
+
+bool USB_getToggle(uint_fast8_t address, uint_fast8_t ep, bool in) {
+	USBDevice * device = USB_findDevice(address);
+
+	if (!device)
+		return false;
+	return ((in ? device->inToggles : device->outToggles) >> (ep & 0x0F)) & 1;
+}
+
+void USB_setToggle(uint_fast8_t address, uint_fast8_t ep, bool in, bool toggle) {
+	USBDevice * device = USB_findDevice(address);
+	uint16_t * toggles;
+
+	if (!device)
+		return;
+	toggles = in ? &device->inToggles : &device->outToggles;
+	if (toggle)
+		*toggles |= 1 << (ep & 0x0F);
+	else
+		*toggles &= ~(1 << (ep & 0x0F));
+}
+
+uint_fast8_t USB_getDescriptor(uint_fast8_t address,
+	uint_fast8_t type,
+	uint_fast8_t index,
+	uint_fast16_t wIndex,
+	uint8_t * buffer,
+	uint_fast16_t length,
+	uint_fast16_t * received) {
+	uint_fast8_t result;
+	ControlPacket packet = {
+		.perAddress = address,
+		.type = 0x10,
+		.endPoint = 0,
+		/* Class descriptors belong to the interface in wIndex */
+		.bmRequestType = (type == descHID || type == descHID_REPORT) ? 0x81 : 0x80,
+		.bRequest = reqGET_DESCRIPTOR,
+		.wValue = (type << 8) | index,
+		.wIndex = wIndex,
+		.wLength = length,
+		.direction = DIR_IN,
+		.data = buffer
+	};
+
+	result = sendControl(&packet);
+	if (received)
+		*received = packet.actualLength;
+	return result;
+}
+
+USBState USB_getState(void) {
+	return state;
+}
+
+void USB_getEnumerationTiming(EnumerationTiming * result) {
+	*result = timing;
+}
+
+void USB_createStepper(USBStepper * stepper, app_timer_id_t const * timer, void(*step)(void)) {
+	ret_code_t err_code = app_timer_create(timer, APP_TIMER_MODE_SINGLE_SHOT, _stepTimeout);
+	APP_ERROR_CHECK(err_code);
+	APP_ERROR_CHECK_BOOL(stepperCount < USB_MAX_STEPPERS);
+
+	stepper->timer = *timer;
+	stepper->step = step;
+	stepper->generation = ++stepGeneration;
+	steppers[stepperCount++] = stepper;
+}
+
+void USB_nextStep(USBStepper * stepper, uint32_t delayMs) {
+	ret_code_t err_code;
+	uint32_t token = stepper->generation;
+
+	if (delayMs) {
+		err_code = app_timer_start(stepper->timer, APP_TIMER_TICKS(delayMs), (void *)(uintptr_t) token);
 	}
 	else {
-		return 1;
+		err_code = app_sched_event_put(&token, sizeof(token), _stepEvent);
 	}
+	APP_ERROR_CHECK(err_code);
+}
+
+void USB_cancelSteps(USBStepper * stepper) {
+	stepper->generation = ++stepGeneration;
+	if (stepper->step)
+		app_timer_stop(stepper->timer);
 }
 
 void USB_busReset(void) {
@@ -102,21 +260,87 @@ void USB_busReset(void) {
 	MAX_disableOptions(rMODE, BIT3);
 
 	/* Perform the reset */
-	MAX_enableOptions(rHCTL, BIT0);
-	while (!MAX_readRegister(rHCTL) & BIT0) {
-		nrf_delay_ms(10000);
-	}
+	MAX_writeRegister(rHCTL, BIT0);
+	while (MAX_readRegister(rHCTL) & BIT0) ;
 
 	/* Restart the SOF generator */
 	MAX_enableOptions(rMODE, BIT3);
 
 	/* Wait until the first SOF is transmitted */
-	while (!MAX_readRegister(rHIRQ) & BIT6) {
-		nrf_delay_ms(100);
-	}
+	while (!(MAX_readRegister(rHIRQ) & BIT6)) ;
 	NRF_LOG_INFO("Bus reset successfully");
 }
 
+uint_fast8_t USB_readDescriptors(USBDevice * device) {
+	DeviceModel * model = &device->model;
+	uint_fast8_t address = device->address;
+	uint_fast8_t result;
+	uint_fast16_t length, received;
+
+	/* bMaxPacketSize0 stays 0 (meaning 8 bytes) until the first 8 bytes are in */
+	memset(model, 0, sizeof(DeviceModel));
+	result = USB_getDescriptor(address, descDEVICE, 0, 0, descriptorArena, 8, NULL);
+	if (result)
+		return result;
+	model->maxPacketSize0 = descriptorArena[7];
+
+	result = USB_getDescriptor(address, descDEVICE, 0, 0, descriptorArena, DEVICE_DESCRIPTOR_LENGTH, &received);
+	if (result)
+		return result;
+	if (DESC_parseDevice(descriptorArena, received, model))
+		return rslBADBC;
+
+	/* Get the header for wTotalLength, then the whole set */
+	result = USB_getDescriptor(address, descCONFIGURATION, 0, 0, descriptorArena, CONFIG_DESCRIPTOR_LENGTH, NULL);
+	if (result)
+		return result;
+	length = descriptorArena[2] | (descriptorArena[3] << 8);
+	if (length > DESCRIPTOR_ARENA_SIZE) {
+		NRF_LOG_INFO("Configuration truncated: %d bytes\n", length);
+		length = DESCRIPTOR_ARENA_SIZE;
+	}
+
+	result = USB_getDescriptor(address, descCONFIGURATION, 0, 0, descriptorArena, length, &received);
+	if (result)
+		return result;
+	/* Only parse what the device sent: the rest of the arena holds stale bytes. A
+	 * configuration cut short by the arena still yields the interfaces before the cut */
+	result = DESC_parseConfiguration(descriptorArena, received, model);
+	if (result != descOK && result != descTRUNCATED)
+		return rslBADBC;
+
+	NRF_LOG_INFO("Device %d: %04x:%04x, %d interfaces, %d endpoints\n",
+		address,
+		model->vendorId,
+		model->productId,
+		model->interfaceCount,
+		model->endpointCount);
+	return rslSUCCES;
+}
+
+uint_fast8_t USB_setConfiguration(USBDevice * device) {
+	uint_fast8_t result;
+	ControlPacket packet = {
+		.perAddress = device->address,
+		.type = 0x10,
+		.endPoint = 0,
+		.bmRequestType = 0,
+		.bRequest = reqSET_CONFIGURATION,
+		.wValue = device->model.configurationValue,
+		.wIndex = 0,
+		.wLength = 0,
+		.direction = DIR_OUT
+	};
+
+	result = sendControl(&packet);
+	if (!result) {
+		/* SET_CONFIGURATION resets the device's toggles, so the data pipes start at DATA0 */
+		device->inToggles = 0;
+		device->outToggles = 0;
+	}
+	return result;
+}
+
 /* Peripheral functions */
 
 void USB_respondStatus(uint_fast8_t * request) {
@@ -147,4 +371,124 @@ void USB_respondStatus(uint_fast8_t * request) {
 		//USB_stallEndpoint(0);
 		// don?t understand the request
 	}
-}
\ No newline at end of file
+}
+
+/* PRIVATE FUNCTIONS */
+
+static uint32_t _ticksToMs(uint32_t ticks) {
+	return (uint32_t)(((uint64_t) ticks * 1000) / APP_TIMER_CLOCK_FREQ);
+}
+
+static void _enterState(USBState newState) {
+	uint_fast8_t it;
+	uint32_t now = app_timer_cnt_get();
+
+	/* Account the time spent in the stage we're leaving */
+	timing.stageMs[state] += _ticksToMs(app_timer_cnt_diff_compute(now, stageStart));
+	stageStart = now;
+	state = newState;
+
+	if (newState == USB_STATE_READY || newState == USB_STATE_FAILED) {
+		timing.totalMs = _ticksToMs(app_timer_cnt_diff_compute(now, attachStart));
+		for (it = USB_STATE_RESET; it < USB_STATE_READY; it++)
+			NRF_LOG_INFO("Stage %d: %d ms\n", it, timing.stageMs[it]);
+		NRF_LOG_INFO("Enumeration %s after %d ms (%d tries)\n",
+			newState == USB_STATE_READY ? "done" : "failed",
+			timing.totalMs,
+			tries + 1);
+	}
+}
+
+static void _retry(void) {
+	if (++tries < USB_ENUMERATION_RETRIES) {
+		NRF_LOG_INFO("Enumeration failed in stage %d. Retrying...\n", state);
+		_startReset();
+	}
+	else {
+		_enterState(USB_STATE_FAILED);
+	}
+}
+
+static void _startReset(void) {
+	_enterState(USB_STATE_RESET);
+
+	/* Stop the SOF generator and start the bus reset; the module times the reset itself */
+	MAX_disableOptions(rMODE, MODE_SOFKAENAB);
+	MAX_writeRegister(rHCTL, HCTL_BUSRST);
+	USB_nextStep(&enumeration, USB_RESET_POLL_MS);
+}
+
+static void _enumerationStep(void) {
+	switch (state) {
+	case USB_STATE_RESET:
+		/* BUSRST clears itself when the reset is done */
+		if (MAX_readRegister(rHCTL) & HCTL_BUSRST) {
+			USB_nextStep(&enumeration, USB_RESET_POLL_MS);
+			break;
+		}
+		/* Restart the SOF generator and let the device recover */
+		MAX_enableOptions(rMODE, MODE_SOFKAENAB);
+		_enterState(USB_STATE_SETTLE);
+		USB_nextStep(&enumeration, USB_RESET_RECOVERY_MS);
+		break;
+
+	case USB_STATE_SETTLE:
+		_enterState(USB_STATE_ADDRESS);
+		if (!rootDevice)
+			rootDevice = USB_allocateDevice();
+		if (!rootDevice) {
+			_enterState(USB_STATE_FAILED);
+			break;
+		}
+		rootDevice->speed = rootSpeed;
+		if (USB_setNewPeripheralAddress(rootDevice->address)) {
+			_retry();
+			break;
+		}
+		USB_nextStep(&enumeration, USB_SET_ADDRESS_RECOVERY_MS);
+		break;
+
+	case USB_STATE_ADDRESS:
+		_enterState(USB_STATE_DESCRIPTOR);
+		if (USB_readDescriptors(rootDevice)) {
+			_retry();
+			break;
+		}
+		USB_nextStep(&enumeration, 0);
+		break;
+
+	case USB_STATE_DESCRIPTOR:
+		_enterState(USB_STATE_CONFIGURE);
+		if (USB_setConfiguration(rootDevice)) {
+			_retry();
+			break;
+		}
+		_enterState(USB_STATE_READY);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* Run the step of the state machine that queued the token. Tokens from before a
+ * USB_cancelSteps match nothing and are dropped */
+static void _runStep(uint32_t token) {
+	uint_fast8_t it;
+
+	for (it = 0; it < stepperCount; it++) {
+		if (steppers[it]->generation == token) {
+			steppers[it]->step();
+			return;
+		}
+	}
+}
+
+static void _stepTimeout(void * p_context) {
+	_runStep((uint32_t)(uintptr_t) p_context);
+}
+
+static void _stepEvent(void * p_event_data, uint16_t event_size) {
+	UNUSED_PARAMETER(event_size);
+	_runStep(*(uint32_t *) p_event_data);
+}
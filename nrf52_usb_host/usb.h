@@ -12,10 +12,16 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-/* It is important that for the the standard peripheral address it is assumed only
- * a single peripheral is connected
- */
-#define PERIPHERAL_ADDRESS 5
+#include "descriptors.h"
+#include "app_timer.h"
+
+/* Size of the device table; devices get the addresses 1 to USB_MAX_DEVICES */
+#define USB_MAX_DEVICES     4
+
+/* Device Speeds */
+#define USB_SPEED_FULL      0
+#define USB_SPEED_LOW       1
+#define USB_SPEED_NONE      0xFF
 
 #define DIR_OUT      0
 #define DIR_IN      1
@@ -57,6 +63,48 @@
 #define reqGET_CONFIGURATION    0x08
 #define reqSET_CONFIGURATION    0x09
 
+/* Device Classes */
+#define clsHID                  0x03
+#define clsHUB                  0x09
+
+/* Enumeration timing (ms): minimum intervals from the USB 2.0 spec (7.1.7.5, 9.2.6.3) */
+#define USB_RESET_POLL_MS           10
+#define USB_RESET_RECOVERY_MS       10
+#define USB_SET_ADDRESS_RECOVERY_MS 2
+#define USB_ENUMERATION_RETRIES     3
+
+/* Enumeration states, in the order they are passed through */
+typedef enum {
+	USB_STATE_DETACHED,
+	USB_STATE_RESET,
+	USB_STATE_SETTLE,
+	USB_STATE_ADDRESS,
+	USB_STATE_DESCRIPTOR,
+	USB_STATE_CONFIGURE,
+	USB_STATE_READY,
+	USB_STATE_FAILED,
+	USB_STATE_COUNT
+} USBState;
+
+/* Time spent in each enumeration stage during the last attach */
+typedef struct {
+	uint32_t stageMs[USB_STATE_COUNT];
+	uint32_t totalMs;
+} EnumerationTiming;
+
+/* An addressed device and the state the transfer engine keeps for it */
+typedef struct {
+	DeviceModel model;
+	uint16_t inToggles;         /* bit n: DATA1 expected next from IN endpoint n */
+	uint16_t outToggles;        /* bit n: DATA1 to be sent next to OUT endpoint n */
+	struct RetryPolicy const * retryPolicies[16];   /* per endpoint number, NULL for the default */
+	uint8_t address;
+	uint8_t parent;             /* address of the hub the device is on, 0 for the root port */
+	uint8_t port;               /* port number on that hub */
+	uint8_t speed;              /* USB_SPEED_FULL or USB_SPEED_LOW */
+	bool used;
+} USBDevice;
+
 typedef struct {
 	uint_fast8_t perAddress;
 	uint_fast8_t type;
@@ -67,15 +115,31 @@ typedef struct {
 	uint_fast16_t wIndex;
 	uint_fast16_t wLength;
 	uint_fast8_t direction;
+	uint8_t * data;             /* wLength bytes for the data stage, NULL to use ControlBuffer */
+	uint_fast16_t actualLength; /* set by sendControl: bytes moved in the data stage */
 } ControlPacket;
 
+/* State machines that step through USB_nextStep: the enumeration and the hub ports */
+#define USB_MAX_STEPPERS    2
+
+/* A state machine that runs its steps from a timer or the scheduler. Steps that were
+ * queued before USB_cancelSteps are dropped when they come due */
+typedef struct {
+	app_timer_id_t timer;
+	void(*step)(void);
+	volatile uint32_t generation;
+} USBStepper;
+
 /* Host Prototypes */
 
 /**
- * Perform a GET_STATUS request
+ * Perform a GET_STATUS request on the root device
  *
  * Parmeters:
  * uint_fast8_t * resultBuffer: a two-byte array for storing the result
+ *
+ * Returns:
+ * uint_fast8_t: the result code of the control transfer
  */
 uint_fast8_t USB_requestStatus(uint_fast8_t *);
 
@@ -98,7 +162,178 @@ uint_fast8_t USB_setNewPeripheralAddress(uint_fast8_t);
  */
 void USB_stallEndpoint(uint_fast8_t);
 
-uint_fast8_t USB_doEnumeration(void);
+/**
+ * Create the enumeration timer. Must be called after app_timer_init
+ */
+void USB_init(void);
+
+/**
+ * Start enumerating a newly attached peripheral. Returns immediately; the
+ * enumeration runs from app_timer callbacks
+ *
+ * Parameters:
+ * uint_fast8_t speed: USB_SPEED_FULL or USB_SPEED_LOW, as detected on the root port
+ */
+void USB_deviceAttached(uint_fast8_t);
+
+/**
+ * Abort any enumeration in progress after the peripheral was removed
+ */
+void USB_deviceDetached(void);
+
+/**
+ * Get the current enumeration state
+ *
+ * Returns:
+ * USBState: the state of the attached peripheral
+ */
+USBState USB_getState(void);
+
+/**
+ * Get the parsed descriptors of the peripheral on the root port
+ *
+ * Returns:
+ * DeviceModel const *: the device model, only complete once the state is USB_STATE_READY
+ */
+DeviceModel const * USB_getDevice(void);
+
+/**
+ * Get the device on the root port
+ *
+ * Returns:
+ * USBDevice *: the device, or NULL if none was addressed
+ */
+USBDevice * USB_getRootDevice(void);
+
+/**
+ * Claim a free entry in the device table and give it the next free address
+ *
+ * Returns:
+ * USBDevice *: the cleared entry, or NULL if the table is full
+ */
+USBDevice * USB_allocateDevice(void);
+
+/**
+ * Release an entry of the device table
+ *
+ * Parameters:
+ * USBDevice * device: the entry to release
+ */
+void USB_freeDevice(USBDevice *);
+
+/**
+ * Look up a device by its address. Address 0 resolves to the device that is being
+ * given its address, so SET_ADDRESS goes out at that device's speed
+ *
+ * Parameters:
+ * uint_fast8_t address: the device address
+ *
+ * Returns:
+ * USBDevice *: the device, or NULL if no device has this address
+ */
+USBDevice * USB_findDevice(uint_fast8_t);
+
+/**
+ * Get the data toggle an endpoint of a device expects next
+ *
+ * Parameters:
+ * uint_fast8_t address: the device address
+ * uint_fast8_t ep: the endpoint number
+ * bool in: true for the IN endpoint, false for OUT
+ *
+ * Returns:
+ * bool: true for DATA1, false for DATA0 (and for unknown devices)
+ */
+bool USB_getToggle(uint_fast8_t, uint_fast8_t, bool);
+
+/**
+ * Store the data toggle an endpoint of a device expects next
+ *
+ * Parameters:
+ * uint_fast8_t address: the device address
+ * uint_fast8_t ep: the endpoint number
+ * bool in: true for the IN endpoint, false for OUT
+ * bool toggle: true for DATA1, false for DATA0
+ */
+void USB_setToggle(uint_fast8_t, uint_fast8_t, bool, bool);
+
+/**
+ * Fetch a descriptor from a peripheral
+ *
+ * Parameters:
+ * uint_fast8_t address: the device address
+ * uint_fast8_t type: the descriptor type (descDEVICE, descCONFIGURATION, ...)
+ * uint_fast8_t index: the descriptor index
+ * uint_fast16_t wIndex: the interface (for HID descriptors) or language ID, 0 for device
+ *                      descriptors
+ * uint8_t * buffer: a buffer of at least 'length' bytes
+ * uint_fast16_t length: the number of bytes to request
+ * uint_fast16_t * received: set to the number of bytes the device sent, may be NULL
+ *
+ * Returns:
+ * uint_fast8_t: the result code of the control transfer
+ */
+uint_fast8_t USB_getDescriptor(uint_fast8_t, uint_fast8_t, uint_fast8_t, uint_fast16_t, uint8_t *, uint_fast16_t, uint_fast16_t *);
+
+/**
+ * Read the device and configuration descriptors of an addressed device into its model
+ *
+ * Parameters:
+ * USBDevice * device: the device
+ *
+ * Returns:
+ * uint_fast8_t: the result code of the failing control transfer, rslBADBC for descriptors
+ *               that could not be parsed
+ */
+uint_fast8_t USB_readDescriptors(USBDevice *);
+
+/**
+ * Select the first configuration of a device and reset its data toggles
+ *
+ * Parameters:
+ * USBDevice * device: the device, with its descriptors read
+ *
+ * Returns:
+ * uint_fast8_t: the result code of the control transfer
+ */
+uint_fast8_t USB_setConfiguration(USBDevice *);
+
+/**
+ * Get the per-stage timing of the last enumeration
+ *
+ * Parameters:
+ * EnumerationTiming * timing: the structure to store the timing in
+ */
+void USB_getEnumerationTiming(EnumerationTiming *);
+
+/**
+ * Set up a state machine for USB_nextStep and create its timer
+ *
+ * Parameters:
+ * USBStepper * stepper: the state machine, must stay valid
+ * app_timer_id_t const * timer: a timer from APP_TIMER_DEF that was not created yet
+ * void(*step)(void): runs the next step
+ */
+void USB_createStepper(USBStepper *, app_timer_id_t const *, void(*)(void));
+
+/**
+ * Run the next step of a state machine after the given delay, or through the scheduler
+ * if there is none
+ *
+ * Parameters:
+ * USBStepper * stepper: the state machine
+ * uint32_t delayMs: the delay in ms, 0 to run as soon as the scheduler gets to it
+ */
+void USB_nextStep(USBStepper *, uint32_t);
+
+/**
+ * Drop the pending step of a state machine, after an attach, a detach or a reset.
+ * Works on a state machine that was not created yet
+ *
+ * Parameters:
+ * USBStepper * stepper: the state machine
+ */
+void USB_cancelSteps(USBStepper *);
 
 void USB_busReset(void);
 
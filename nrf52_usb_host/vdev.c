@@ -0,0 +1,505 @@
+/*
+ * vdev.c
+ *
+ * Virtual USB devices for the MAX3421E model. Data toggles are not checked: the model
+ * ACKs what it receives and the module keeps the host's toggles
+ */
+
+#include <string.h>
+
+#include "vdev.h"
+#include "usb.h"
+#include "descriptors.h"
+#include "hidreport.h"
+
+/* bmRequestType values of the requests the control pipe answers */
+#define REQUEST_DEVICE_IN       0x80
+#define REQUEST_INTERFACE_IN    0x81
+#define REQUEST_ENDPOINT_IN     0x82
+#define REQUEST_DEVICE_OUT      0x00
+#define REQUEST_CLASS_OUT       0x21
+#define REQUEST_ENDPOINT_OUT    0x02
+
+/* Low-speed mouse: buttons, X, Y and wheel, boot compatible */
+static uint8_t const mouseReport[] = {
+	0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00,
+	0x05, 0x09, 0x19, 0x01, 0x29, 0x05, 0x15, 0x00, 0x25, 0x01, 0x95, 0x05, 0x75, 0x01, 0x81, 0x02,
+	0x95, 0x01, 0x75, 0x03, 0x81, 0x01,
+	0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x03, 0x81, 0x06,
+	0xC0, 0xC0
+};
+
+static uint8_t const mouseDevice[DEVICE_DESCRIPTOR_LENGTH] = {
+	18, descDEVICE, 0x10, 0x01, 0x00, 0x00, 0x00, 8,
+	0x6D, 0x04, 0x16, 0xC0, 0x00, 0x01, 0, 0, 0, 1
+};
+
+static uint8_t const mouseConfiguration[] = {
+	9, descCONFIGURATION, 34, 0, 1, 1, 0, 0xA0, 50,
+	9, descINTERFACE, 0, 0, 1, clsHID, 1, 2, 0,
+	9, descHID, 0x11, 0x01, 0, 1, descHID_REPORT, sizeof(mouseReport), 0,
+	7, descENDPOINT, 0x81, epINTERRUPT, 4, 0, 10
+};
+
+static VirtualDescriptors const mouseDescriptors = {
+	mouseDevice,
+	mouseConfiguration,
+	{ mouseReport },
+	{ sizeof(mouseReport) }
+};
+
+/* Low-speed keyboard: the boot keyboard report with LED outputs */
+static uint8_t const keyboardReport[] = {
+	0x05, 0x01, 0x09, 0x06, 0xA1, 0x01,
+	0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02,
+	0x95, 0x01, 0x75, 0x08, 0x81, 0x01,
+	0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02,
+	0x95, 0x01, 0x75, 0x03, 0x91, 0x01,
+	0x95, 0x06, 0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00,
+	0xC0
+};
+
+static uint8_t const keyboardDevice[DEVICE_DESCRIPTOR_LENGTH] = {
+	18, descDEVICE, 0x10, 0x01, 0x00, 0x00, 0x00, 8,
+	0x6D, 0x04, 0x1C, 0xC3, 0x00, 0x01, 0, 0, 0, 1
+};
+
+static uint8_t const keyboardConfiguration[] = {
+	9, descCONFIGURATION, 34, 0, 1, 1, 0, 0xA0, 50,
+	9, descINTERFACE, 0, 0, 1, clsHID, 1, 1, 0,
+	9, descHID, 0x11, 0x01, 0, 1, descHID_REPORT, sizeof(keyboardReport), 0,
+	7, descENDPOINT, 0x81, epINTERRUPT, 8, 0, 10
+};
+
+static VirtualDescriptors const keyboardDescriptors = {
+	keyboardDevice,
+	keyboardConfiguration,
+	{ keyboardReport },
+	{ sizeof(keyboardReport) }
+};
+
+/* Full-speed composite: report ID 1 is a mouse with 12-bit axes, wheel and AC Pan,
+ * report ID 2 the media keys */
+static uint8_t const compositeReport[] = {
+	0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x85, 0x01, 0x09, 0x01, 0xA1, 0x00,
+	0x05, 0x09, 0x19, 0x01, 0x29, 0x05, 0x15, 0x00, 0x25, 0x01, 0x95, 0x05, 0x75, 0x01, 0x81, 0x02,
+	0x95, 0x01, 0x75, 0x03, 0x81, 0x01,
+	0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x16, 0x01, 0xF8, 0x26, 0xFF, 0x07, 0x75, 0x0C, 0x95, 0x02, 0x81, 0x06,
+	0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x01, 0x81, 0x06,
+	0x05, 0x0C, 0x0A, 0x38, 0x02, 0x95, 0x01, 0x81, 0x06,
+	0xC0, 0xC0,
+	0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x85, 0x02, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08,
+	0x09, 0xCD, 0x0A, 0x83, 0x01, 0x09, 0xB5, 0x09, 0xB6, 0x09, 0xEA, 0x09, 0xE9, 0x0A, 0x25, 0x02, 0x0A, 0x24, 0x02,
+	0x81, 0x02,
+	0xC0
+};
+
+static uint8_t const compositeDevice[DEVICE_DESCRIPTOR_LENGTH] = {
+	18, descDEVICE, 0x00, 0x02, 0x00, 0x00, 0x00, 8,
+	0x6D, 0x04, 0x2B, 0xC5, 0x01, 0x12, 0, 0, 0, 1
+};
+
+static uint8_t const compositeConfiguration[] = {
+	9, descCONFIGURATION, 82, 0, 3, 1, 0, 0xA0, 98,
+	/* Boot keyboard */
+	9, descINTERFACE, 0, 0, 1, clsHID, 1, 1, 0,
+	9, descHID, 0x11, 0x01, 0, 1, descHID_REPORT, sizeof(keyboardReport), 0,
+	7, descENDPOINT, 0x81, epINTERRUPT, 8, 0, 8,
+	/* Mouse and media keys, report protocol only */
+	9, descINTERFACE, 1, 0, 1, clsHID, 0, 0, 0,
+	9, descHID, 0x11, 0x01, 0, 1, descHID_REPORT, sizeof(compositeReport), 0,
+	7, descENDPOINT, 0x82, epINTERRUPT, 8, 0, 2,
+	/* Vendor bulk pipe */
+	9, descINTERFACE, 2, 0, 2, 0xFF, 0, 0, 0,
+	7, descENDPOINT, 0x83, epBULK, 64, 0, 0,
+	7, descENDPOINT, 0x03, epBULK, 64, 0, 0
+};
+
+static VirtualDescriptors const compositeDescriptors = {
+	compositeDevice,
+	compositeConfiguration,
+	{ keyboardReport, compositeReport },
+	{ sizeof(keyboardReport), sizeof(compositeReport) }
+};
+
+/* Full-speed vendor device with a bulk pipe each way */
+static uint8_t const bulkDevice[DEVICE_DESCRIPTOR_LENGTH] = {
+	18, descDEVICE, 0x00, 0x02, 0xFF, 0x00, 0x00, 64,
+	0x09, 0x12, 0x01, 0x00, 0x00, 0x01, 0, 0, 0, 1
+};
+
+static uint8_t const bulkConfiguration[] = {
+	9, descCONFIGURATION, 32, 0, 1, 1, 0, 0x80, 50,
+	9, descINTERFACE, 0, 0, 2, 0xFF, 0, 0, 0,
+	7, descENDPOINT, 0x82, epBULK, 64, 0, 0,
+	7, descENDPOINT, 0x01, epBULK, 64, 0, 0
+};
+
+static VirtualDescriptors const bulkDescriptors = {
+	bulkDevice,
+	bulkConfiguration,
+	{ NULL },
+	{ 0 }
+};
+
+/* PROTOTYPES FOR PRIVATE FUNCTIONS */
+
+static uint_fast8_t _token(MaxSimPort *, uint_fast8_t, uint_fast8_t, uint_fast8_t, uint8_t *, uint_fast8_t *);
+static void _busReset(MaxSimPort *);
+static bool _fault(VirtualDevice *, uint_fast8_t, uint_fast8_t, uint_fast8_t *);
+static bool _delay(uint8_t *, uint8_t);
+static uint_fast8_t _setup(VirtualDevice *, uint8_t const *);
+static uint_fast8_t _controlIn(VirtualDevice *, uint8_t *, uint_fast8_t *);
+static void _status(VirtualDevice *);
+static uint_fast8_t _dataIn(VirtualDevice *, VirtualEndpoint *, uint8_t *, uint_fast8_t *);
+static uint_fast8_t _dataOut(VirtualDevice *, VirtualEndpoint *, uint_fast8_t);
+static VirtualEndpoint * _findEndpoint(VirtualDevice *, uint_fast8_t);
+static uint8_t const * _findHidDescriptor(VirtualDevice const *, uint_fast8_t);
+
+/* PUBLIC FUNCTIONS */
+
+void VDEV_init(VirtualDevice * device, VirtualDescriptors const * descriptors, uint_fast8_t speed) {
+	uint8_t const * config = descriptors->configuration;
+	uint_fast16_t offset, length = config[2] | (config[3] << 8);
+	VirtualEndpoint * endpoint;
+
+	memset(device, 0, sizeof(VirtualDevice));
+	device->port.token = _token;
+	device->port.busReset = _busReset;
+	device->port.speed = speed;
+	device->descriptors = descriptors;
+
+	for (offset = 0; offset + 1 < length && config[offset]; offset += config[offset]) {
+		if (config[offset + 1] != descENDPOINT || device->endpointCount >= VDEV_MAX_ENDPOINTS)
+			continue;
+		endpoint = &device->endpoints[device->endpointCount++];
+		endpoint->address = config[offset + 2];
+		endpoint->maxPacketSize = MIN(config[offset + 4], MAXSIM_FIFO_SIZE);
+	}
+}
+
+void VDEV_initMouse(VirtualDevice * device) {
+	VDEV_init(device, &mouseDescriptors, USB_SPEED_LOW);
+	VDEV_setDelay(device, 0, 2);
+	VDEV_setDelay(device, 0x81, 2);
+}
+
+void VDEV_initKeyboard(VirtualDevice * device) {
+	VDEV_init(device, &keyboardDescriptors, USB_SPEED_LOW);
+}
+
+void VDEV_initComposite(VirtualDevice * device) {
+	VDEV_init(device, &compositeDescriptors, USB_SPEED_FULL);
+}
+
+void VDEV_initBulk(VirtualDevice * device) {
+	VDEV_init(device, &bulkDescriptors, USB_SPEED_FULL);
+	_findEndpoint(device, 0x82)->stream = true;
+}
+
+bool VDEV_queueReport(VirtualDevice * device, uint_fast8_t ep, uint8_t const * data, uint_fast8_t length) {
+	VirtualEndpoint * endpoint = _findEndpoint(device, ep);
+	uint_fast8_t slot;
+
+	if (!endpoint || !(ep & epDIR_IN) || endpoint->queueCount >= VDEV_QUEUE_SLOTS || length > endpoint->maxPacketSize)
+		return false;
+
+	slot = (endpoint->queueHead + endpoint->queueCount++) % VDEV_QUEUE_SLOTS;
+	memcpy(endpoint->queue[slot], data, length);
+	endpoint->queueLengths[slot] = length;
+	return true;
+}
+
+void VDEV_setDelay(VirtualDevice * device, uint_fast8_t ep, uint_fast8_t naks) {
+	VirtualEndpoint * endpoint;
+
+	if (!(ep & 0x0F)) {
+		device->controlDelay = device->controlNaksLeft = naks;
+		return;
+	}
+	endpoint = _findEndpoint(device, ep);
+	if (endpoint)
+		endpoint->ackDelay = endpoint->naksLeft = naks;
+}
+
+bool VDEV_injectFault(VirtualDevice * device, VirtualFault const * fault) {
+	if (device->faultCount >= VDEV_MAX_FAULTS)
+		return false;
+	device->faults[device->faultCount++] = *fault;
+	return true;
+}
+
+void VDEV_getStats(VirtualDevice const * device, VirtualStats * result) {
+	*result = device->stats;
+}
+
+/* PRIVATE FUNCTIONS */
+
+static uint_fast8_t _token(MaxSimPort * port,
+	uint_fast8_t token,
+	uint_fast8_t address,
+	uint_fast8_t ep,
+	uint8_t * data,
+	uint_fast8_t * length) {
+	VirtualDevice * device = (VirtualDevice *) port;
+	bool in = token == xfrIN || token == xfrINHS || token == xfrISOIN;
+	VirtualEndpoint * endpoint;
+	uint_fast8_t result, received = *length;
+
+	/* Tokens for another address go unanswered */
+	*length = 0;
+	if (address != device->address)
+		return rslTIMEOUT;
+
+	if (_fault(device, token, in ? ep | epDIR_IN : ep, &result))
+		return result;
+
+	if (!ep) {
+		switch (token) {
+		case xfrSETUP:
+			return _setup(device, data);
+		case xfrIN:
+			result = _controlIn(device, data, length);
+			break;
+		case xfrOUT:
+			result = device->controlStalled ? rslSTALL : _delay(&device->controlNaksLeft, device->controlDelay) ? rslNAK : rslSUCCES;
+			if (result == rslSUCCES) {
+				device->stats.outPackets++;
+				device->stats.outBytes += received;
+			}
+			break;
+		case xfrINHS:
+		case xfrOUTHS:
+			result = device->controlStalled ? rslSTALL : _delay(&device->controlNaksLeft, device->controlDelay) ? rslNAK : rslSUCCES;
+			if (result == rslSUCCES && token == xfrINHS)
+				_status(device);
+			break;
+		default:
+			result = rslSTALL;
+			break;
+		}
+	}
+	else {
+		/* Only the control pipe exists until the device is configured */
+		endpoint = _findEndpoint(device, in ? ep | epDIR_IN : ep);
+		if (!endpoint || !device->configuration)
+			return rslTIMEOUT;
+		result = in ? _dataIn(device, endpoint, data, length) : _dataOut(device, endpoint, received);
+	}
+
+	if (result == rslNAK)
+		device->stats.naks++;
+	else if (result == rslSTALL)
+		device->stats.stalls++;
+	return result;
+}
+
+static void _busReset(MaxSimPort * port) {
+	VirtualDevice * device = (VirtualDevice *) port;
+
+	device->address = 0;
+	device->newAddress = 0;
+	device->configuration = 0;
+	device->controlStalled = false;
+}
+
+/* Check the injected faults for a token. Returns true with the result if one hits */
+static bool _fault(VirtualDevice * device, uint_fast8_t token, uint_fast8_t ep, uint_fast8_t * result) {
+	VirtualFault * fault;
+	uint_fast8_t it;
+
+	for (it = 0; it < device->faultCount; it++) {
+		fault = &device->faults[it];
+		if (!fault->count || (fault->token != VDEV_ANY_TOKEN && fault->token != token))
+			continue;
+		if ((fault->ep & 0x0F) != (ep & 0x0F) || ((ep & 0x0F) && (fault->ep & epDIR_IN) != (ep & epDIR_IN)))
+			continue;
+		if (fault->skip) {
+			fault->skip--;
+			return false;
+		}
+		if (fault->count != VDEV_FOREVER)
+			fault->count--;
+		device->stats.faults++;
+		*result = fault->result;
+		return true;
+	}
+	return false;
+}
+
+/* Count down the NAKs before a packet. Returns true if this token is to be NAK'd */
+static bool _delay(uint8_t * naksLeft, uint8_t delay) {
+	if (*naksLeft) {
+		(*naksLeft)--;
+		return true;
+	}
+	*naksLeft = delay;
+	return false;
+}
+
+/* A SETUP is always ACK'd; requests the device doesn't know STALL in the next stage */
+static uint_fast8_t _setup(VirtualDevice * device, uint8_t const * data) {
+	VirtualDescriptors const * descriptors = device->descriptors;
+	uint8_t const * config = descriptors->configuration;
+	uint_fast8_t type = data[3], index = data[4];
+	uint_fast16_t length = data[6] | (data[7] << 8);
+
+	memcpy(device->setup, data, sizeof(device->setup));
+	device->response = NULL;
+	device->responseLength = 0;
+	device->responseSent = 0;
+	device->controlStalled = false;
+	device->controlNaksLeft = device->controlDelay;
+	device->stats.setups++;
+
+	switch (data[1] | (data[0] << 8)) {
+	case reqGET_DESCRIPTOR | (REQUEST_DEVICE_IN << 8):
+		if (type == descDEVICE) {
+			device->response = descriptors->device;
+			device->responseLength = DEVICE_DESCRIPTOR_LENGTH;
+		}
+		else if (type == descCONFIGURATION) {
+			device->response = config;
+			device->responseLength = config[2] | (config[3] << 8);
+		}
+		break;
+	case reqGET_DESCRIPTOR | (REQUEST_INTERFACE_IN << 8):
+		if (type == descHID_REPORT && index < VDEV_MAX_INTERFACES && descriptors->reports[index]) {
+			device->response = descriptors->reports[index];
+			device->responseLength = descriptors->reportLengths[index];
+		}
+		else if (type == descHID && (device->response = _findHidDescriptor(device, index)) != NULL) {
+			device->responseLength = device->response[0];
+		}
+		break;
+	case reqGET_STATUS | (REQUEST_DEVICE_IN << 8):
+	case reqGET_STATUS | (REQUEST_INTERFACE_IN << 8):
+	case reqGET_STATUS | (REQUEST_ENDPOINT_IN << 8):
+		device->reply[0] = device->reply[1] = 0;
+		device->response = device->reply;
+		device->responseLength = 2;
+		break;
+	case reqGET_CONFIGURATION | (REQUEST_DEVICE_IN << 8):
+		device->reply[0] = device->configuration;
+		device->response = device->reply;
+		device->responseLength = 1;
+		break;
+	case reqSET_ADDRESS | (REQUEST_DEVICE_OUT << 8):
+	case reqSET_CONFIGURATION | (REQUEST_DEVICE_OUT << 8):
+	case reqCLEAR_FEATURE | (REQUEST_ENDPOINT_OUT << 8):
+	case reqHID_SET_REPORT | (REQUEST_CLASS_OUT << 8):
+	case reqHID_SET_IDLE | (REQUEST_CLASS_OUT << 8):
+	case reqHID_SET_PROTOCOL | (REQUEST_CLASS_OUT << 8):
+		return rslSUCCES;
+	default:
+		break;
+	}
+
+	if (device->response)
+		device->responseLength = MIN(device->responseLength, length);
+	else
+		device->controlStalled = true;
+	return rslSUCCES;
+}
+
+/* Send the next bMaxPacketSize0 piece of the response */
+static uint_fast8_t _controlIn(VirtualDevice * device, uint8_t * data, uint_fast8_t * length) {
+	uint_fast8_t chunk;
+
+	if (device->controlStalled)
+		return rslSTALL;
+	if (_delay(&device->controlNaksLeft, device->controlDelay))
+		return rslNAK;
+
+	chunk = MIN(device->responseLength - device->responseSent, device->descriptors->device[7]);
+	if (chunk)
+		memcpy(data, device->response + device->responseSent, chunk);
+	device->responseSent += chunk;
+	*length = chunk;
+
+	device->stats.inPackets++;
+	device->stats.inBytes += chunk;
+	return rslSUCCES;
+}
+
+/* The status stage of a request without data (or with OUT data) finished */
+static void _status(VirtualDevice * device) {
+	VirtualEndpoint * endpoint;
+
+	switch (device->setup[1] | (device->setup[0] << 8)) {
+	case reqSET_ADDRESS | (REQUEST_DEVICE_OUT << 8):
+		device->address = device->setup[2] & 0x7F;
+		break;
+	case reqSET_CONFIGURATION | (REQUEST_DEVICE_OUT << 8):
+		device->configuration = device->setup[2];
+		break;
+	case reqCLEAR_FEATURE | (REQUEST_ENDPOINT_OUT << 8):
+		endpoint = _findEndpoint(device, device->setup[4]);
+		if (endpoint)
+			endpoint->naksLeft = endpoint->ackDelay;
+		break;
+	default:
+		break;
+	}
+}
+
+static uint_fast8_t _dataIn(VirtualDevice * device, VirtualEndpoint * endpoint, uint8_t * data, uint_fast8_t * length) {
+	uint_fast8_t it;
+
+	if (!endpoint->stream && !endpoint->queueCount)
+		return rslNAK;
+	if (_delay(&endpoint->naksLeft, endpoint->ackDelay))
+		return rslNAK;
+
+	if (endpoint->stream) {
+		for (it = 0; it < endpoint->maxPacketSize; it++) {
+			data[it] = device->streamValue;
+			device->streamValue = (device->streamValue + 1) % 10;
+		}
+		*length = endpoint->maxPacketSize;
+	}
+	else {
+		*length = endpoint->queueLengths[endpoint->queueHead];
+		memcpy(data, endpoint->queue[endpoint->queueHead], *length);
+		endpoint->queueHead = (endpoint->queueHead + 1) % VDEV_QUEUE_SLOTS;
+		endpoint->queueCount--;
+	}
+
+	device->stats.inPackets++;
+	device->stats.inBytes += *length;
+	return rslSUCCES;
+}
+
+static uint_fast8_t _dataOut(VirtualDevice * device, VirtualEndpoint * endpoint, uint_fast8_t length) {
+	if (_delay(&endpoint->naksLeft, endpoint->ackDelay))
+		return rslNAK;
+
+	device->stats.outPackets++;
+	device->stats.outBytes += length;
+	return rslSUCCES;
+}
+
+static VirtualEndpoint * _findEndpoint(VirtualDevice * device, uint_fast8_t ep) {
+	uint_fast8_t it;
+
+	for (it = 0; it < device->endpointCount; it++) {
+		if (device->endpoints[it].address == ep)
+			return &device->endpoints[it];
+	}
+	return NULL;
+}
+
+/* The HID class descriptor that follows the descriptor of an interface */
+static uint8_t const * _findHidDescriptor(VirtualDevice const * device, uint_fast8_t interface) {
+	uint8_t const * config = device->descriptors->configuration;
+	uint_fast16_t offset, length = config[2] | (config[3] << 8);
+	bool inInterface = false;
+
+	for (offset = 0; offset + 1 < length && config[offset]; offset += config[offset]) {
+		if (config[offset + 1] == descINTERFACE)
+			inInterface = config[offset + 2] == interface;
+		else if (config[offset + 1] == descHID && inInterface)
+			return &config[offset];
+	}
+	return NULL;
+}
@@ -0,0 +1,185 @@
+#pragma once
+/*
+ * vdev.h
+ *
+ * Virtual USB devices for the MAX3421E model (max_sim.h): a descriptor set, a standard
+ * control pipe and endpoints that behave as scripted. Endpoints can be slow to ACK, NAK
+ * until a report is queued or stream test data, and faults (NAK, STALL, timeout) can be
+ * injected on any pipe. A few models of the devices we see in the field are included.
+ * Host-only, built with the model by host/CMakeLists.txt
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "max_sim.h"
+
+#define VDEV_MAX_INTERFACES     4
+#define VDEV_MAX_ENDPOINTS      6
+#define VDEV_MAX_FAULTS         4
+
+/* Reports an IN endpoint can hold before VDEV_queueReport refuses more */
+#define VDEV_QUEUE_SLOTS        4
+
+/* VirtualFault.count of a fault that never wears off */
+#define VDEV_FOREVER            0xFFFF
+
+/* VirtualFault.token of a fault that hits every token type */
+#define VDEV_ANY_TOKEN          0xFF
+
+/* The descriptors a device answers GET_DESCRIPTOR with; strings are not supported */
+typedef struct {
+	uint8_t const * device;                             /* 18 bytes */
+	uint8_t const * configuration;                      /* wTotalLength bytes */
+	uint8_t const * reports[VDEV_MAX_INTERFACES];       /* HID report descriptor by interface, or NULL */
+	uint16_t reportLengths[VDEV_MAX_INTERFACES];
+} VirtualDescriptors;
+
+/* Answer a number of tokens on a pipe with something else than the device would */
+typedef struct {
+	uint8_t ep;                 /* bEndpointAddress, 0 for the whole control pipe */
+	uint8_t token;              /* xfrSETUP, xfrIN, ... or VDEV_ANY_TOKEN */
+	uint8_t result;             /* rslNAK, rslSTALL, rslTIMEOUT, ... */
+	uint16_t skip;              /* matching tokens answered normally first */
+	uint16_t count;             /* matching tokens that get the fault, or VDEV_FOREVER */
+} VirtualFault;
+
+typedef struct {
+	uint8_t address;            /* bEndpointAddress */
+	uint8_t maxPacketSize;
+	uint8_t ackDelay;           /* NAKs before every packet */
+	uint8_t naksLeft;
+	bool stream;                /* IN: always has a full packet of the 0..9 test pattern */
+	uint8_t queue[VDEV_QUEUE_SLOTS][MAXSIM_FIFO_SIZE];
+	uint8_t queueLengths[VDEV_QUEUE_SLOTS];
+	uint8_t queueHead;
+	uint8_t queueCount;
+} VirtualEndpoint;
+
+typedef struct {
+	uint32_t setups;
+	uint32_t inPackets;         /* data packets sent to the host, control included */
+	uint32_t outPackets;        /* data packets received from the host */
+	uint32_t inBytes;
+	uint32_t outBytes;
+	uint32_t naks;
+	uint32_t stalls;
+	uint32_t faults;            /* tokens answered by an injected fault */
+} VirtualStats;
+
+typedef struct {
+	MaxSimPort port;            /* must stay first: the model hands this to MAXSIM_attach */
+	VirtualDescriptors const * descriptors;
+	uint8_t address;
+	uint8_t newAddress;         /* taken over after the status stage of SET_ADDRESS */
+	uint8_t configuration;
+
+	/* Control pipe */
+	uint8_t setup[8];
+	uint8_t const * response;
+	uint16_t responseLength;
+	uint16_t responseSent;
+	uint8_t reply[2];           /* GET_STATUS and GET_CONFIGURATION data */
+	bool controlStalled;
+	uint8_t controlDelay;       /* NAKs before every control data and status packet */
+	uint8_t controlNaksLeft;
+
+	uint8_t streamValue;
+	VirtualEndpoint endpoints[VDEV_MAX_ENDPOINTS];
+	uint8_t endpointCount;
+	VirtualFault faults[VDEV_MAX_FAULTS];
+	uint8_t faultCount;
+	VirtualStats stats;
+} VirtualDevice;
+
+/**
+ * Set up a device from a descriptor set. The endpoints are taken from the configuration
+ * descriptor; they answer NAK until a report is queued
+ *
+ * Parameters:
+ * VirtualDevice * device: the device to set up
+ * VirtualDescriptors const * descriptors: its descriptors, must stay valid
+ * uint_fast8_t speed: USB_SPEED_FULL or USB_SPEED_LOW
+ */
+void VDEV_init(VirtualDevice *, VirtualDescriptors const *, uint_fast8_t);
+
+/**
+ * Low-speed boot mouse with a wheel that is slow to ACK: every control packet and every
+ * report is NAK'd twice first
+ *
+ * Parameters:
+ * VirtualDevice * device: the device to set up
+ */
+void VDEV_initMouse(VirtualDevice *);
+
+/**
+ * Low-speed boot keyboard: the interrupt endpoint NAKs until a key report is queued
+ *
+ * Parameters:
+ * VirtualDevice * device: the device to set up
+ */
+void VDEV_initKeyboard(VirtualDevice *);
+
+/**
+ * Full-speed composite device: a keyboard, a mouse with media keys (report IDs) and a
+ * vendor bulk interface. Its long configuration and report descriptors are read in
+ * 8-byte packets
+ *
+ * Parameters:
+ * VirtualDevice * device: the device to set up
+ */
+void VDEV_initComposite(VirtualDevice *);
+
+/**
+ * Full-speed vendor device that streams the 0..9 test pattern on bulk IN endpoint 2 and
+ * takes whatever is sent to bulk OUT endpoint 1
+ *
+ * Parameters:
+ * VirtualDevice * device: the device to set up
+ */
+void VDEV_initBulk(VirtualDevice *);
+
+/**
+ * Queue a report on an IN endpoint; it is sent at the next IN token that is not NAK'd
+ *
+ * Parameters:
+ * VirtualDevice * device: the device
+ * uint_fast8_t ep: the bEndpointAddress
+ * uint8_t const * data: the report
+ * uint_fast8_t length: its length, at most the endpoint's wMaxPacketSize
+ *
+ * Returns:
+ * bool: false if the endpoint does not exist or its queue is full
+ */
+bool VDEV_queueReport(VirtualDevice *, uint_fast8_t, uint8_t const *, uint_fast8_t);
+
+/**
+ * Make an endpoint slow: NAK a number of times before every packet
+ *
+ * Parameters:
+ * VirtualDevice * device: the device
+ * uint_fast8_t ep: the bEndpointAddress, 0 for the control pipe
+ * uint_fast8_t naks: the NAKs before every packet
+ */
+void VDEV_setDelay(VirtualDevice *, uint_fast8_t, uint_fast8_t);
+
+/**
+ * Inject a fault. Faults are checked in the order they were added
+ *
+ * Parameters:
+ * VirtualDevice * device: the device
+ * VirtualFault const * fault: the fault (copied)
+ *
+ * Returns:
+ * bool: false if the fault table is full
+ */
+bool VDEV_injectFault(VirtualDevice *, VirtualFault const *);
+
+/**
+ * Get the device-side counters
+ *
+ * Parameters:
+ * VirtualDevice const * device: the device
+ * VirtualStats * result: filled in with a copy of the counters
+ */
+void VDEV_getStats(VirtualDevice const *, VirtualStats *);